@@ -0,0 +1,59 @@
+#!/bin/bash
+# Times two PepteamMap builds on the same inputs and checks that they produce
+# the same mapping file.
+#    usage: benchmark_map.sh reference-PepteamMap candidate-PepteamMap pepTree-query-file pepTree-subject-file cutoff [runs] [PepteamMap options]
+
+if [ $# -lt 5 ]; then
+	echo "usage: $0 reference-PepteamMap candidate-PepteamMap pepTree-query-file pepTree-subject-file cutoff [runs] [PepteamMap options]" >&2
+	exit 1
+fi
+
+reference=$1
+candidate=$2
+query=$3
+subject=$4
+cutoff=$5
+runs=${6:-3}
+shift $(( $# < 6 ? $# : 6 ))
+options=("$@")
+
+# Same naming as PepteamMap, the matrix preceding the cutoff when it is not PAM30
+matrix=
+for (( o = 0; o + 1 < ${#options[@]}; ++o )); do
+	if [ "${options[o]}" = "--matrix" ]; then
+		matrix=${options[o+1]}
+	fi
+done
+case "${matrix,,}" in
+	""|pam30) matrix= ;;
+	blosum62) matrix=blosum62. ;;
+	*)        matrix=${matrix##*/}. ;;
+esac
+mapping=$(awk -v q="$query" -v m="$matrix" -v c="$cutoff" 'BEGIN { i = int( c ); printf "%s.mapping.%s%d_%d", q, m, i, int( 100*(c - i) ) }')
+
+# Best wall clock time in seconds over the runs, the last mapping file being kept as $2
+bench() {
+	local best=
+	for (( r = 0; r < runs; ++r )); do
+		local start=$(date +%s%N)
+		"$1" "${options[@]}" "$query" "$subject" "$cutoff" > /dev/null || exit 1
+		local elapsed=$(( $(date +%s%N) - start ))
+		if [ -z "$best" ] || [ $elapsed -lt $best ]; then
+			best=$elapsed
+		fi
+	done
+	mv "$mapping" "$2"
+	echo $best
+}
+
+ref=$(bench "$reference" "$mapping.reference")
+cand=$(bench "$candidate" "$mapping.candidate")
+
+awk -v r=$ref -v c=$cand 'BEGIN { printf "reference: %.3fs  candidate: %.3fs  speedup: %.2fx\n", r/1e9, c/1e9, r/c }'
+if cmp -s "$mapping.reference" "$mapping.candidate"; then
+	echo "identical mapping output"
+	rm -f "$mapping.reference" "$mapping.candidate"
+else
+	echo "mapping outputs differ: $mapping.reference $mapping.candidate"
+	exit 2
+fi
@@ -6,6 +6,7 @@
 #include <cstdint>
 #include <limits>
 #include <stdexcept>
+#include <algorithm>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -14,6 +15,7 @@
 #include <unistd.h>
 
 #include "FastIdx.hpp"
+#include "ThreadPool.hpp"
 
 using namespace std;
 
@@ -32,76 +34,334 @@ MemFastIdx::MemFastIdx( vector< string > const & proteinsName
 		};
 
 		for ( size_t i = 0, e = proteinsName.size(); i != e; ++i ) {
-				auto snPos  = ConcatInVector( names, proteinsName[i] );
-				if ( snPos > numeric_limits<uint32_t>::max() ) {
-						throw std::runtime_error{ "Protein name index overflow, abording" };
-				}
-				indices.push_back( static_cast< uint32_t >( snPos ) );
-				auto seqPos = ConcatInVector( sequences, proteinsSeq[i] );
-				if ( seqPos > numeric_limits<uint32_t>::max() ) {
-						throw std::runtime_error{ "Protein sequence index overflow, abording" };
-				}
-				indices.push_back( static_cast< uint32_t >(  seqPos ) );
+				indices.push_back( ConcatInVector( names    , proteinsName[i] ) );
+				indices.push_back( ConcatInVector( sequences, proteinsSeq[i]  ) );
 		}
 }
 
-static auto const indicesOffset = static_cast< uint32_t >( 2 * sizeof( uint32_t ) );
+static size_t const indicesOffsetV1 = 2 * sizeof( uint32_t );
+static size_t const indicesOffsetV2 = 2 * sizeof( uint32_t ) + 2 * sizeof( uint64_t );
+
+namespace {
+
+	// Writes the header of an index of the given sections sizes, returns whether the
+	// indices are to be written on 64 bits (version 2)
+	bool WriteHeader( FILE * file, size_t nbIndices, size_t namesSize, size_t sequencesSize, bool forceWide ) {
+			bool wide = forceWide
+			         || indicesOffsetV1 + nbIndices * sizeof( uint32_t ) + namesSize + sequencesSize > numeric_limits< uint32_t >::max();
+			if ( wide ) {
+					uint64_t snOffset  = indicesOffsetV2 + nbIndices * sizeof( uint64_t );
+					uint64_t seqOffset = snOffset        + namesSize;
+
+					uint32_t arr[] = { 0, FastIdxFormat::currentVersion };
+					memcpy( arr, FastIdxFormat::magic, sizeof( FastIdxFormat::magic ) );
+					uint64_t offsets[] = { snOffset, seqOffset };
+					fwrite( arr    , sizeof( arr[0] )    , sizeof( arr ) / sizeof( arr[0] )        , file );
+					fwrite( offsets, sizeof( offsets[0] ), sizeof( offsets ) / sizeof( offsets[0] ), file );
+			} else {
+					auto snOffset  = static_cast< uint32_t >( indicesOffsetV1 + nbIndices * sizeof( uint32_t ) );
+					auto seqOffset = static_cast< uint32_t >( snOffset        + namesSize );
+
+					uint32_t arr[] = { snOffset, seqOffset };
+					fwrite( arr, sizeof( arr[0] ), sizeof( arr ) / sizeof( arr[0] ), file );
+			}
+			return wide;
+	}
+
+	// Writes indices on 32 or 64 bits, adding the bases to the names and sequences offsets
+	void WriteIndices( FILE * file, vector< uint64_t > const & indices, uint64_t namesBase, uint64_t sequencesBase, bool wide ) {
+			if ( wide ) {
+					vector< uint64_t > out( indices.size() );
+					for ( size_t i = 0, e = out.size(); i != e; i += 2 ) {
+							out[i]   = namesBase     + indices[i];
+							out[i+1] = sequencesBase + indices[i+1];
+					}
+					fwrite( out.data(), sizeof( out.front() ), out.size(), file );
+			} else {
+					vector< uint32_t > out( indices.size() );
+					for ( size_t i = 0, e = out.size(); i != e; i += 2 ) {
+							out[i]   = static_cast< uint32_t >( namesBase     + indices[i] );
+							out[i+1] = static_cast< uint32_t >( sequencesBase + indices[i+1] );
+					}
+					fwrite( out.data(), sizeof( out.front() ), out.size(), file );
+			}
+	}
+
+}
 
-void MemFastIdx::Write( FILE * file ) const {
+void MemFastIdx::Write( FILE * file, bool forceWide ) const {
 		auto const & indices   = GetIndices();
 		auto const & names     = GetNames();
 		auto const & sequences = GetSequences();
 
-		auto snOffset  = static_cast< uint32_t >( indicesOffset + indices.size() * sizeof( indices.front() ) );
-		auto seqOffset = static_cast< uint32_t >( snOffset      + names.size()   * sizeof( names.front() ) );
-
-		uint32_t arr[] = { snOffset, seqOffset };
-		fwrite( arr, sizeof( arr[0] ), sizeof( arr ) / sizeof( arr[0] ), file );
-		fwrite( indices.data(), sizeof( indices.front() ), indices.size(), file );
+		bool wide = WriteHeader( file, indices.size(), names.size(), sequences.size(), forceWide );
+		WriteIndices( file, indices, 0, 0, wide );
 		fwrite( names.data(), sizeof( names.front() ), names.size(), file );
 		fwrite( sequences.data(), sizeof( sequences.front() ), sequences.size(), file );
 }
 
 MMappedFastIdx::MMappedFastIdx( const char * filename )
-	: fd( open( filename, O_RDONLY ) ) {
-		if ( !fd ) {
-				throw std::runtime_error{ "Unable to open input FastIdx file\n" };
+	: fd( open( filename, O_RDONLY ) )
+	, fileSize( 0 )
+	, ptr( nullptr ) {
+		if ( fd < 0 ) {
+				throw std::runtime_error{ string{ "Unable to open input FastIdx file \"" } + filename + '"' };
 		}
 		struct stat fStat;
 		fstat( fd, &fStat );
-		fileSize = static_cast< uint32_t >( fStat.st_size );
+		fileSize = static_cast< size_t >( fStat.st_size );
+		if ( fileSize < indicesOffsetV1 ) {
+				close( fd );
+				throw std::runtime_error{ string{ "Invalid FastIdx file \"" } + filename + "\", abording" };
+		}
 		ptr = static_cast< char const * >( mmap( nullptr, fileSize, PROT_READ, MAP_SHARED, fd, 0 ) );
+
+		auto header = reinterpret_cast< uint32_t const * >( ptr );
+		if ( memcmp( ptr, FastIdxFormat::magic, sizeof( FastIdxFormat::magic ) ) != 0 ) {   // version 1 has no magic number
+				version         = 1;
+				indicesOffset   = indicesOffsetV1;
+				namesOffset     = header[0];
+				sequencesOffset = header[1];
+		} else {
+				version = header[1];
+				if ( version != FastIdxFormat::currentVersion || fileSize < indicesOffsetV2 ) {
+						throw std::runtime_error{ string{ "Unsupported FastIdx file version in \"" } + filename + "\", abording" };
+				}
+				auto offsets = reinterpret_cast< uint64_t const * >( ptr + 2 * sizeof( uint32_t ) );
+				indicesOffset   = indicesOffsetV2;
+				namesOffset     = offsets[0];
+				sequencesOffset = offsets[1];
+		}
 }
 
 MMappedFastIdx::~MMappedFastIdx() {
 		close( fd );
 }
 
-size_t MMappedFastIdx::Size() const {
-		return GetIndicesSize()/2;
+bool MMappedFastIdx::Preload( bool lock ) const {
+		if ( lock && mlock( ptr, fileSize ) == 0 ) {   // locking faults the pages in
+				return true;
+		}
+		madvise( const_cast< char * >( ptr ), fileSize, MADV_WILLNEED );
+		size_t pageSize = static_cast< size_t >( sysconf( _SC_PAGESIZE ) );
+		char volatile touched = 0;
+		for ( size_t i = 0; i < fileSize; i += pageSize ) {
+				touched = ptr[i];
+		}
+		(void)touched;
+		return !lock;
 }
 
-uint32_t const * MMappedFastIdx::GetIndicesData() const {
-		return reinterpret_cast< uint32_t const * >( ptr + indicesOffset );
+size_t MMappedFastIdx::Size() const {
+		return GetIndicesSize()/2;
 }
 
 size_t MMappedFastIdx::GetIndicesSize() const {
-		return (reinterpret_cast< uint32_t const * >( ptr )[0] - indicesOffset)/sizeof( uint32_t );
+		return (namesOffset - indicesOffset)/(IsWide() ? sizeof( uint64_t ) : sizeof( uint32_t ));
 }
 
 char const * MMappedFastIdx::GetNamesData() const {
-		return ptr + reinterpret_cast< uint32_t const * >( ptr )[0];
+		return ptr + namesOffset;
 }
 
 size_t MMappedFastIdx::GetNamesSize() const {
-		uint32_t const * tmp = reinterpret_cast< uint32_t const * >( ptr );
-		return tmp[1] - tmp[0];
+		return sequencesOffset - namesOffset;
 }
 
 char const * MMappedFastIdx::GetSequencesData() const {
-		return ptr + reinterpret_cast< uint32_t const * >( ptr )[1];
+		return ptr + sequencesOffset;
 }
 
 size_t MMappedFastIdx::GetSequencesSize() const {
-		return fileSize - reinterpret_cast< uint32_t const * >( ptr )[1];
+		return fileSize - sequencesOffset;
+}
+
+FastaIndexer::FastaIndexer( char const * filename )
+	: fd( open( filename, O_RDONLY ) )
+	, fileSize( 0 )
+	, ptr( nullptr ) {
+		if ( fd < 0 ) {
+				throw std::runtime_error{ string{ "Unable to open input file \"" } + filename + '"' };
+		}
+		struct stat fStat;
+		fstat( fd, &fStat );
+		fileSize = static_cast< size_t >( fStat.st_size );
+		if ( fileSize != 0 ) {
+				void * p = mmap( nullptr, fileSize, PROT_READ, MAP_SHARED, fd, 0 );
+				if ( p == MAP_FAILED ) {
+						close( fd );
+						throw std::runtime_error{ string{ "Unable to map input file \"" } + filename + '"' };
+				}
+				ptr = static_cast< char const * >( p );
+				madvise( p, fileSize, MADV_SEQUENTIAL );
+		}
+}
+
+FastaIndexer::~FastaIndexer() {
+		if ( ptr ) {
+				munmap( const_cast< char * >( ptr ), fileSize );
+		}
+		close( fd );
+}
+
+// First '>' at or after p starting a new record, i.e. following a non empty line which
+// is not a header: the parser is then necessarily between two sequences, whatever
+// came before
+char const * FastaIndexer::NextRecordStart( char const * p ) const {
+		char const * end = ptr + fileSize;
+		while ( p < end ) {
+				auto nl = static_cast< char const * >( memchr( p, '\n', end - p ) );
+				if ( !nl || nl + 1 == end ) {
+						return end;
+				}
+				if ( nl[1] == '>' ) {
+						auto prevNl = static_cast< char const * >( memrchr( ptr, '\n', nl - ptr ) );
+						char const * lineStart = prevNl ? prevNl + 1 : ptr;
+						if ( lineStart != nl && *lineStart != '>' ) {
+								return nl + 1;
+						}
+				}
+				p = nl + 1;
+		}
+		return end;
+}
+
+size_t FastaIndexer::Parse( size_t nbThreads ) {
+		static size_t const minChunkSize = 1 << 20;
+		nbThreads = max< size_t >( nbThreads, 1 );
+		size_t nbChunks = min( 4*nbThreads, fileSize / minChunkSize + 1 );
+		if ( nbThreads == 1 ) {
+				nbChunks = 1;
+		}
+
+		chunks.assign( nbChunks, Chunk{} );
+		char const * begin = ptr;
+		for ( size_t i = 0; i != nbChunks; ++i ) {
+				char const * end = i+1 == nbChunks ? ptr + fileSize
+				                                   : max( begin, NextRecordStart( ptr + (i+1)*fileSize/nbChunks ) );
+				chunks[i].begin = begin;
+				chunks[i].end   = end;
+				begin = end;
+		}
+
+		WorkStealingPool pool( nbThreads );
+		pool.Run( nbChunks, [&]( size_t, size_t i ) {
+				ParseChunk( chunks[i], i == 0, i+1 == nbChunks );
+		});
+
+		size_t nbSequences = 0, lineNumber = 0;
+		for ( auto const & chunk : chunks ) {
+				for ( auto l : chunk.emptyLines ) {
+						fprintf( stderr, "      warning: suspicious new line at line number %zu; continuing\n", lineNumber + l + 1 );
+				}
+				lineNumber  += chunk.nbLines;
+				nbSequences += chunk.indices.size() / 2;
+		}
+		return nbSequences;
+}
+
+// Line based version of the historical character state machine
+void FastaIndexer::ParseChunk( Chunk & chunk, bool first, bool last ) const {
+		enum class ReadingState { Start, NewLineFromSeq, Header, Sequence };
+		ReadingState readingState = ReadingState::Start;
+		size_t nameStart = 0, seqStart = 0;
+
+		auto StartRecord = [&]() {
+				readingState = ReadingState::Header;
+				nameStart = chunk.names.size();
+		};
+		auto ProcessSequence = [&]() {
+				chunk.indices.push_back( nameStart );
+				chunk.indices.push_back( seqStart );
+				chunk.sequences.push_back( '\0' );
+		};
+
+		char const * p = chunk.begin;
+		if ( !first && p != chunk.end ) {   // chunks other than the first one start on a '>'
+				++p;
+				StartRecord();
+		}
+		while ( p != chunk.end ) {
+				auto nl = static_cast< char const * >( memchr( p, '\n', chunk.end - p ) );
+				char const * lineEnd = nl ? nl : chunk.end;
+
+				if ( readingState == ReadingState::Start ) {
+						for ( ; p != lineEnd && *p != '>'; ++p ) {
+								fprintf( stderr, "Invalid '%c' character at start of file, was expecting '>'\n", *p );
+						}
+						if ( p != lineEnd ) {
+								++p;
+								StartRecord();
+						}
+				} else if ( readingState == ReadingState::NewLineFromSeq ) {
+						if ( p == lineEnd ) {
+								if ( nl ) {
+										chunk.emptyLines.push_back( chunk.nbLines + 1 );
+								}
+						} else if ( *p == '>' ) {
+								ProcessSequence();
+								++p;
+								StartRecord();
+						} else {
+								readingState = ReadingState::Sequence;
+						}
+				}
+
+				if ( readingState == ReadingState::Header ) {
+						chunk.names.insert( chunk.names.end(), p, lineEnd );
+						if ( nl ) {
+								chunk.names.push_back( '\0' );
+								readingState = ReadingState::Sequence;
+								seqStart = chunk.sequences.size();
+						}
+				} else if ( readingState == ReadingState::Sequence ) {
+						chunk.sequences.insert( chunk.sequences.end(), p, lineEnd );
+						if ( nl ) {
+								readingState = ReadingState::NewLineFromSeq;
+						}
+				}
+
+				if ( !nl ) {
+						break;
+				}
+				++chunk.nbLines;
+				p = nl + 1;
+		}
+
+		// A record is complete at the end of a chunk followed by another one, the last
+		// record of the file is only kept if it has some sequence
+		bool const hasSequence = chunk.sequences.size() != seqStart;
+		if ( readingState == ReadingState::Sequence || readingState == ReadingState::NewLineFromSeq ) {
+				if ( !last || hasSequence ) {
+						ProcessSequence();
+				} else {
+						chunk.names.resize( nameStart );
+				}
+		} else if ( readingState == ReadingState::Header ) {
+				chunk.names.resize( nameStart );
+		}
+}
+
+void FastaIndexer::Write( FILE * file, bool forceWide ) const {
+		size_t nbIndices = 0, namesSize = 0, sequencesSize = 0;
+		for ( auto const & chunk : chunks ) {
+				nbIndices     += chunk.indices.size();
+				namesSize     += chunk.names.size();
+				sequencesSize += chunk.sequences.size();
+		}
+
+		bool wide = WriteHeader( file, nbIndices, namesSize, sequencesSize, forceWide );
+
+		uint64_t namesBase = 0, sequencesBase = 0;
+		for ( auto const & chunk : chunks ) {
+				WriteIndices( file, chunk.indices, namesBase, sequencesBase, wide );
+				namesBase     += chunk.names.size();
+				sequencesBase += chunk.sequences.size();
+		}
+		for ( auto const & chunk : chunks ) {
+				fwrite( chunk.names.data(), 1, chunk.names.size(), file );
+		}
+		for ( auto const & chunk : chunks ) {
+				fwrite( chunk.sequences.data(), 1, chunk.sequences.size(), file );
+		}
 }
@@ -6,6 +6,20 @@
 #include <vector>
 #include <tuple>
 
+// ~~~ FastIdx files ~~~ //
+// Version 1 (legacy, no magic number):
+//    [namesOffset:u32][sequencesOffset:u32][(nameOffset:u32, sequenceOffset:u32)...][names][sequences]
+// Version 2, for indexes over 4 GB:
+//    ["FIDX"][version:u32][namesOffset:u64][sequencesOffset:u64][(nameOffset:u64, sequenceOffset:u64)...][names][sequences]
+// names and sequences being NUL terminated.  Writers only use version 2 when the index
+// does not fit version 1 (or when asked to), readers map both.
+namespace FastIdxFormat {
+
+	char     const magic[4]       = { 'F', 'I', 'D', 'X' };   // never a valid version 1 names offset (not a multiple of 8)
+	uint32_t const currentVersion = 2;
+
+} // namespace FastIdxFormat
+
 class MemFastIdx {
 	public:
 		MemFastIdx( std::vector< std::string > const & proteinsName
@@ -13,10 +27,10 @@ class MemFastIdx {
                 );
 
 	public:
-		void Write( FILE * file ) const;
+		void Write( FILE * file, bool forceWide = false ) const;
 
 	private:
-		typedef std::tuple< std::vector< uint32_t >
+		typedef std::tuple< std::vector< uint64_t >
 		                  , std::vector< char >
 		                  , std::vector< char >
 		                  > LinearizedProtIdx;
@@ -25,8 +39,8 @@ class MemFastIdx {
 		LinearizedProtIdx idx;
 
 	private:
-		std::vector< uint32_t >       & GetIndices()       {   return std::get< 0 >( idx );   }
-		std::vector< uint32_t > const & GetIndices() const {   return std::get< 0 >( idx );   }
+		std::vector< uint64_t >       & GetIndices()       {   return std::get< 0 >( idx );   }
+		std::vector< uint64_t > const & GetIndices() const {   return std::get< 0 >( idx );   }
 
 		std::vector< char >       & GetNames()       {   return std::get< 1 >( idx );   }
 		std::vector< char > const & GetNames() const {   return std::get< 1 >( idx );   }
@@ -42,24 +56,92 @@ class MMappedFastIdx {
 		~MMappedFastIdx();
 
 	public:
-		size_t           Size() const;
+		// Faults every page of the file in and, with lock, locks them in memory; false when
+		// they could not be locked (they are faulted in all the same)
+		bool Preload( bool lock ) const;
+
+		size_t FileSize() const {   return fileSize;   }
+
+		uint32_t Version() const {   return version;   }
+
+		bool IsWide() const {   return version >= 2;   }
+
+		size_t       Size() const;
+
+		size_t       GetIndicesSize() const;
+
+		char const * GetNamesData() const;
+		size_t       GetNamesSize() const;
+
+		char const * GetSequencesData() const;
+		size_t       GetSequencesSize() const;
+
+		size_t GetNameOffset    ( size_t index ) const {   return GetIndex( 2*index   );   }
+		size_t GetSequenceOffset( size_t index ) const {   return GetIndex( 2*index+1 );   }
+
+		char const * GetName    ( size_t index ) const {   return GetNamesData    () + GetNameOffset    ( index );   }
+		char const * GetSequence( size_t index ) const {   return GetSequencesData() + GetSequenceOffset( index );   }
+
+	private:
+		int          fd;
+		size_t       fileSize;
+		char const * ptr;
+
+		uint32_t version;
+		size_t   indicesOffset;
+		size_t   namesOffset;
+		size_t   sequencesOffset;
+
+	private:
+		size_t GetIndex( size_t i ) const {
+				return IsWide() ? reinterpret_cast< uint64_t const * >( ptr + indicesOffset )[i]
+				                : reinterpret_cast< uint32_t const * >( ptr + indicesOffset )[i];
+		}
+};
+
+// Creates a FastIdx straight from a FASTA file.  The file is mapped in memory and cut
+// into chunks at record boundaries, each chunk being parsed (possibly concurrently)
+// into its own names and sequences sections; Write() then lays the chunks sections
+// one after the other, only rebasing the indices.
+class FastaIndexer {
+	public:
+		explicit FastaIndexer( char const * filename );
 
-		uint32_t const * GetIndicesData() const;
-		size_t           GetIndicesSize() const;
+		~FastaIndexer();
 
-		char const     * GetNamesData() const;
-		size_t           GetNamesSize() const;
+		FastaIndexer( FastaIndexer const & ) = delete;
+		FastaIndexer & operator=( FastaIndexer const & ) = delete;
 
-		char const     * GetSequencesData() const;
-		size_t           GetSequencesSize() const;
+	public:
+		// Returns the number of sequences found
+		size_t Parse( size_t nbThreads );
 
-		char const * GetName    ( size_t index ) const {   return GetNamesData    () + GetIndicesData()[ 2*index   ];   }
-		char const * GetSequence( size_t index ) const {   return GetSequencesData() + GetIndicesData()[ 2*index+1 ];   }
+		void Write( FILE * file, bool forceWide = false ) const;
 
 	private:
-		int fd;
-		uint32_t fileSize;
+		struct Chunk {
+				char const * begin;
+				char const * end;
+
+				std::vector< uint64_t > indices;     // relative to the chunk sections
+				std::vector< char >     names;
+				std::vector< char >     sequences;
+
+				size_t                nbLines = 0;
+				std::vector< size_t > emptyLines;   // relative to the chunk first line
+		};
+
+	private:
+		int          fd;
+		size_t       fileSize;
 		char const * ptr;
+
+		std::vector< Chunk > chunks;
+
+	private:
+		char const * NextRecordStart( char const * p ) const;
+
+		void ParseChunk( Chunk & chunk, bool first, bool last ) const;
 };
 
 #endif
@@ -1,22 +1,30 @@
 #include <cstdio>
-#include <cassert>
 #include <string>
 #include <sstream>
 #include <vector>
 #include <chrono>
 #include <cstring>
 #include <cstdint>
+#include <cstdlib>
 #include <stdexcept>
 
 #include "FastIdx.hpp"
+#include "Reads.hpp"
 
 using namespace std;
 
 void UsageError( char * argv[] ) {
 		fprintf( stderr
-		       , "Usage: %s -* input-file\n"
+		       , "Usage: %s [-j threads] [--v2] [--flanks left,right] [--min-quality q] [--amber-q] -* input-file\n"
 		         "   where * is one of:\n"
-		         "     c -> create the protein index from input fasta file\n"
+		         "     c -> create the protein index from input fasta file (parsed with the given number of threads)\n"
+		         "          --v2 forces the 64 bits file format, otherwise only used for indexes over 4 GB\n"
+		         "     n -> create the peptide index from input nucleotide reads (FASTQ or FASTA, gzipped or not)\n"
+		         "          the insert of every read, between the --flanks constant sequences (the whole read\n"
+		         "          without them), is translated in frame; reads without insert, with ambiguous bases,\n"
+		         "          out of frame, with a base under --min-quality (FASTQ) or a stop codon are dropped\n"
+		         "          (--amber-q translates TAG as Q), the others collapsed into distinct peptides\n"
+		         "          named \"pep<rank>;size=<reads>\", for PepTree --abundances\n"
 		         "     s -> print the number of proteins in the index\n"
 		         "     p -> print the index in human 'interpretable' format\n"
 		       , argv[ 0 ]
@@ -24,86 +32,64 @@ void UsageError( char * argv[] ) {
 		exit( 1 );
 }
 
-FILE * OpenInputFile( char const * filename ) {
-		FILE * inputFile = fopen( filename, "rb" );
-		if ( !inputFile ) {
-				fprintf( stderr, "Unable to open input file \"%s\"\n", filename );
-				exit( 1 );
-		}
-		return inputFile;
-}
+void IndexCreation( char const * filename, size_t nbThreads, bool forceWide ) {
+		try {
+				printf( "Indexing \"%s\"...\n", filename );
+				auto startTimer = chrono::high_resolution_clock::now();
 
-void IndexCreation( char * argv[] ) {
-		char const * filename = argv[ 2 ];
-		FILE * inputFile = OpenInputFile( filename );
-
-		auto proteinsName = vector< string >{};
-		auto proteinsSeq  = vector< string >{};
-		auto ProcessSequence = [ & ]( string && name, string && seq ) {
-				proteinsName.push_back( move( name ) );
-				proteinsSeq.push_back( move( seq ) );
-		};
-
-		printf( "Indexing \"%s\"...\n", filename );
-
-		enum class ReadingState { Start, NewLineFromSeq, Header, Sequence };
-		ReadingState readingState = ReadingState::Start;
-		size_t lineNumber = 0, nbSeqProcessed = 0;
-		string text, name;
-		auto startTimer = chrono::high_resolution_clock::now();
-		for ( char c; (c = fgetc_unlocked( inputFile )) != EOF; ) {
-				if ( readingState == ReadingState::Start ) {
-						if ( c != '>' ) {
-								fprintf( stderr, "Invalid '%c' character at start of file, was expecting '>'\n", c );
-						} else {
-								readingState = ReadingState::Header;
-						}
-				} else if ( c == '>' && readingState == ReadingState::NewLineFromSeq ) {
-						readingState = ReadingState::Header;
-
-						ProcessSequence( move( name ), move( text ) );
-						++nbSeqProcessed;
-						text = string{};
-				} else if ( c == '\n' ) {
-						++lineNumber;
-						switch ( readingState ) {
-							case ReadingState::NewLineFromSeq: {
-									fprintf( stderr, "      warning: suspicious new line at line number %zu; continuing\n", lineNumber + 1 );
-								} break;
-	
-							case ReadingState::Header: {
-									readingState = ReadingState::Sequence;
-									name = move( text );
-									text = string{};
-								} break;
-	
-							case ReadingState::Sequence: {
-									readingState = ReadingState::NewLineFromSeq;
-								} break;
-	
-							default: {
-								} assert( !"Should never get here!" );
-						}
-				} else {
-						if ( readingState == ReadingState::NewLineFromSeq ) {
-								readingState = ReadingState::Sequence;
-						}
-						text += c;
+				FastaIndexer indexer( filename );
+				size_t nbSeqProcessed = indexer.Parse( nbThreads );
+
+				auto finishTimer = chrono::high_resolution_clock::now();
+				auto elapsed1 = finishTimer - startTimer;
+				printf( "   ...indexed %zu sequence%s from input file in %ld seconds.\n"
+				      , nbSeqProcessed, nbSeqProcessed > 1 ? "s" : "", chrono::duration_cast< chrono::seconds >( elapsed1 ).count()
+				      );
+
+				printf( "Writting protein index structure...\n" );
+				startTimer = chrono::high_resolution_clock::now();
+
+				stringstream outputProtIdxFilenameStream;
+				outputProtIdxFilenameStream << filename << ".fastIdx";
+				FILE * outputProtIdxFile = fopen( outputProtIdxFilenameStream.str().c_str(), "wb" );
+				if ( !outputProtIdxFile ) {
+						fprintf( stderr, "Unable to open output file \"%s\"\n", outputProtIdxFilenameStream.str().c_str() );
+						exit( 1 );
 				}
+				indexer.Write( outputProtIdxFile, forceWide );
+				fclose( outputProtIdxFile );
+
+				finishTimer = chrono::high_resolution_clock::now();
+				auto elapsed2 = finishTimer - startTimer;
+				printf( "   ...written in %ld seconds.\n"
+				      , chrono::duration_cast< chrono::seconds >( elapsed2 ).count()
+				      );
+		} catch( std::exception & e ) {
+				fprintf( stderr, "%s\n", e.what() );
+				exit( 1 );
 		}
-		if ( readingState != ReadingState::Header && !text.empty() ) {
-				ProcessSequence( move( name ), move( text ) );
-				++nbSeqProcessed;
-		}
-		auto finishTimer = chrono::high_resolution_clock::now();
-		auto elapsed1 = finishTimer - startTimer;
-		printf( "   ...indexed %zu sequence%s from input file in %ld seconds.\n"
-		      , nbSeqProcessed, nbSeqProcessed > 1 ? "s" : "", chrono::duration_cast< chrono::seconds >( elapsed1 ).count()
-		      );
-		fclose( inputFile );
+}
 
+void ReadsIndexCreation( char const * filename, size_t nbThreads, bool forceWide, TranslationOptions const & options ) {
 		try {
-				printf( "Writting protein index structure...\n" );
+				printf( "Translating reads of \"%s\"...\n", filename );
+				auto startTimer = chrono::high_resolution_clock::now();
+
+				ReadTranslator translator( options );
+				size_t nbReads = translator.Parse( filename, nbThreads );
+
+				auto finishTimer = chrono::high_resolution_clock::now();
+				auto elapsed1 = finishTimer - startTimer;
+				auto const & stats = translator.GetStats();
+				printf( "   ...translated %zu read%s from input file in %ld seconds.\n"
+				      , nbReads, nbReads > 1 ? "s" : "", chrono::duration_cast< chrono::seconds >( elapsed1 ).count()
+				      );
+				printf( "   kept %zu, dropped %zu without insert, %zu ambiguous, %zu out of frame, %zu low quality, %zu with stop codon\n"
+				      , stats.Kept(), stats.noInsert, stats.ambiguous, stats.outOfFrame, stats.lowQuality, stats.stopCodon
+				      );
+				printf( "   %zu distinct peptide%s\n", translator.NumPeptides(), translator.NumPeptides() > 1 ? "s" : "" );
+
+				printf( "Writting peptide index structure...\n" );
 				startTimer = chrono::high_resolution_clock::now();
 
 				stringstream outputProtIdxFilenameStream;
@@ -113,8 +99,7 @@ void IndexCreation( char * argv[] ) {
 						fprintf( stderr, "Unable to open output file \"%s\"\n", outputProtIdxFilenameStream.str().c_str() );
 						exit( 1 );
 				}
-				MemFastIdx idx( proteinsName, proteinsSeq );
-				idx.Write( outputProtIdxFile );
+				translator.Write( outputProtIdxFile, forceWide );
 				fclose( outputProtIdxFile );
 
 				finishTimer = chrono::high_resolution_clock::now();
@@ -128,48 +113,87 @@ void IndexCreation( char * argv[] ) {
 		}
 }
 
-void IndexSizePrinting( char * argv[] ) {
-		MMappedFastIdx idx( argv[ 2 ] );
+void IndexSizePrinting( char const * filename ) {
+		MMappedFastIdx idx( filename );
 		printf( "Number of proteins in index: %zu\n", idx.Size() );
 }
 
-void IndexPrinting( char * argv[] ) {
-		MMappedFastIdx idx( argv[ 2 ] );
+void IndexPrinting( char const * filename ) {
+		MMappedFastIdx idx( filename );
 
-		auto size      = idx.GetIndicesSize();
-		auto indices   = idx.GetIndicesData();
-		auto names     = idx.GetNamesData();
-		auto sequences = idx.GetSequencesData();
+		auto size = idx.Size();
 
-		auto nodeNumber = size_t{ 0 };
-		for ( size_t i = 0; i < size; i += 2 ) {
-				printf( "(%05zu) %06zX: %06X | %06X\n", nodeNumber++, i, indices[ i ], indices[ i+1 ] );
+		for ( size_t i = 0; i < size; ++i ) {
+				printf( "(%05zu) %06zX: %06zX | %06zX\n", i, 2*i, idx.GetNameOffset( i ), idx.GetSequenceOffset( i ) );
 		}
 
 		printf( "~~~~~~\n" );
 
-		nodeNumber = 0;
-		for ( size_t i = 0; i < size; i += 2 ) {
-				printf( "(%05zu) %06X: %s\n", nodeNumber++, indices[ i ], &names[ indices[ i ] ] );
+		for ( size_t i = 0; i < size; ++i ) {
+				printf( "(%05zu) %06zX: %s\n", i, idx.GetNameOffset( i ), idx.GetName( i ) );
 		}
 
 		printf( "~~~~~~\n" );
 
-		nodeNumber = 0;
-		for ( size_t i = 1; i < size; i += 2 ) {
-				printf( "(%05zu) %06X: %s\n", nodeNumber++, indices[ i ], &sequences[ indices[ i ] ] );
+		for ( size_t i = 0; i < size; ++i ) {
+				printf( "(%05zu) %06zX: %s\n", i, idx.GetSequenceOffset( i ), idx.GetSequence( i ) );
+		}
+}
+
+// A Phred quality, from 0 to 93 as the printable FASTQ quality characters
+bool ParseQuality( char const * s, unsigned & quality ) {
+		char * end;
+		long q = strtol( s, &end, 10 );
+		if ( end == s || *end != '\0' || q < 0 || q > 93 ) {
+				return false;
 		}
+		quality = static_cast< unsigned >( q );
+		return true;
 }
 
 int main( int argc, char * argv[] ) {
-		if ( argc != 3 || argv[ 1 ][ 0 ] != '-' || strlen( argv[ 1 ] ) != 2 ) {
+		size_t nbThreads = 1;
+		bool   forceWide = false;
+		TranslationOptions translation;
+		bool   translationOptions = false;
+		int argi = 1;
+		while ( argi < argc ) {
+				if ( argc - argi > 2 && strcmp( argv[ argi ], "-j" ) == 0 && atoi( argv[ argi+1 ] ) > 0 ) {
+						nbThreads = static_cast< size_t >( atoi( argv[ argi+1 ] ) );
+						argi += 2;
+				} else if ( strcmp( argv[ argi ], "--v2" ) == 0 ) {
+						forceWide = true;
+						++argi;
+				} else if ( argc - argi > 2 && strcmp( argv[ argi ], "--flanks" ) == 0 && strchr( argv[ argi+1 ], ',' ) ) {
+						char const * comma = strchr( argv[ argi+1 ], ',' );
+						translation.leftFlank  = string( argv[ argi+1 ], static_cast< size_t >( comma - argv[ argi+1 ] ) );
+						translation.rightFlank = string( comma+1 );
+						translationOptions = true;
+						argi += 2;
+				} else if ( argc - argi > 2 && strcmp( argv[ argi ], "--min-quality" ) == 0 && ParseQuality( argv[ argi+1 ], translation.minQuality ) ) {
+						translationOptions = true;
+						argi += 2;
+				} else if ( strcmp( argv[ argi ], "--amber-q" ) == 0 ) {
+						translation.amberAsQ = true;
+						translationOptions = true;
+						++argi;
+				} else {
+						break;
+				}
+		}
+		if ( argc - argi != 2 || argv[ argi ][ 0 ] != '-' || strlen( argv[ argi ] ) != 2 ) {
+				UsageError( argv );
+		}
+		if ( translationOptions && argv[ argi ][ 1 ] != 'n' ) {
 				UsageError( argv );
 		}
+		char const * filename = argv[ argi+1 ];
 
-		switch ( argv[ 1 ][ 1 ] ) {
-			case 'c': {   IndexCreation    ( argv );   } break;
-			case 's': {   IndexSizePrinting( argv );   } break;
-			case 'p': {   IndexPrinting    ( argv );   } break;
+		switch ( argv[ argi ][ 1 ] ) {
+			case 'c': {   IndexCreation     ( filename, nbThreads, forceWide );   } break;
+			case 'n': {   ReadsIndexCreation( filename, nbThreads, forceWide, translation );   } break;
+			case 's': {   IndexSizePrinting ( filename );   } break;
+			case 'p': {   IndexPrinting     ( filename );   } break;
 			default: UsageError( argv );
 		}
 
@@ -0,0 +1,164 @@
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "Jobs.hpp"
+
+using namespace std;
+
+namespace {
+
+	size_t const maxArgsSize = 1 << 20;
+
+	bool WriteAll( int fd, void const * data, size_t size ) {
+			auto p = static_cast< char const * >( data );
+			while ( size != 0 ) {
+					ssize_t n = write( fd, p, size );
+					if ( n <= 0 ) {
+							return false;
+					}
+					p    += n;
+					size -= static_cast< size_t >( n );
+			}
+			return true;
+	}
+
+	bool ReadAll( int fd, void * data, size_t size ) {
+			auto p = static_cast< char * >( data );
+			while ( size != 0 ) {
+					ssize_t n = read( fd, p, size );
+					if ( n <= 0 ) {
+							return false;
+					}
+					p    += n;
+					size -= static_cast< size_t >( n );
+			}
+			return true;
+	}
+
+} // namespace
+
+void Job::Close() {
+		for ( int * fd : { &cwd, &output, &error } ) {
+				if ( *fd >= 0 ) {
+						close( *fd );
+						*fd = -1;
+				}
+		}
+}
+
+int ConnectJobSocket( char const * socketFilename ) {
+		sockaddr_un address;
+		memset( &address, 0, sizeof( address ) );
+		address.sun_family = AF_UNIX;
+		if ( strlen( socketFilename ) >= sizeof( address.sun_path ) ) {
+				return -1;
+		}
+		strcpy( address.sun_path, socketFilename );
+		int connection = socket( AF_UNIX, SOCK_STREAM, 0 );
+		if ( connection < 0 ) {
+				return -1;
+		}
+		if ( connect( connection, reinterpret_cast< sockaddr const * >( &address ), sizeof( address ) ) != 0 ) {
+				close( connection );
+				return -1;
+		}
+		return connection;
+}
+
+bool SendJob( int connection, vector< string > const & args ) {
+		string data;
+		for ( auto const & arg : args ) {
+				data.append( arg.c_str(), arg.size() + 1 );
+		}
+		if ( data.size() > maxArgsSize ) {
+				return false;
+		}
+		int cwd = open( ".", O_RDONLY | O_DIRECTORY );
+		if ( cwd < 0 ) {
+				return false;
+		}
+
+		// The descriptors go along the size, the arguments follow
+		uint32_t size = static_cast< uint32_t >( data.size() );
+		int fds[] = { cwd, STDOUT_FILENO, STDERR_FILENO };
+		char control[CMSG_SPACE( sizeof( fds ) )];
+		memset( control, 0, sizeof( control ) );
+		iovec iov = { &size, sizeof( size ) };
+		msghdr message;
+		memset( &message, 0, sizeof( message ) );
+		message.msg_iov        = &iov;
+		message.msg_iovlen     = 1;
+		message.msg_control    = control;
+		message.msg_controllen = sizeof( control );
+		cmsghdr * header = CMSG_FIRSTHDR( &message );
+		header->cmsg_level = SOL_SOCKET;
+		header->cmsg_type  = SCM_RIGHTS;
+		header->cmsg_len   = CMSG_LEN( sizeof( fds ) );
+		memcpy( CMSG_DATA( header ), fds, sizeof( fds ) );
+		bool sent = sendmsg( connection, &message, 0 ) == sizeof( size );
+		close( cwd );
+		return sent && WriteAll( connection, data.data(), data.size() );
+}
+
+bool ReceiveJob( int connection, Job & job ) {
+		uint32_t size = 0;
+		int fds[3];
+		char control[CMSG_SPACE( sizeof( fds ) )];
+		iovec iov = { &size, sizeof( size ) };
+		msghdr message;
+		memset( &message, 0, sizeof( message ) );
+		message.msg_iov        = &iov;
+		message.msg_iovlen     = 1;
+		message.msg_control    = control;
+		message.msg_controllen = sizeof( control );
+		ssize_t n = recvmsg( connection, &message, MSG_CMSG_CLOEXEC );
+		cmsghdr * header = n > 0 ? CMSG_FIRSTHDR( &message ) : nullptr;
+		if ( !header || header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS ) {
+				return false;
+		}
+		size_t nbFds = (header->cmsg_len - CMSG_LEN( 0 )) / sizeof( int );
+		memcpy( fds, CMSG_DATA( header ), std::min( nbFds, size_t{ 3 } ) * sizeof( int ) );
+		if ( nbFds != 3 ) {
+				for ( size_t i = 0; i < nbFds && i < 3; ++i ) {
+						close( fds[i] );
+				}
+				return false;
+		}
+		job.cwd    = fds[0];
+		job.output = fds[1];
+		job.error  = fds[2];
+
+		if ( (n != sizeof( size ) && !ReadAll( connection, reinterpret_cast< char * >( &size ) + n, sizeof( size ) - static_cast< size_t >( n ) ))
+		  || size > maxArgsSize
+		   ) {
+				job.Close();
+				return false;
+		}
+		string data( size, '\0' );
+		if ( !ReadAll( connection, &data[0], size ) || (size != 0 && data.back() != '\0') ) {
+				job.Close();
+				return false;
+		}
+		job.args.clear();
+		for ( size_t start = 0; start != data.size(); start = data.find( '\0', start ) + 1 ) {
+				job.args.emplace_back( data.c_str() + start );
+		}
+		return true;
+}
+
+bool SendStatus( int connection, int32_t status ) {
+		return WriteAll( connection, &status, sizeof( status ) );
+}
+
+bool ReceiveStatus( int connection, int32_t & status ) {
+		return ReadAll( connection, &status, sizeof( status ) );
+}
@@ -0,0 +1,37 @@
+#ifndef JOBS_HPP
+#define JOBS_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// ~~~ Pepteamd jobs ~~~ //
+// A job is sent by PepteamSubmit over the Unix domain socket of Pepteamd as the size of its
+// arguments then the arguments, NUL terminated, along with the working directory, standard
+// output and standard error of the client (passed as SCM_RIGHTS file descriptors), so that
+// it writes its files and messages as PepteamMap run by the client would:
+//    [size:u32][argument\0...]
+// Its exit status is sent back once it is done:
+//    [status:i32]
+struct Job {
+		std::vector< std::string > args;
+		int cwd    = -1;
+		int output = -1;
+		int error  = -1;
+
+		void Close();
+};
+
+// Connects to the socket of Pepteamd, -1 when it is not listening
+int ConnectJobSocket( char const * socketFilename );
+
+// Sends the job of the client to connection
+bool SendJob( int connection, std::vector< std::string > const & args );
+
+// Receives a job from connection, false when the client is gone or sent an invalid one
+bool ReceiveJob( int connection, Job & job );
+
+bool SendStatus   ( int connection, int32_t status );
+bool ReceiveStatus( int connection, int32_t & status );
+
+#endif
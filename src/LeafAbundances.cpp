@@ -0,0 +1,97 @@
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <cctype>
+#include <limits>
+#include <stdexcept>
+#include <algorithm>
+
+#include "LeafAbundances.hpp"
+
+using namespace std;
+
+namespace {
+
+	// Sums the read counts of the proteins of every position of a leaf
+	struct AbundanceFunctor {
+			vector< uint32_t > const & proteinCounts;
+			uint64_t                   abundance;
+			uint32_t                   count;
+
+			void ListSize( size_t ) {   }
+
+			void AddHeader( uint32_t protNumber, size_t ) {
+					count = proteinCounts[protNumber];
+			}
+			void StopHeader() {   }
+
+			void AddPos( size_t ) {
+					abundance += count;
+			}
+			void StopPos() {   }
+	};
+
+} // namespace
+
+uint32_t HeaderReadCount( char const * name ) {
+		for ( char const * p = name; *p; ++p ) {
+				if ( p != name && *(p-1) != ';' && *(p-1) != '|' && *(p-1) != ' ' ) {
+						continue;
+				}
+				size_t keySize = strncmp( p, "size=", 5 ) == 0 ? 5 : strncmp( p, "count=", 6 ) == 0 ? 6 : 0;
+				if ( keySize == 0 || !isdigit( p[keySize] ) ) {
+						continue;
+				}
+				uint64_t count = 0;
+				for ( p += keySize; isdigit( *p ); ++p ) {
+						count = std::min< uint64_t >( 10*count + (*p - '0'), numeric_limits< uint32_t >::max() );
+				}
+				return static_cast< uint32_t >( count );
+		}
+		return 1;
+}
+
+void WriteLeafAbundances( FILE * file, MMappedPepTree const & tree, vector< uint32_t > const & proteinCounts ) {
+		vector< uint32_t > abundances( tree.GetNumberLeaves(), 0 );
+		for ( size_t i = 0; i != abundances.size(); ++i ) {
+				tree.ForLeaf( i, [&]( char const *, size_t offset ) {
+						AbundanceFunctor f{ proteinCounts, 0, 0 };
+						tree.ForLeafPos( offset, f );
+						abundances[i] = static_cast< uint32_t >( std::min< uint64_t >( f.abundance, numeric_limits< uint32_t >::max() ) );
+				});
+		}
+
+		uint32_t arr[] = { 0, LeafAbundancesFormat::currentVersion };
+		memcpy( arr, LeafAbundancesFormat::magic, sizeof( LeafAbundancesFormat::magic ) );
+		uint64_t nbLeaves = abundances.size();
+		fwrite( arr      , sizeof( arr[0] ), sizeof( arr ) / sizeof( arr[0] ), file );
+		fwrite( &nbLeaves, sizeof( nbLeaves ), 1, file );
+		fwrite( abundances.data(), sizeof( uint32_t ), abundances.size(), file );
+}
+
+LeafAbundances::LeafAbundances( char const * filename ) {
+		FILE * file = fopen( filename, "rb" );
+		if ( !file ) {
+				throw std::runtime_error{ string{ "Unable to open input LeafAbundances file \"" } + filename + '"' };
+		}
+		uint32_t arr[2];
+		uint64_t nbLeaves;
+		if ( fread( arr, sizeof( arr[0] ), 2, file ) != 2 || fread( &nbLeaves, sizeof( nbLeaves ), 1, file ) != 1
+		  || memcmp( arr, LeafAbundancesFormat::magic, sizeof( LeafAbundancesFormat::magic ) ) != 0 || arr[1] != LeafAbundancesFormat::currentVersion
+		   ) {
+				fclose( file );
+				throw std::runtime_error{ string{ "Invalid or unsupported LeafAbundances file \"" } + filename + "\", abording" };
+		}
+		vector< uint32_t > abundances( nbLeaves );
+		bool valid = fread( abundances.data(), sizeof( uint32_t ), abundances.size(), file ) == abundances.size();
+		fclose( file );
+		if ( !valid ) {
+				throw std::runtime_error{ string{ "Truncated LeafAbundances file \"" } + filename + "\", abording" };
+		}
+		prefix.assign( abundances.size() + 1, 0 );
+		for ( size_t i = 0; i != abundances.size(); ++i ) {
+				prefix[i+1] = prefix[i] + abundances[i];
+		}
+}
@@ -0,0 +1,48 @@
+#ifndef LEAFABUNDANCES_HPP
+#define LEAFABUNDANCES_HPP
+
+#include <cstdio>
+#include <cstdint>
+#include <vector>
+
+#include "PepTree.hpp"
+
+// ~~~ LeafAbundances files ~~~ //
+// A LeafAbundances file goes along a PepTree of sequencing reads (or of distinct peptides
+// with their read counts), holding the abundance of every leaf: the read counts of the
+// proteins it occurs in, once per occurrence, saturating at 2^32-1:
+//    ["LABD"][version:u32][nbLeaves:u64][abundance:u32...]
+namespace LeafAbundancesFormat {
+
+	char     const magic[4]       = { 'L', 'A', 'B', 'D' };
+	uint32_t const currentVersion = 1;
+
+} // namespace LeafAbundancesFormat
+
+// Read count of a FASTA header, from its first "size=" or "count=" field (following the
+// start of the header, a ';', a '|' or a space, as written by dereplication tools), 1
+// without one
+uint32_t HeaderReadCount( char const * name );
+
+// Writes the abundance of every leaf of tree, proteinCounts holding the read count of
+// every protein
+void WriteLeafAbundances( FILE * file, MMappedPepTree const & tree, std::vector< uint32_t > const & proteinCounts );
+
+// Abundances are kept as their prefix sums, for the leaf ranges of accepted blocks
+class LeafAbundances {
+	public:
+		explicit LeafAbundances( char const * filename );
+
+	public:
+		size_t GetNumberLeaves() const {   return prefix.size() - 1;   }
+
+		uint32_t Get( size_t leaf ) const {   return static_cast< uint32_t >( prefix[leaf+1] - prefix[leaf] );   }
+
+		// Abundance of the leaves [start, stop)
+		uint64_t Sum( size_t start, size_t stop ) const {   return prefix[stop] - prefix[start];   }
+
+	private:
+		std::vector< uint64_t > prefix;   // abundance of the leaves before every leaf, and of all of them
+};
+
+#endif
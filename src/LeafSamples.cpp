@@ -0,0 +1,102 @@
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <stdexcept>
+#include <algorithm>
+
+#include "LeafSamples.hpp"
+
+using namespace std;
+
+namespace {
+
+	// Sets the bit of the sample of every protein of a leaf positions
+	struct SamplesFunctor {
+			vector< size_t > const & proteinStarts;
+			uint64_t                 mask;
+
+			void ListSize( size_t ) {   }
+
+			void AddHeader( uint32_t protNumber, size_t ) {
+					auto sample = upper_bound( proteinStarts.begin(), proteinStarts.end(), protNumber ) - proteinStarts.begin() - 1;
+					mask |= uint64_t{ 1 } << sample;
+			}
+			void StopHeader() {   }
+
+			void AddPos( size_t ) {   }
+			void StopPos() {   }
+	};
+
+} // namespace
+
+void WriteLeafSamples( FILE * file, MMappedPepTree const & tree
+                     , vector< size_t > const & proteinStarts, vector< string > const & names
+                     ) {
+		if ( names.empty() || names.size() > LeafSamplesFormat::maxSamples || proteinStarts.size() != names.size() ) {
+				throw std::runtime_error{ "A samples tree requires from 1 to 64 samples, abording" };
+		}
+		vector< uint64_t > masks( tree.GetNumberLeaves(), 0 );
+		for ( size_t i = 0; i != masks.size(); ++i ) {
+				tree.ForLeaf( i, [&]( char const *, size_t offset ) {
+						SamplesFunctor f{ proteinStarts, 0 };
+						tree.ForLeafPos( offset, f );
+						masks[i] = f.mask;
+				});
+		}
+
+		uint32_t arr[] = { 0, LeafSamplesFormat::currentVersion, static_cast< uint32_t >( names.size() ), 0 };
+		memcpy( arr, LeafSamplesFormat::magic, sizeof( LeafSamplesFormat::magic ) );
+		uint64_t nbLeaves = masks.size();
+		fwrite( arr      , sizeof( arr[0] ), sizeof( arr ) / sizeof( arr[0] ), file );
+		fwrite( &nbLeaves, sizeof( nbLeaves ), 1, file );
+		fwrite( masks.data(), sizeof( uint64_t ), masks.size(), file );
+		for ( auto const & name : names ) {
+				fwrite( name.c_str(), 1, name.size() + 1, file );
+		}
+}
+
+LeafSamples::LeafSamples( char const * filename ) {
+		FILE * file = fopen( filename, "rb" );
+		if ( !file ) {
+				throw std::runtime_error{ string{ "Unable to open input LeafSamples file \"" } + filename + '"' };
+		}
+		uint32_t arr[4];
+		uint64_t nbLeaves;
+		if ( fread( arr, sizeof( arr[0] ), 4, file ) != 4 || fread( &nbLeaves, sizeof( nbLeaves ), 1, file ) != 1
+		  || memcmp( arr, LeafSamplesFormat::magic, sizeof( LeafSamplesFormat::magic ) ) != 0 || arr[1] != LeafSamplesFormat::currentVersion
+		  || arr[2] == 0 || arr[2] > LeafSamplesFormat::maxSamples
+		   ) {
+				fclose( file );
+				throw std::runtime_error{ string{ "Invalid or unsupported LeafSamples file \"" } + filename + "\", abording" };
+		}
+		masks.resize( nbLeaves );
+		bool valid = fread( masks.data(), sizeof( uint64_t ), masks.size(), file ) == masks.size();
+		string name;
+		for ( int c; valid && (c = fgetc( file )) != EOF; ) {
+				if ( c == '\0' ) {
+						names.push_back( name );
+						name.clear();
+				} else {
+						name += static_cast< char >( c );
+				}
+		}
+		fclose( file );
+		if ( !valid || !name.empty() || names.size() != arr[2] ) {
+				throw std::runtime_error{ string{ "Truncated LeafSamples file \"" } + filename + "\", abording" };
+		}
+
+		columns.resize( names.size() );
+		for ( size_t s = 0; s != names.size(); ++s ) {
+				auto & column = columns[s];
+				column.bits .assign( masks.size() / 64 + 1, 0 );
+				column.ranks.assign( masks.size() / 64 + 1, 0 );
+				for ( size_t leaf = 0; leaf != masks.size(); ++leaf ) {
+						column.bits[leaf / 64] |= ((masks[leaf] >> s) & 1) << (leaf % 64);
+				}
+				for ( size_t word = 1; word != column.bits.size(); ++word ) {
+						column.ranks[word] = column.ranks[word-1] + __builtin_popcountll( column.bits[word-1] );
+				}
+		}
+}
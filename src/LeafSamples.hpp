@@ -0,0 +1,67 @@
+#ifndef LEAFSAMPLES_HPP
+#define LEAFSAMPLES_HPP
+
+#include <cstdio>
+#include <cstdint>
+#include <vector>
+#include <string>
+
+#include "PepTree.hpp"
+
+// ~~~ LeafSamples files ~~~ //
+// A LeafSamples file goes along a PepTree built from the FastIdx files of several samples,
+// their proteins being numbered one sample after the other.  It holds the samples every
+// leaf occurs in, as a bitset, then the FastIdx filenames of the samples:
+//    ["LSMP"][version:u32][nbSamples:u32][0:u32][nbLeaves:u64][mask:u64...][names]
+// names being NUL terminated, in sample order.
+namespace LeafSamplesFormat {
+
+	char     const magic[4]       = { 'L', 'S', 'M', 'P' };
+	uint32_t const currentVersion = 1;
+	size_t   const maxSamples     = 64;   // one bit per sample in a 64 bits mask
+
+} // namespace LeafSamplesFormat
+
+// Writes the samples of every leaf of tree, the proteins from proteinStarts[s] on (up to
+// the next start) being the ones of sample s
+void WriteLeafSamples( FILE * file, MMappedPepTree const & tree
+                     , std::vector< size_t > const & proteinStarts, std::vector< std::string > const & names
+                     );
+
+// The leaves of every sample are also kept as a bit column with the count of its leaves
+// before every 64 leaves, so that a leaf of the tree is numbered as in the PepTree of the
+// sample alone (whose leaves are the ones of the sample, in the same order).
+class LeafSamples {
+	public:
+		explicit LeafSamples( char const * filename );
+
+	public:
+		size_t NbSamples() const {   return names.size();   }
+
+		size_t GetNumberLeaves() const {   return masks.size();   }
+
+		char const * GetName( size_t sample ) const {   return names[sample].c_str();   }
+
+		uint64_t Mask( size_t leaf ) const {   return masks[leaf];   }
+
+		// Leaves of the sample before leaf, which is the index of leaf in the PepTree of the
+		// sample alone when it is one of its leaves; leaf may be GetNumberLeaves()
+		size_t Rank( size_t sample, size_t leaf ) const {
+				auto const & column = columns[sample];
+				size_t word = leaf / 64, bit = leaf % 64;
+				return column.ranks[word] + (bit == 0 ? 0 : __builtin_popcountll( column.bits[word] << (64 - bit) ));
+		}
+
+	private:
+		struct Column {
+				std::vector< uint64_t > bits;    // by 64 leaves, one more word than needed
+				std::vector< uint64_t > ranks;   // leaves of the sample before every word
+		};
+
+	private:
+		std::vector< uint64_t >    masks;
+		std::vector< std::string > names;
+		std::vector< Column >      columns;
+};
+
+#endif
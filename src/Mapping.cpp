@@ -0,0 +1,72 @@
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#include <sys/stat.h>
+
+#include "Mapping.hpp"
+
+using namespace std;
+
+namespace Mapping {
+
+	static char const magic[8] = { 'P', 'E', 'P', 'T', 'M', 'A', 'P', '\0' };
+
+	void WriteHeader( FILE * file, Header const & header ) {
+			if ( fwrite( magic, sizeof( magic ), 1, file ) != 1 || fwrite( &header, sizeof( header ), 1, file ) != 1 ) {
+					throw std::runtime_error{ "Unable to write output, abording" };
+			}
+	}
+
+	bool ReadHeader( FILE * file, Header & header ) {
+			char buf[ sizeof( magic ) ];
+			if ( fread( buf, sizeof( buf ), 1, file ) != 1 || memcmp( buf, magic, sizeof( magic ) ) != 0 ) {
+					return false;
+			}
+			if ( fread( &header, sizeof( header ), 1, file ) != 1 ) {
+					throw std::runtime_error{ "Truncated mapping file header, abording" };
+			}
+			if ( header.version != currentVersion ) {
+					throw std::runtime_error{ "Unsupported mapping file version, abording" };
+			}
+			return true;
+	}
+
+	Reader::Reader( char const * filename )
+		: file( fopen( filename, "rb" ) ) {
+			if ( !file ) {
+					throw std::runtime_error{ string{ "Unable to open mapping file \"" } + filename + '"' };
+			}
+			binary = ReadHeader( file, header );
+			if ( !binary ) {
+					memset( &header, 0, sizeof( header ) );
+					rewind( file );
+			}
+	}
+
+	Reader::~Reader() {
+			fclose( file );
+	}
+
+	uint64_t Reader::RemainingSize() const {
+			struct stat fStat;
+			off_t position = ftello( file );
+			if ( fstat( fileno( file ), &fStat ) != 0 || !S_ISREG( fStat.st_mode ) || position < 0 || position > fStat.st_size ) {
+					return UINT64_MAX;
+			}
+			return static_cast< uint64_t >( fStat.st_size - position );
+	}
+
+	void ThrowTruncated() {
+			throw std::runtime_error{ "Truncated mapping file, abording" };
+	}
+
+	void Reader::ThrowBlocks() {
+			throw std::runtime_error{ "Mapping file holds blocks, the pepTree files are needed to expand them, abording" };
+	}
+
+	void Reader::ThrowNoBlocks() {
+			throw std::runtime_error{ "Mapping file does not hold blocks, abording" };
+	}
+
+} // namespace Mapping
@@ -0,0 +1,336 @@
+#ifndef MAPPING_HPP
+#define MAPPING_HPP
+
+#include <cstdio>
+#include <cstdint>
+#include <cinttypes>
+#include <vector>
+
+#include "OutputBuffer.hpp"
+
+// ~~~ Mapping files ~~~ //
+// A binary mapping file is a fixed header followed by independent blocks:
+//    [nbRecords:u32][payloadSize:u32][payload]
+// Records are delta-encoded against the previous record of the same block:
+//    zigzag(query - prevQuery) zigzag(subject - prevSubject) zigzag(scoreNum) zigzag(scoreDen)
+// as LEB128 varints, the score being the exact similarity ratio scoreNum/scoreDen.
+// Since deltas restart with every block, blocks produced separately can simply be
+// concatenated.  The legacy text format is one "query subject score" line per mapping.
+//
+// With the Blocks flag set, records describe whole accepted ranges instead:
+//    zigzag(queryStart - prevQueryStart) (queryStop - queryStart)
+//    zigzag(subjectStart - prevSubjectStart) (subjectStop - subjectStart) depth
+// meaning every (query, subject) leaf pair of the ranges maps, their scores being
+// recomputed from the trees by the consumers that need them.
+namespace Mapping {
+
+	uint32_t const currentVersion = 1;
+
+	enum Flags : uint32_t {
+		Blocks = 1 << 0
+	};
+
+	struct Header {
+			uint32_t version;
+			uint32_t flags;
+			uint32_t depth;
+			uint32_t matrixId;
+			double   cutoff;
+			int32_t  matrix[24][24];
+	};
+
+	void WriteHeader( FILE * file, Header const & header );
+
+	// Returns false if the file does not start with a binary mapping header
+	bool ReadHeader( FILE * file, Header & header );
+
+	inline void PutVarint( std::vector< uint8_t > & buf, uint64_t v ) {
+			while ( v >= 0x80 ) {
+					buf.push_back( static_cast< uint8_t >( v | 0x80 ) );
+					v >>= 7;
+			}
+			buf.push_back( static_cast< uint8_t >( v ) );
+	}
+
+	[[noreturn]] void ThrowTruncated();
+
+	// Stops at the end of the payload, or past 64 bits, on corrupted data
+	inline uint64_t GetVarint( uint8_t const * & p, uint8_t const * end ) {
+			uint64_t v = 0;
+			for ( unsigned shift = 0; ; shift += 7 ) {
+					if ( p == end || shift > 63 ) {
+							ThrowTruncated();
+					}
+					uint8_t b = *p++;
+					v |= static_cast< uint64_t >( b & 0x7F ) << shift;
+					if ( !(b & 0x80) ) {
+							return v;
+					}
+			}
+	}
+
+	inline uint64_t ZigZag( int64_t v )   {   return (static_cast< uint64_t >( v ) << 1) ^ static_cast< uint64_t >( v >> 63 );   }
+	inline int64_t  UnZigZag( uint64_t v ) {   return static_cast< int64_t >( v >> 1 ) ^ -static_cast< int64_t >( v & 1 );   }
+
+	// Encodes mappings as binary blocks into an OutputBuffer
+	class BinaryWriter {
+		public:
+			explicit BinaryWriter( OutputBuffer & out_ )
+				: out( out_ ) {
+			}
+
+			~BinaryWriter() {
+					Finish();
+			}
+
+		public:
+			static size_t const maxBlockPayload = 1 << 20;
+
+		public:
+			void Add( uint64_t query, uint64_t subject, int32_t scoreNum, int32_t scoreDen ) {
+					PutVarint( payload, ZigZag( static_cast< int64_t >( query )   - prevQuery ) );
+					PutVarint( payload, ZigZag( static_cast< int64_t >( subject ) - prevSubject ) );
+					PutVarint( payload, ZigZag( scoreNum ) );
+					PutVarint( payload, ZigZag( scoreDen ) );
+					prevQuery   = query;
+					prevSubject = subject;
+					++nbRecords;
+					if ( payload.size() >= maxBlockPayload ) {
+							Finish();
+					}
+			}
+
+			// Closes the current block
+			void Finish() {
+					if ( nbRecords == 0 ) {
+							return;
+					}
+					uint32_t blockHeader[] = { nbRecords, static_cast< uint32_t >( payload.size() ) };
+					out.Write( blockHeader, sizeof( blockHeader ) );
+					out.Write( payload.data(), payload.size() );
+					payload.clear();
+					nbRecords = 0;
+					prevQuery = prevSubject = 0;
+			}
+
+		private:
+			OutputBuffer & out;
+
+			std::vector< uint8_t > payload;
+			uint32_t nbRecords   = 0;
+			int64_t  prevQuery   = 0;
+			int64_t  prevSubject = 0;
+	};
+
+	// Encodes accepted leaf ranges as binary blocks into an OutputBuffer
+	class BlockWriter {
+		public:
+			explicit BlockWriter( OutputBuffer & out_ )
+				: out( out_ ) {
+			}
+
+			~BlockWriter() {
+					Finish();
+			}
+
+		public:
+			static size_t const maxBlockPayload = 1 << 20;
+
+		public:
+			void AddBlock( uint64_t queryStart  , uint64_t queryStop
+			             , uint64_t subjectStart, uint64_t subjectStop
+			             , uint32_t depth
+			             ) {
+					PutVarint( payload, ZigZag( static_cast< int64_t >( queryStart )   - prevQuery ) );
+					PutVarint( payload, queryStop - queryStart );
+					PutVarint( payload, ZigZag( static_cast< int64_t >( subjectStart ) - prevSubject ) );
+					PutVarint( payload, subjectStop - subjectStart );
+					PutVarint( payload, depth );
+					prevQuery   = queryStart;
+					prevSubject = subjectStart;
+					++nbRecords;
+					if ( payload.size() >= maxBlockPayload ) {
+							Finish();
+					}
+			}
+
+			void Finish() {
+					if ( nbRecords == 0 ) {
+							return;
+					}
+					uint32_t blockHeader[] = { nbRecords, static_cast< uint32_t >( payload.size() ) };
+					out.Write( blockHeader, sizeof( blockHeader ) );
+					out.Write( payload.data(), payload.size() );
+					payload.clear();
+					nbRecords = 0;
+					prevQuery = prevSubject = 0;
+			}
+
+		private:
+			OutputBuffer & out;
+
+			std::vector< uint8_t > payload;
+			uint32_t nbRecords   = 0;
+			int64_t  prevQuery   = 0;
+			int64_t  prevSubject = 0;
+	};
+
+	// Writes mappings in the legacy "query subject score" text format
+	class TextWriter {
+		public:
+			explicit TextWriter( OutputBuffer & out_ )
+				: out( out_ ) {
+			}
+
+		public:
+			void Add( uint64_t query, uint64_t subject, int32_t scoreNum, int32_t scoreDen ) {
+					static size_t const maxRecordSize = 64;
+					auto n = snprintf( out.Reserve( maxRecordSize ), maxRecordSize
+					                 , "%" PRIu64 " %" PRIu64 " %g\n", query, subject, scoreNum / static_cast< double >( scoreDen )
+					                 );
+					out.Commit( static_cast< size_t >( n ) );
+			}
+
+			void Finish() {   }
+
+		private:
+			OutputBuffer & out;
+	};
+
+	// Reads either format.  Mappings of a Blocks file are only available through
+	// ForEachBlock(), their scores having to be recomputed from the trees.
+	class Reader {
+		public:
+			explicit Reader( char const * filename );
+
+			~Reader();
+
+		public:
+			bool IsBinary() const {   return binary;   }
+
+			Header const & GetHeader() const {   return header;   }
+
+			bool HasBlocks() const {   return binary && (header.flags & Blocks);   }
+
+			// Calls f( query, subject, score ) for every mapping
+			template< typename F >
+			void ForEachMapping( F && f ) {
+					if ( HasBlocks() ) {
+							ThrowBlocks();
+					} else if ( binary ) {
+							ForEachRawMapping( [&]( uint64_t query, uint64_t subject, int32_t scoreNum, int32_t scoreDen ) {
+									f( query, subject, scoreNum / static_cast< double >( scoreDen ) );
+							});
+					} else {
+							ForEachTextMapping( f );
+					}
+			}
+
+			// Binary pair files only, calls f( query, subject, scoreNum, scoreDen ) for every mapping
+			template< typename F >
+			void ForEachRawMapping( F && f ) {
+					if ( HasBlocks() ) {
+							ThrowBlocks();
+					}
+					ForEachPayload( [&]( uint8_t const * p, uint8_t const * end, uint32_t nbRecords ) {
+							ForEachRawMappingOf( p, end, nbRecords, f );
+					});
+			}
+
+			// Blocks files only, calls f( queryStart, queryStop, subjectStart, subjectStop, depth ) for every block
+			template< typename F >
+			void ForEachBlock( F && f ) {
+					if ( !HasBlocks() ) {
+							ThrowNoBlocks();
+					}
+					ForEachPayload( [&]( uint8_t const * p, uint8_t const * end, uint32_t nbRecords ) {
+							ForEachBlockOf( p, end, nbRecords, f );
+					});
+			}
+
+			// Binary files only, reads the payload of the next block so that it can be
+			// decoded independently (by another thread for instance) with one of the
+			// decoders below; returns false once every block has been read
+			bool ReadBlock( std::vector< uint8_t > & payload, uint32_t & nbRecords ) {
+					uint32_t blockHeader[2];
+					if ( fread( blockHeader, sizeof( blockHeader ), 1, file ) != 1 ) {
+							return false;
+					}
+					// every record takes a byte per varint at least, and the payload has to be in the file
+					if ( blockHeader[1] < uint64_t{ blockHeader[0] } * (HasBlocks() ? 5 : 4) || blockHeader[1] > RemainingSize() ) {
+							ThrowTruncated();
+					}
+					payload.resize( blockHeader[1] );
+					if ( fread( payload.data(), 1, payload.size(), file ) != payload.size() ) {
+							ThrowTruncated();
+					}
+					nbRecords = blockHeader[0];
+					return true;
+			}
+
+			// Decodes a block of a pair file, payload [p, end), calls f( query, subject, scoreNum, scoreDen )
+			template< typename F >
+			static void ForEachRawMappingOf( uint8_t const * p, uint8_t const * end, uint32_t nbRecords, F && f ) {
+					int64_t query = 0, subject = 0;
+					for ( uint32_t i = 0; i != nbRecords; ++i ) {
+							query   += UnZigZag( GetVarint( p, end ) );
+							subject += UnZigZag( GetVarint( p, end ) );
+							auto num = UnZigZag( GetVarint( p, end ) );
+							auto den = UnZigZag( GetVarint( p, end ) );
+							f( static_cast< uint64_t >( query ), static_cast< uint64_t >( subject )
+							 , static_cast< int32_t >( num ), static_cast< int32_t >( den )
+							 );
+					}
+			}
+
+			// Decodes a block of a Blocks file, payload [p, end), calls f( queryStart, queryStop, subjectStart, subjectStop, depth )
+			template< typename F >
+			static void ForEachBlockOf( uint8_t const * p, uint8_t const * end, uint32_t nbRecords, F && f ) {
+					int64_t query = 0, subject = 0;
+					for ( uint32_t i = 0; i != nbRecords; ++i ) {
+							query   += UnZigZag( GetVarint( p, end ) );
+							auto querySize = GetVarint( p, end );
+							subject += UnZigZag( GetVarint( p, end ) );
+							auto subjectSize = GetVarint( p, end );
+							auto depth = GetVarint( p, end );
+							f( static_cast< uint64_t >( query )  , static_cast< uint64_t >( query + querySize )
+							 , static_cast< uint64_t >( subject ), static_cast< uint64_t >( subject + subjectSize )
+							 , static_cast< uint32_t >( depth )
+							 );
+					}
+			}
+
+		private:
+			FILE * file;
+			bool   binary;
+			Header header;
+
+		private:
+			template< typename F >
+			void ForEachPayload( F && f ) {
+					std::vector< uint8_t > payload;
+					uint32_t nbRecords;
+					while ( ReadBlock( payload, nbRecords ) ) {
+							f( static_cast< uint8_t const * >( payload.data() ), payload.data() + payload.size(), nbRecords );
+					}
+			}
+
+			template< typename F >
+			void ForEachTextMapping( F & f ) {
+					uint64_t query, subject;
+					double score;
+					while ( fscanf( file, "%" SCNu64 " %" SCNu64 " %lg\n", &query, &subject, &score ) == 3 ) {
+							f( query, subject, score );
+					}
+			}
+
+			// Bytes left in a regular file, unknown otherwise
+			uint64_t RemainingSize() const;
+
+			[[noreturn]] static void ThrowBlocks();
+			[[noreturn]] static void ThrowNoBlocks();
+	};
+
+} // namespace Mapping
+
+#endif
@@ -0,0 +1,106 @@
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <cinttypes>
+#include <stdexcept>
+
+#include "Matrices.hpp"
+#include "Mapping.hpp"
+#include "PepTree.hpp"
+#include "Similarity.hpp"
+
+using namespace std;
+
+void UsageError( char * argv[] ) {
+		fprintf( stderr
+		       , "Usage: %s -* mapping-file [pepTree-query-file pepTree-subject-file]\n"
+		         "   where * is one of:\n"
+		         "     h -> print the header of a binary mapping file\n"
+		         "     t -> print the mappings in the legacy text format\n"
+		         "          (the pepTree files are required to rescore the pairs of a blocks file)\n"
+		         "     b -> print the blocks of a blocks file\n"
+		       , argv[ 0 ]
+		       );
+		exit( 1 );
+}
+
+void HeaderPrinting( Mapping::Reader & mappings ) {
+		if ( !mappings.IsBinary() ) {
+				printf( "Text mapping file, no header\n" );
+				return;
+		}
+		auto const & header = mappings.GetHeader();
+		printf( "Version: %u\n", header.version );
+		printf( "Flags: %08X\n", header.flags );
+		printf( "Depth: %u\n", header.depth );
+		printf( "Matrix: %u (%s)\n", header.matrixId, Matrix::Name( static_cast< Matrix::Id >( header.matrixId ) ) );
+		printf( "Cutoff: %g\n", header.cutoff );
+}
+
+void TextPrinting( Mapping::Reader & mappings, char * argv[] ) {
+		OutputBuffer out( stdout );
+		Mapping::TextWriter writer( out );
+		if ( mappings.HasBlocks() ) {
+				if ( !argv[ 3 ] ) {
+						UsageError( argv );
+				}
+				MMappedPepTree query( argv[ 3 ] );
+				MMappedPepTree subject( argv[ 4 ] );
+				auto const & matrix = mappings.GetHeader().matrix;
+				mappings.ForEachBlock( [&]( uint64_t queryStart, uint64_t queryStop
+				                          , uint64_t subjectStart, uint64_t subjectStop
+				                          , uint32_t
+				                          ) {
+						for ( uint64_t qIdx = queryStart; qIdx != queryStop; ++qIdx ) {
+								query.ForLeaf( qIdx, [&]( char const * qStr, size_t ) {
+										for ( uint64_t sIdx = subjectStart; sIdx != subjectStop; ++sIdx ) {
+												subject.ForLeaf( sIdx, [&]( char const * sStr, size_t ) {
+														auto score = WordsSimilarity( matrix, qStr, sStr );
+														writer.Add( qIdx, sIdx, GetScoreNum( score ), GetScoreDen( score ) );
+												});
+										}
+								});
+						}
+				});
+		} else if ( mappings.IsBinary() ) {
+				mappings.ForEachRawMapping( [&]( uint64_t query, uint64_t subject, int32_t scoreNum, int32_t scoreDen ) {
+						writer.Add( query, subject, scoreNum, scoreDen );
+				});
+		} else {
+				mappings.ForEachMapping( [&]( uint64_t query, uint64_t subject, double score ) {
+						auto n = snprintf( out.Reserve( 64 ), 64, "%" PRIu64 " %" PRIu64 " %g\n", query, subject, score );
+						out.Commit( static_cast< size_t >( n ) );
+				});
+		}
+		out.Flush();
+}
+
+void BlocksPrinting( Mapping::Reader & mappings ) {
+		mappings.ForEachBlock( []( uint64_t queryStart, uint64_t queryStop
+		                         , uint64_t subjectStart, uint64_t subjectStop
+		                         , uint32_t depth
+		                         ) {
+				printf( "[%" PRIu64 ", %" PRIu64 ") x [%" PRIu64 ", %" PRIu64 ") @ %u\n", queryStart, queryStop, subjectStart, subjectStop, depth );
+		});
+}
+
+int main( int argc, char * argv[] ) {
+		if ( (argc != 3 && argc != 5) || argv[ 1 ][ 0 ] != '-' || strlen( argv[ 1 ] ) != 2 ) {
+				UsageError( argv );
+		}
+
+		try {
+				Mapping::Reader mappings( argv[ 2 ] );
+				switch ( argv[ 1 ][ 1 ] ) {
+					case 'h': {   HeaderPrinting( mappings );         } break;
+					case 't': {   TextPrinting  ( mappings, argv );   } break;
+					case 'b': {   BlocksPrinting( mappings );         } break;
+					default: UsageError( argv );
+				}
+		} catch( std::exception & e ) {
+				fprintf( stderr, "%s\n", e.what() );
+				return 1;
+		}
+
+		return 0;
+}
@@ -0,0 +1,103 @@
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <cstring>
+#include <climits>
+#include <strings.h>
+#include <stdexcept>
+
+#include "Fasta.hpp"
+#include "Matrices.hpp"
+
+using namespace std;
+
+namespace Matrix {
+
+	char const * Name( Id id ) {
+			switch ( id ) {
+				case Id::Pam30:    {   return "PAM30";      }
+				case Id::Blosum62: {   return "BLOSUM62";   }
+				case Id::File:     {   return "file";       }
+			}
+			return "unknown";
+	}
+
+	bool GetBuiltin( char const * name, Id & id, int (&matrix)[24][24] ) {
+			if ( strcasecmp( name, "pam30" ) == 0 ) {
+					id = Id::Pam30;
+					memcpy( matrix, Pam30, sizeof( matrix ) );
+			} else if ( strcasecmp( name, "blosum62" ) == 0 ) {
+					id = Id::Blosum62;
+					memcpy( matrix, Blosum62, sizeof( matrix ) );
+			} else {
+					return false;
+			}
+			return true;
+	}
+
+	void LoadFile( char const * filename, int (&matrix)[24][24] ) {
+			ifstream file( filename );
+			if ( !file ) {
+					throw std::runtime_error{ string{ "Unable to open matrix file \"" } + filename + "\", abording" };
+			}
+			auto Error = [filename]( char const * what ) {
+					return std::runtime_error{ string{ "Invalid matrix file \"" } + filename + "\": " + what + ", abording" };
+			};
+
+			vector< Fasta::AAIndex > columns;
+			bool seen[24][24] = {};
+			int  minScore = INT_MAX;
+			string line;
+			while ( getline( file, line ) ) {
+					istringstream ls( line );
+					string first;
+					if ( !(ls >> first) || first[0] == '#' ) {
+							continue;
+					}
+					if ( columns.empty() ) {   // header line
+							for ( string res = first; ; ) {
+									if ( res.size() != 1 ) {
+											throw Error( "residues are expected in the header line" );
+									}
+									columns.push_back( Fasta::Char2Index( res[0] ) );
+									if ( !(ls >> res) ) {
+											break;
+									}
+							}
+							continue;
+					}
+					if ( first.size() != 1 ) {
+							throw Error( "rows must start with their residue" );
+					}
+					auto row = Fasta::Char2Index( first[0] );
+					for ( auto col : columns ) {
+							int score;
+							if ( !(ls >> score) ) {
+									throw Error( "missing scores" );
+							}
+							if ( row >= 0 && col >= 0 ) {
+									matrix[row][col] = score;
+									seen[row][col] = true;
+									minScore = min( minScore, score );
+							}
+					}
+			}
+
+			for ( size_t i = 0; i != 20; ++i ) {   // the standard residues are mandatory, in rows and columns
+					for ( size_t j = 0; j != 20; ++j ) {
+							if ( !seen[i][j] ) {
+									throw Error( "the 20 standard residues are expected" );
+							}
+					}
+			}
+			for ( size_t i = 0; i != 24; ++i ) {
+					for ( size_t j = 0; j != 24; ++j ) {
+							if ( !seen[i][j] ) {
+									matrix[i][j] = minScore;
+							}
+					}
+			}
+	}
+
+} // namespace Matrix
@@ -1,8 +1,14 @@
 #ifndef MATRICES_HPP
 #define MATRICES_HPP
 
+#include <cstdint>
+
 namespace Matrix {
 
+	// Identifiers of the substitution matrices, as recorded in mapping files
+	// (File: loaded from a matrix file, only its scores identify it)
+	enum class Id : uint32_t { Pam30 = 0, Blosum62 = 1, File = 2 };
+
 	int const Pam30 [24][24] = {
 		//  A    R    N    D    C    Q    E    G    H    I    L    K    M    F    P    S    T    W    Y    V    B    Z    X    *
 		{   6,  -7,  -4,  -3,  -6,  -4,  -2,  -2,  -7,  -5,  -6,  -7,  -5,  -8,  -2,   0,  -1, -13,  -8,  -2,  -3,  -3,  -3, -17 },
@@ -59,6 +65,17 @@ namespace Matrix {
 		{ -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4,  1 }
 	};
 
+	char const * Name( Id id );
+
+	// Copies the built-in matrix called name (case insensitive) into matrix,
+	// returns false if there is no such built-in
+	bool GetBuiltin( char const * name, Id & id, int (&matrix)[24][24] );
+
+	// Loads a matrix in the NCBI text format: '#' comment lines, a header line listing
+	// the residues of the columns, then one line per residue starting with the residue.
+	// Residues the file does not list (B, Z, X, * for instance) score the matrix minimum.
+	void LoadFile( char const * filename, int (&matrix)[24][24] );
+
 } // namespace Matrix
 
 #endif
@@ -0,0 +1,114 @@
+#ifndef OUTPUTBUFFER_HPP
+#define OUTPUTBUFFER_HPP
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+// Staging buffer in front of a FILE *.  When constructed without a file the
+// data is kept in memory and spilled to an anonymous temporary file past the
+// staging capacity; CopyTo() then appends everything to the final file, or
+// Drain() reads it back.  This is what lets concurrent tasks produce their
+// output independently and have it written back in a deterministic order.
+class OutputBuffer {
+	public:
+		explicit OutputBuffer( FILE * file_ = nullptr, size_t capacity_ = defaultCapacity )
+			: file( file_ )
+			, ownsFile( false )
+			, capacity( capacity_ ) {
+		}
+
+		OutputBuffer( OutputBuffer const & ) = delete;
+		OutputBuffer & operator=( OutputBuffer const & ) = delete;
+
+		~OutputBuffer() {
+				if ( ownsFile ) {
+						fclose( file );
+				}
+		}
+
+	public:
+		static size_t const defaultCapacity = 8 << 20;
+
+	public:
+		// Returns a pointer to at least sz writable bytes, to be committed by Commit()
+		char * Reserve( size_t sz ) {
+				if ( buffer.size() + sz > capacity ) {
+						Flush();
+				}
+				auto curSize = buffer.size();
+				buffer.resize( curSize + sz );
+				reserved = curSize;
+				return buffer.data() + curSize;
+		}
+
+		void Commit( size_t sz ) {
+				buffer.resize( reserved + sz );
+		}
+
+		void Write( void const * data, size_t sz ) {
+				memcpy( Reserve( sz ), data, sz );
+		}
+
+		void Flush() {
+				if ( buffer.empty() ) {
+						return;
+				}
+				if ( !file ) {
+						file = tmpfile();
+						if ( !file ) {
+								throw std::runtime_error{ "Unable to create temporary output file, abording" };
+						}
+						ownsFile = true;
+				}
+				if ( fwrite( buffer.data(), 1, buffer.size(), file ) != buffer.size() ) {
+						throw std::runtime_error{ "Unable to write output, abording" };
+				}
+				buffer.clear();
+		}
+
+		bool Empty() const {
+				return buffer.empty() && !ownsFile;
+		}
+
+		// Appends the content of a file-less buffer to out, then releases it
+		void CopyTo( FILE * out ) {
+				Drain( 1, [out]( char const * data, size_t sz ) {
+						if ( fwrite( data, 1, sz, out ) != sz ) {
+								throw std::runtime_error{ "Unable to write output, abording" };
+						}
+				});
+		}
+
+		// Reads back the content of a file-less buffer, written as records of recordSize
+		// bytes, by calling f( data, sz ) on chunks of whole records, then releases it
+		template< typename F >
+		void Drain( size_t recordSize, F && f ) {
+				if ( ownsFile ) {
+						Flush();
+						rewind( file );
+						std::vector< char > tmp( std::max< size_t >( capacity / recordSize, 1 ) * recordSize );
+						for ( size_t n; (n = fread( tmp.data(), 1, tmp.size(), file )) != 0; ) {
+								f( tmp.data(), n );
+						}
+						fclose( file );
+						file = nullptr;
+						ownsFile = false;
+				} else {
+						f( buffer.data(), buffer.size() );
+				}
+				std::vector< char >{}.swap( buffer );
+		}
+
+	private:
+		FILE * file;
+		bool   ownsFile;
+		size_t capacity;
+		size_t reserved = 0;
+
+		std::vector< char > buffer;
+};
+
+#endif
@@ -1,10 +1,15 @@
 #include "PepTree.hpp"
 
 #include <cstdio>
+#include <cstring>
 #include <cassert>
 #include <queue>
 #include <cstdint>
 #include <limits>
+#include <algorithm>
+#include <stdexcept>
+#include <memory>
+#include <functional>
 #include <boost/range/algorithm/for_each.hpp>
 
 #include <sys/types.h>
@@ -14,6 +19,8 @@
 #include <unistd.h>
 
 #include "Fasta.hpp"
+#include "ThreadPool.hpp"
+#include "OutputBuffer.hpp"
 
 using namespace std;
 using boost::range::for_each;
@@ -49,89 +56,176 @@ size_t Trie::GetLeafCreatePath( char const * seq ) {
 
 namespace {
 
-	size_t LinearizeLeafData( vector< LeafBaseDataType > & arrayLeafData, Trie const & trie, size_t leafIndex ) {
-			auto leaf = trie.GetLeaf( leafIndex );
-			auto curIndex = arrayLeafData.size();
+	// Positions of a leaf, by protein then position, in the encoding of a file version:
+	// 16 bits counts and positions in versions 1 and 2 (flagging the values which do not
+	// fit), delta coded varints from version 3
+	class LeafPosEncoder {
+		public:
+			explicit LeafPosEncoder( uint32_t version )
+				: varint( version >= PepTreeFormat::varintLeafPosVersion ) {
+			}
+
+		public:
+			bool Overflow() const {   return overflow;   }
+
+			vector< LeafBaseDataType > const & Data() const {   return data;   }
+
+			void StartLeaf( size_t nbProteins ) {
+					data.clear();
+					previousProtein = 0;
+					PutCount( nbProteins );
+			}
+
+			void AddProtein( uint32_t protein, size_t nbPositions ) {
+					if ( varint ) {
+							PutVarint( protein - previousProtein );
+					} else {
+							PutBigEndian( protein, 4 );
+					}
+					previousProtein  = protein;
+					previousPosition = 0;
+					PutCount( nbPositions );
+			}
 
-			if ( leaf->positions.size() > numeric_limits< uint16_t >::max() ) {
-					throw std::runtime_error{ "Leaf data vector-of-proteins size overflow, abording" };
+			void AddPosition( size_t position ) {
+					PutCount( varint ? position - previousPosition : position );
+					previousPosition = position;
 			}
-			auto vecSz = static_cast< uint16_t >( leaf->positions.size() );
-			arrayLeafData.push_back( static_cast< LeafBaseDataType >( vecSz >> 8 ) );
-			arrayLeafData.push_back( static_cast< LeafBaseDataType >( vecSz      ) );
 
-			for_each( leaf->positions, [&]( pair< uint32_t, vector< size_t > > const & p ) {
-					auto protIdx = p.first;
-					arrayLeafData.push_back( static_cast< char >( protIdx >> 24 ) );
-					arrayLeafData.push_back( static_cast< char >( protIdx >> 16 ) );
-					arrayLeafData.push_back( static_cast< char >( protIdx >>  8 ) );
-					arrayLeafData.push_back( static_cast< char >( protIdx       ) );
+		private:
+			bool                       varint;
+			bool                       overflow = false;
+			uint32_t                   previousProtein  = 0;
+			size_t                     previousPosition = 0;
+			vector< LeafBaseDataType > data;
 
-					if ( p.second.size() > numeric_limits< uint16_t >::max() ) {
-							throw std::runtime_error{ "Leaf data vector-of-positions size overflow, abording" };
+		private:
+			void PutCount( size_t value ) {
+					if ( varint ) {
+							PutVarint( value );
+					} else {
+							overflow |= value > numeric_limits< uint16_t >::max();
+							PutBigEndian( value, 2 );
 					}
-					uint16_t sz = (uint16_t)p.second.size();
-					arrayLeafData.push_back( (LeafBaseDataType)(sz >> 8) );
-					arrayLeafData.push_back( (LeafBaseDataType)sz );
+			}
 
-					for_each( p.second, [&]( size_t z ) {
-							if ( z > numeric_limits< uint16_t >::max() ) {
-									throw std::runtime_error{ "Leaf data position overflow, abording" };
-							}
-							uint16_t pos = (uint16_t)z;
-							arrayLeafData.push_back( (LeafBaseDataType)(pos >> 8) );
-							arrayLeafData.push_back( (LeafBaseDataType)pos );
-					});
+			void PutBigEndian( uint64_t value, size_t size ) {
+					for ( size_t shift = 8*size; shift != 0; shift -= 8 ) {
+							data.push_back( static_cast< LeafBaseDataType >( value >> (shift - 8) ) );
+					}
+			}
+
+			void PutVarint( uint64_t value ) {
+					for ( ; value >= 0x80; value >>= 7 ) {
+							data.push_back( static_cast< LeafBaseDataType >( value | 0x80 ) );
+					}
+					data.push_back( static_cast< LeafBaseDataType >( value ) );
+			}
+	};
+
+	// Leaf positions section sizes in every encoding
+	struct LeafPosSizes {
+			size_t legacy   = 0;
+			size_t varint   = 0;
+			bool   overflow = false;
+
+			template< typename F >   // encodes a leaf to the given encoder
+			void AddLeaf( LeafPosEncoder & legacyEncoder, LeafPosEncoder & varintEncoder, F && encode ) {
+					encode( legacyEncoder );
+					encode( varintEncoder );
+					legacy += legacyEncoder.Data().size();
+					varint += varintEncoder.Data().size();
+			}
+
+			void Finish( LeafPosEncoder const & legacyEncoder ) {
+					overflow = legacyEncoder.Overflow();
+			}
+	};
+
+	// First version at least minVersion which fits the tree
+	uint32_t ChooseVersion( uint32_t minVersion, uint32_t depth, size_t nbNodes, size_t nbLeaves, size_t legacyLeafPosSize, bool legacyOverflow ) {
+			if ( minVersion >= PepTreeFormat::packedLeavesVersion ) {
+					if ( depth > PepTreeFormat::maxPackedDepth ) {
+							throw std::runtime_error{ "Packed leaves require a depth of at most 12, abording" };
+					}
+					return PepTreeFormat::packedLeavesVersion;
+			}
+			if ( legacyOverflow || minVersion >= PepTreeFormat::varintLeafPosVersion ) {
+					return PepTreeFormat::varintLeafPosVersion;
+			}
+			if ( minVersion >= 2 || MemPepTree::NeedsWideFormat( depth, nbNodes, nbLeaves, legacyLeafPosSize ) ) {
+					return 2;
+			}
+			return 1;
+	}
+
+	void EncodeLeafPositions( LeafPosEncoder & encoder, Trie::Leaf const & leaf ) {
+			encoder.StartLeaf( leaf.positions.size() );
+			for_each( leaf.positions, [&]( pair< uint32_t const, vector< size_t > > const & p ) {
+					encoder.AddProtein( p.first, p.second.size() );
+					for_each( p.second, [&]( size_t z ) {   encoder.AddPosition( z );   } );
 			});
+	}
 
+	size_t LinearizeLeafData( vector< LeafBaseDataType > & arrayLeafData, LeafPosEncoder & encoder, Trie const & trie, size_t leafIndex ) {
+			auto curIndex = arrayLeafData.size();
+			EncodeLeafPositions( encoder, *trie.GetLeaf( leafIndex ) );
+			if ( encoder.Overflow() ) {
+					throw std::runtime_error{ "Leaf data counts or positions overflow the 16 bits of the file version, abording" };
+			}
+			arrayLeafData.insert( arrayLeafData.end(), encoder.Data().begin(), encoder.Data().end() );
 			return curIndex;
 	}
 
 	size_t LinearizeLeaves( vector< LeafBaseDataType > & arrayLeaves
 	                      , vector< LeafBaseDataType > & arrayLeafData
+	                      , LeafPosEncoder & encoder
 	                      , Trie const & trie, size_t leafIndex
 	                      , string const & str
+	                      , bool wide
 	                      ) {
 			size_t curIndex = arrayLeaves.size();
-			size_t strSzIn32b = StringBufferSizeInWords( str.size() );
-			arrayLeaves.resize( curIndex + (strSzIn32b + 1)*sizeof( uint32_t ) );   // reserve size for buffer + link
+			arrayLeaves.resize( curIndex + LeavesLinkSize( str.size(), wide ) );   // reserve size for buffer + link
 			std::copy( begin( str ), end( str ), arrayLeaves.data() + curIndex );
-			size_t link = LinearizeLeafData( arrayLeafData, trie, leafIndex );
-			if ( link > numeric_limits< uint32_t >::max() ) {
+			size_t link = LinearizeLeafData( arrayLeafData, encoder, trie, leafIndex );
+			if ( !wide && link > numeric_limits< uint32_t >::max() ) {
 					throw std::runtime_error{ "Leaf data index overflow, abording" };
 			}
-			arrayLeaves[arrayLeaves.size()-4] = (LeafBaseDataType)(link >> 24);
-			arrayLeaves[arrayLeaves.size()-3] = (LeafBaseDataType)(link >> 16);
-			arrayLeaves[arrayLeaves.size()-2] = (LeafBaseDataType)(link >>  8);
-			arrayLeaves[arrayLeaves.size()-1] = (LeafBaseDataType)link;
-			return curIndex / LeavesLinkSize( trie.Depth() );
+			for ( size_t i = arrayLeaves.size(), shift = 0; shift != (wide ? 64 : 32); shift += 8 ) {
+					arrayLeaves[--i] = (LeafBaseDataType)(link >> shift);
+			}
+			return curIndex / LeavesLinkSize( trie.Depth(), wide );
 	}
 
+	template< typename Node >
 	struct NodeQueueData {
-			size_t                 nodeIndex;
-			string                 genealogy;
-			uint32_t             * updateParent;   // !null if first child and parent 'beginning of children' link is to be updated
-			vector< uint32_t * >   leafUpdates;
+			size_t           nodeIndex;
+			string           genealogy;
+			Node           * updateParent;   // !null if first child and parent 'beginning of children' link is to be updated
+			vector< Node * > leafUpdates;
 	};
 	static size_t const endOfChildrenSentinelIndex = ((size_t)-1);
 	static size_t const rootSentinelIndex          = ((size_t)-2);
 
 	// Complex linearization by breadth first traversal in order for the range
 	// described by node n and n+1 take into account every child leave of the subtree
-	void LinearizeNodes( vector< EncodedNodeType >  & arrayNodes
+	template< typename Node >
+	void LinearizeNodes( vector< Node >             & arrayNodes
 	                   , vector< LeafBaseDataType > & arrayLeaves
 	                   , vector< LeafBaseDataType > & arrayLeafData
+	                   , LeafPosEncoder & encoder
 	                   , Trie const & trie
 	                   ) {
-			queue< NodeQueueData > nodeQueue;
-			nodeQueue.push( NodeQueueData{ rootSentinelIndex, {}, nullptr, {} } );
+			bool const wide = sizeof( Node ) == sizeof( WideEncodedNodeType );
+			queue< NodeQueueData< Node > > nodeQueue;
+			nodeQueue.push( NodeQueueData< Node >{ rootSentinelIndex, {}, nullptr, {} } );
 
 			while ( !nodeQueue.empty() ) {
 					auto nodeData = move( nodeQueue.front() );
 					nodeQueue.pop();
 
 					size_t thisIndex = arrayNodes.size();
-					if ( thisIndex > UINT32_MAX ) {
+					if ( thisIndex > numeric_limits< Node >::max() ) {
 							throw std::runtime_error{ "Node index overflow, abording" };
 					}
 
@@ -144,7 +238,7 @@ namespace {
 							if ( nodeData.updateParent ) {
 									// there is no need to "encode" this link since we are garanteed it's > 0
 									// (no possible link to the first node (to any children of root for the matter))
-									*nodeData.updateParent = static_cast< uint32_t >( thisIndex );
+									*nodeData.updateParent = static_cast< Node >( thisIndex );
 							}
 							arrayNodes[thisIndex] = nodeData.genealogy.back();
 					}
@@ -157,115 +251,410 @@ namespace {
 											if ( nodeData.nodeIndex != rootSentinelIndex ) {
 													nodeData.leafUpdates.push_back( &arrayNodes[thisIndex] );
 											}
-											nodeQueue.push( NodeQueueData{ p.second
-											                             , nodeData.genealogy + p.first
-											                             , &arrayNodes[thisIndex + 1]
-											                             , move( nodeData.leafUpdates )
-											                             } );
+											nodeQueue.push( NodeQueueData< Node >{ p.second
+											                                     , nodeData.genealogy + p.first
+											                                     , &arrayNodes[thisIndex + 1]
+											                                     , move( nodeData.leafUpdates )
+											                                     } );
 											firstChild = false;
 									} else {
-											nodeQueue.push( NodeQueueData{ p.second
-											                             , nodeData.genealogy + p.first
-											                             , nullptr
-											                             , vector< uint32_t * >{}
-											                             } );
+											nodeQueue.push( NodeQueueData< Node >{ p.second
+											                                     , nodeData.genealogy + p.first
+											                                     , nullptr
+											                                     , vector< Node * >{}
+											                                     } );
 									}
 							});
-							nodeQueue.push( NodeQueueData{ endOfChildrenSentinelIndex, {}, nullptr, {} } );
+							nodeQueue.push( NodeQueueData< Node >{ endOfChildrenSentinelIndex, {}, nullptr, {} } );
 					} else {
-							uint32_t childLeafIndex = LinearizeLeaves( arrayLeaves, arrayLeafData
-							                                         , trie, nodeData.nodeIndex
-							                                         , nodeData.genealogy
-							                                         );
-							if ( childLeafIndex > 134217727 ) {   //< 2^27-1 ~ UINT27_MAX
+							size_t childLeafIndex = LinearizeLeaves( arrayLeaves, arrayLeafData, encoder
+							                                       , trie, nodeData.nodeIndex
+							                                       , nodeData.genealogy
+							                                       , wide
+							                                       );
+							if ( childLeafIndex > NodeLinkMask< Node >() ) {
 									throw std::runtime_error{ "Leaf index overflow, abording" };
 							}
 
-							for_each( nodeData.leafUpdates, [childLeafIndex]( uint32_t * linkPtr ) {
-									*linkPtr = CompressComponents( { static_cast< char >( *linkPtr ), childLeafIndex } );
+							auto link = static_cast< Node >( childLeafIndex );
+							for_each( nodeData.leafUpdates, [link]( Node * linkPtr ) {
+									*linkPtr = EncodeNode( static_cast< char >( *linkPtr ), link );
 							});
-							arrayNodes[thisIndex]   = CompressComponents( { nodeData.genealogy.back(), childLeafIndex } );
-							arrayNodes[thisIndex+1] = static_cast< uint32_t >( thisIndex );
+							arrayNodes[thisIndex]   = EncodeNode( nodeData.genealogy.back(), link );
+							arrayNodes[thisIndex+1] = static_cast< Node >( thisIndex );
 					}
 			}
 	}
 
-}
+	// Sizes of the leaf positions section
+	LeafPosSizes LeafDataSizes( Trie const & trie ) {
+			LeafPosSizes   sizes;
+			LeafPosEncoder legacyEncoder( 1 ), varintEncoder( PepTreeFormat::varintLeafPosVersion );
+			for ( size_t i = 0, e = trie.NumLeaves(); i != e; ++i ) {
+					sizes.AddLeaf( legacyEncoder, varintEncoder, [&]( LeafPosEncoder & encoder ) {
+							EncodeLeafPositions( encoder, *trie.GetLeaf( i ) );
+					});
+			}
+			sizes.Finish( legacyEncoder );
+			return sizes;
+	}
 
-MemPepTree Trie::LinearizeTree() const {
-		vector< EncodedNodeType >  arrayNodes;
-		vector< LeafBaseDataType > arrayLeaves;
-		vector< LeafBaseDataType > arrayLeafData;
+	template< typename Node >
+	MemPepTree LinearizeTreeOf( Trie const & trie, uint32_t version ) {
+			bool const wide = sizeof( Node ) == sizeof( WideEncodedNodeType );
+			vector< Node >             arrayNodes;
+			vector< LeafBaseDataType > arrayLeaves;
+			vector< LeafBaseDataType > arrayLeafData;
+
+			// nb link = nb leaves + nb internal*2 (includes leaves link per internal, excluding root) = Leaf::nbLeaves + 2*(Node::nbNodes - 1),
+			//   plus trailing 0s to indicate 'end of children list', which is one per node (including root) = Node::nbNodes
+			arrayNodes.reserve( 2*(trie.NumLeaves() + trie.NumNodes() - 1) + trie.NumNodes() );
+			arrayLeaves.reserve( trie.NumLeaves()*LeavesLinkSize( trie.Depth(), wide ) + 1/*sentinel*/ );
 
-		// nb link = nb leaves + nb internal*2 (includes leaves link per internal, excluding root) = Leaf::nbLeaves + 2*(Node::nbNodes - 1),
-		//   plus trailing 0s to indicate 'end of children list', which is one per node (including root) = Node::nbNodes
-		arrayNodes.reserve( 2*(NumLeaves() + NumNodes() - 1) + NumNodes() );
-		arrayLeaves.reserve( NumLeaves()*(StringBufferSizeInWords( Depth() ) + 1/*link*/)*sizeof( uint32_t ) + 1/*sentinel*/ );
+			LeafPosEncoder encoder( version );
+			LinearizeNodes( arrayNodes, arrayLeaves, arrayLeafData, encoder, trie );
 
-		LinearizeNodes( arrayNodes, arrayLeaves, arrayLeafData, *this );
+			arrayLeaves.push_back( '\0' );   // end of leaves sentinel
 
-		arrayLeaves.push_back( '\0' );   // end of leaves sentinel
+			return MemPepTree{ trie.Depth(), move( arrayNodes ), move( arrayLeaves ), move( arrayLeafData ), version };
+	}
+
+}
 
-		return MemPepTree{ Depth(), move( arrayNodes ), move( arrayLeaves ), move( arrayLeafData ) };
+bool Trie::NeedsVarintLeafPos() const {
+		return LeafDataSizes( *this ).overflow;
 }
 
-static uint32_t const nodesOffset = 3 * sizeof( uint32_t );   // treeDepth + LeavesOffset + LeafDataOffset
+MemPepTree Trie::LinearizeTree( uint32_t minVersion ) const {
+		size_t nbNodes = 2*(NumLeaves() + NumNodes() - 1) + NumNodes();
+		auto   sizes   = LeafDataSizes( *this );
+		auto   version = ChooseVersion( minVersion, Depth(), nbNodes, NumLeaves(), sizes.legacy, sizes.overflow );
+		if ( version >= 2 ) {
+				return LinearizeTreeOf< WideEncodedNodeType >( *this, version );
+		}
+		return LinearizeTreeOf< EncodedNodeType >( *this, version );
+}
+
+static size_t const nodesOffsetV1 = 3 * sizeof( uint32_t );                        // treeDepth + LeavesOffset + LeafDataOffset
+static size_t const nodesOffsetV2 = 4 * sizeof( uint32_t ) + 2 * sizeof( uint64_t );   // magic + version + treeDepth + padding + LeavesOffset + LeafDataOffset
 
 MemPepTree::MemPepTree( uint32_t depth_
                       , std::vector< EncodedNodeType >  && nodes_
                       , std::vector< LeafBaseDataType > && leaves_
                       , std::vector< LeafBaseDataType > && leafPos_
+                      , uint32_t version_
                       )
 	: depth{ depth_ }
+	, version{ version_ }
+	, wide{ false }
 	, nodes{ move( nodes_ ) }
 	, leaves{ move( leaves_ ) }
 	, leafPos{ move( leafPos_ ) } {
+		if ( version != 1 ) {
+				throw std::runtime_error{ "Invalid version for a 32 bits PepTree, abording" };
+		}
+}
+
+MemPepTree::MemPepTree( uint32_t depth_
+                      , std::vector< WideEncodedNodeType > && nodes_
+                      , std::vector< LeafBaseDataType >    && leaves_
+                      , std::vector< LeafBaseDataType >    && leafPos_
+                      , uint32_t version_
+                      )
+	: depth{ depth_ }
+	, version{ version_ }
+	, wide{ true }
+	, wideNodes{ move( nodes_ ) }
+	, leaves{ move( leaves_ ) }
+	, leafPos{ move( leafPos_ ) } {
+		if ( version < 2 || version > PepTreeFormat::currentVersion ) {
+				throw std::runtime_error{ "Invalid version for a 64 bits PepTree, abording" };
+		}
+}
+
+bool MemPepTree::NeedsWideFormat( uint32_t depth, size_t nbNodes, size_t nbLeaves, size_t leafPosSize ) {
+		size_t fileSize = nodesOffsetV1
+		                + nbNodes * sizeof( EncodedNodeType )
+		                + nbLeaves * LeavesLinkSize( depth ) + 1/*sentinel*/
+		                + leafPosSize;
+		return nbLeaves > NodeLinkMask< EncodedNodeType >() || fileSize > numeric_limits< uint32_t >::max();
+}
+
+namespace {
+
+	// Header of a tree of the given sections sizes (in nodes and bytes)
+	void WritePepTreeHeader( FILE * file, uint32_t version, uint32_t depth, size_t nbNodes, size_t leavesSize, size_t leafPosSize ) {
+			if ( version >= 2 ) {
+					uint64_t leavesOffset  = nodesOffsetV2 + nbNodes * sizeof( WideEncodedNodeType );
+					uint64_t leafPosOffset = leavesOffset  + leavesSize;
+
+					uint32_t arr[] = { 0, version, depth, 0 };
+					memcpy( arr, PepTreeFormat::magic, sizeof( PepTreeFormat::magic ) );
+					uint64_t offsets[] = { leavesOffset, leafPosOffset };
+					fwrite( arr      , sizeof( arr[0] )    , sizeof( arr ) / sizeof( arr[0] )        , file );
+					fwrite( offsets  , sizeof( offsets[0] ), sizeof( offsets ) / sizeof( offsets[0] ), file );
+			} else {
+					if ( nodesOffsetV1 + nbNodes * sizeof( EncodedNodeType ) + leavesSize + leafPosSize > numeric_limits< uint32_t >::max() ) {
+							throw std::runtime_error{ "PepTree file too large for version 1, abording" };
+					}
+					auto leavesOffset  = static_cast< uint32_t >( nodesOffsetV1 + nbNodes * sizeof( EncodedNodeType ) );
+					auto leafPosOffset = static_cast< uint32_t >( leavesOffset  + leavesSize );
+
+					uint32_t arr[] = { depth, leavesOffset, leafPosOffset };
+					fwrite( arr, sizeof( arr[0] ), sizeof( arr ) / sizeof( arr[0] ), file );
+			}
+	}
+
+	// Packed word and link of an in memory leaf, padded string and 64 bits big endian link
+	void PackLeaf( LeafBaseDataType const * leaf, uint32_t depth, uint64_t & word, uint64_t & link ) {
+			static struct ResidueCodes {
+					uint8_t codes[256] = {};
+
+					ResidueCodes() {
+							for ( size_t i = 0; PepTreeFormat::residuesInOrder[i]; ++i ) {
+									codes[ static_cast< unsigned char >( PepTreeFormat::residuesInOrder[i] ) ] = static_cast< uint8_t >( i+1 );
+							}
+					}
+			} const residueCodes;
+
+			word = 0;
+			for ( uint32_t i = 0; i != depth; ++i ) {
+					word = (word << 5) | residueCodes.codes[ leaf[i] ];
+			}
+			leaf += LeavesLinkSize( depth, true ) - sizeof( uint64_t );
+			link = 0;
+			for ( size_t i = 0; i != sizeof( uint64_t ); ++i ) {
+					link = (link << 8) | leaf[i];
+			}
+	}
+
 }
 
 void MemPepTree::Write( FILE * file ) const {
-		size_t nodesSize   = nodes.size();
-		size_t leavesSize  = leaves.size();
-		size_t leafPosSize = leafPos.size();
+		size_t nodesSize = wide ? wideNodes.size() : nodes.size();
+		bool const packed = version >= PepTreeFormat::packedLeavesVersion;
+		vector< uint64_t > packedLeaves;   // words then links
+		if ( packed ) {
+				size_t const leafSize = LeavesLinkSize( depth, true );
+				size_t const nbLeaves = leaves.size() / leafSize;   // without the sentinel
+				packedLeaves.resize( 2*nbLeaves );
+				for ( size_t i = 0; i != nbLeaves; ++i ) {
+						PackLeaf( leaves.data() + i*leafSize, depth, packedLeaves[i], packedLeaves[nbLeaves + i] );
+				}
+		}
+		size_t leavesSize = packed ? packedLeaves.size() * sizeof( uint64_t ) : leaves.size();
+		WritePepTreeHeader( file, version, depth, nodesSize, leavesSize, leafPos.size() );
+		if ( wide ) {
+				fwrite( wideNodes.data(), sizeof( WideEncodedNodeType ), nodesSize, file );
+		} else {
+				fwrite( nodes.data(), sizeof( EncodedNodeType ), nodesSize, file );
+		}
+		if ( packed ) {
+				fwrite( packedLeaves.data(), sizeof( uint64_t ), packedLeaves.size(), file );
+		} else {
+				fwrite( leaves.data(), sizeof( LeafBaseDataType ), leaves.size(), file );
+		}
+		fwrite( leafPos.data(), sizeof( LeafBaseDataType ), leafPos.size(), file );
+}
+
+namespace {
+
+	struct ShardSections {
+			vector< WideEncodedNodeType > const * nodes;
+			vector< LeafBaseDataType >    const * leaves;
+			vector< size_t > levelStarts;    // in the shard nodes, the root being level 0
+			vector< size_t > levelOffsets;   // of the shard part of each level in the stitched nodes
+			size_t           leafOffset;
+			size_t           leafPosOffset;
+	};
+
+	uint64_t GetBigEndian( LeafBaseDataType const * p, size_t size ) {
+			uint64_t value = 0;
+			for ( size_t i = 0; i != size; ++i ) {
+					value = (value << 8) | p[i];
+			}
+			return value;
+	}
+
+	template< typename Node >
+	MemPepTree StitchShardsOf( uint32_t depth
+	                         , vector< ShardSections > const & shards
+	                         , size_t nbNodes, size_t nbLeaves
+	                         , vector< LeafBaseDataType > && arrayLeafData
+	                         , uint32_t version
+	                         ) {
+			bool const wide = sizeof( Node ) == sizeof( WideEncodedNodeType );
+			size_t const shardLeafSize = LeavesLinkSize( depth, true );
+			size_t const leafSize      = LeavesLinkSize( depth, wide );
+			size_t const stringSize    = shardLeafSize - sizeof( uint64_t );
+			size_t const linkSize      = leafSize - stringSize;
+
+			vector< Node >             arrayNodes( nbNodes, 0 );   // 0 = end of children sentinel
+			vector< LeafBaseDataType > arrayLeaves( nbLeaves*leafSize + 1/*sentinel*/, 0 );
+
+			for_each( shards, [&]( ShardSections const & shard ) {
+					auto const & nodes = *shard.nodes;
+
+					// Nodes: leaf links shifted by the leaves of the previous shards, children links
+					// moved to the shard part of the next level.  Residues are copied as encoded,
+					// J being encoded as 0 a node of the first leaf might be 0 as a sentinel.
+					for ( size_t d = 1; d <= depth; ++d ) {
+							size_t begin = shard.levelStarts[d];
+							size_t end   = d == 1 ? begin + 2 : shard.levelStarts[d+1];   // root children list sentinel is common
+							for ( size_t i = begin; i != end; ) {
+									if ( nodes[i] == 0 && i != begin ) {
+											++i;
+											continue;
+									}
 
-		EncodedNodeType const  * nodesData   = nodes.data();
-		LeafBaseDataType const * leavesData  = leaves.data();
-		LeafBaseDataType const * leafPosData = leafPos.data();
+									size_t index = shard.levelOffsets[d] + (i - begin);
+									size_t link  = NodeLink( nodes[i] ) + shard.leafOffset;
+									if ( link > NodeLinkMask< Node >() ) {
+											throw std::runtime_error{ "Leaf index overflow, abording" };
+									}
+									auto residueBits = static_cast< Node >( nodes[i] >> NodeLinkBits< WideEncodedNodeType >() );
+									arrayNodes[index]   = (residueBits << NodeLinkBits< Node >()) | static_cast< Node >( link );
+									arrayNodes[index+1] = static_cast< Node >( d < depth ? shard.levelOffsets[d+1] + nodes[i+1] - shard.levelStarts[d+1]
+									                                                     : index
+									                                         );
+									i += 2;
+							}
+					}
+
+					// Leaves: strings and links shifted by the positions of the previous shards
+					auto const & leaves = *shard.leaves;
+					auto out = arrayLeaves.data() + shard.leafOffset*leafSize;
+					for ( size_t i = 0; i + shardLeafSize < leaves.size(); i += shardLeafSize, out += leafSize ) {
+							std::copy( leaves.data() + i, leaves.data() + i + stringSize, out );
+							uint64_t link = GetBigEndian( leaves.data() + i + stringSize, sizeof( uint64_t ) ) + shard.leafPosOffset;
+							if ( !wide && link > numeric_limits< uint32_t >::max() ) {
+									throw std::runtime_error{ "Leaf data index overflow, abording" };
+							}
+							for ( size_t j = linkSize; j-- != 0; link >>= 8 ) {
+									out[stringSize + j] = static_cast< LeafBaseDataType >( link );
+							}
+					}
+			});
 
-		uint32_t leavesOffset  = nodesOffset  + nodesSize  * sizeof( *nodesData );
-		uint32_t leafPosOffset = leavesOffset + leavesSize * sizeof( *leavesData );
+			return MemPepTree{ depth, move( arrayNodes ), move( arrayLeaves ), move( arrayLeafData ), version };
+	}
 
-		uint32_t arr[] = { depth, leavesOffset, leafPosOffset };
-		fwrite( arr        , sizeof( arr[0] )      , sizeof( arr ) / sizeof( arr[0] ), file );
-		fwrite( nodesData  , sizeof( *nodesData )  , nodesSize                       , file );
-		fwrite( leavesData , sizeof( *leavesData ) , leavesSize                      , file );
-		fwrite( leafPosData, sizeof( *leafPosData ), leafPosSize                     , file );
 }
 
-void MMappedPepTree::WriteReadableNodes( FILE * file ) const {
-		uint32_t index = 0;
-		size_t nodeNumber = 0;
-		uint32_t const * p   = GetNodesData();
-		uint32_t const * end = p + GetNodesSize();
-		while( p != end ) {
-				uint32_t val = *p++;
-				auto comp = ExtractComponents( val );
-				char c = GetAAChar( comp );
-				if ( Fasta::IsValidAA( c ) ) {
-						fprintf( file, "(%05zu) %06X: %c %06X\n", nodeNumber++, index++, c, GetIndex( comp ) );
-				} else if ( !val ) {
-						fprintf( file, "        %06X: |\n", index++ );
-				} else {
-						fprintf( file, "        %06X: --> %06X\n", index++, val );
+// Trie::LinearizeTree() lays the nodes out level by level, and a level by parent, so
+// that every level of the whole tree is the concatenation of that level in the shards;
+// only the root children list (one node per shard) is shared
+MemPepTree MemPepTree::Stitch( uint32_t depth, vector< MemPepTree > && trees, uint32_t minVersion ) {
+		size_t const   shardLeafSize = LeavesLinkSize( depth, true );
+		uint32_t const shardVersion  = trees.empty() ? 2 : trees.front().version;
+		if ( shardVersion < PepTreeFormat::varintLeafPosVersion && minVersion >= PepTreeFormat::varintLeafPosVersion ) {
+				throw std::runtime_error{ "PepTree shards must be of version 3 for a tree of version 3, abording" };
+		}
+
+		vector< ShardSections > shards;
+		vector< size_t >        levelSizes( depth + 2, 0 );   // of the stitched nodes, by level
+		size_t nbLeaves = 0, leafPosSize = 0;
+		for_each( trees, [&]( MemPepTree const & tree ) {
+				if ( !tree.wide || tree.version != shardVersion || tree.depth != depth ) {
+						throw std::runtime_error{ "PepTree shards must be of the 64 bits format, and of the same version and depth, abording" };
+				}
+				if ( tree.leaves.size() <= 1 ) {   // only the sentinel
+						return;
+				}
+
+				// Level boundaries, each level holding one children list per node of the previous one
+				ShardSections shard{ &tree.wideNodes, &tree.leaves, vector< size_t >( depth + 2, 0 ), vector< size_t >( depth + 1, 0 ), nbLeaves, leafPosSize };
+				size_t previousLevelSize = 1;
+				for ( size_t d = 1; d <= depth; ++d ) {
+						size_t i = shard.levelStarts[d], lists = 0, levelSize = 0;
+						while ( lists != previousLevelSize ) {
+								if ( i >= tree.wideNodes.size() ) {
+										throw std::runtime_error{ "Invalid PepTree shard, abording" };
+								}
+								// a level starts with a node, whose link to the first leaf might be 0
+								if ( tree.wideNodes[i] == 0 && i != shard.levelStarts[d] ) {
+										++lists;
+										++i;
+								} else {
+										++levelSize;
+										i += 2;
+								}
+						}
+						if ( d == 1 && levelSize != 1 ) {
+								throw std::runtime_error{ "PepTree shards must hold the fragments of a single first residue, abording" };
+						}
+						shard.levelStarts[d+1] = i;
+						previousLevelSize = levelSize;
+				}
+
+				for ( size_t d = 1; d <= depth; ++d ) {
+						shard.levelOffsets[d] = levelSizes[d];
+						levelSizes[d] += d == 1 ? 2 : shard.levelStarts[d+1] - shard.levelStarts[d];
 				}
+				nbLeaves    += (tree.leaves.size() - 1) / shardLeafSize;
+				leafPosSize += tree.leafPos.size();
+				shards.push_back( move( shard ) );
+		});
+
+		// Levels start after the previous ones, the root children list ending with its sentinel
+		levelSizes[1] += 1;
+		size_t nbNodes = 0;
+		for ( size_t d = 1; d <= depth; ++d ) {
+				for_each( shards, [&]( ShardSections & shard ) {   shard.levelOffsets[d] += nbNodes;   });
+				nbNodes += levelSizes[d];
+		}
+
+		vector< LeafBaseDataType > arrayLeafData;
+		arrayLeafData.reserve( leafPosSize );
+		for_each( trees, [&]( MemPepTree const & tree ) {
+				arrayLeafData.insert( arrayLeafData.end(), tree.leafPos.begin(), tree.leafPos.end() );
+		});
+
+		// Leaf positions are kept as encoded in the shards, in version 3 or in the legacy encoding
+		auto version = ChooseVersion( minVersion, depth, nbNodes, nbLeaves, leafPosSize, shardVersion >= PepTreeFormat::varintLeafPosVersion );
+		if ( version >= 2 ) {
+				return StitchShardsOf< WideEncodedNodeType >( depth, shards, nbNodes, nbLeaves, move( arrayLeafData ), version );
+		}
+		return StitchShardsOf< EncodedNodeType >( depth, shards, nbNodes, nbLeaves, move( arrayLeafData ), version );
+}
+
+namespace {
+
+	template< typename Node >
+	void WriteReadableNodesOf( FILE * file, Node const * p, Node const * end ) {
+			size_t index = 0;
+			size_t nodeNumber = 0;
+			while( p != end ) {
+					Node val = *p++;
+					char c = NodeChar( val );
+					if ( Fasta::IsValidAA( c ) ) {
+							fprintf( file, "(%05zu) %06zX: %c %06zX\n", nodeNumber++, index++, c, static_cast< size_t >( NodeLink( val ) ) );
+					} else if ( !val ) {
+							fprintf( file, "        %06zX: |\n", index++ );
+					} else {
+							fprintf( file, "        %06zX: --> %06zX\n", index++, static_cast< size_t >( val ) );
+					}
+			}
+	}
+
+}
+
+void MMappedPepTree::WriteReadableNodes( FILE * file ) const {
+		if ( IsWide() ) {
+				auto p = GetNodesData< WideEncodedNodeType >();
+				WriteReadableNodesOf( file, p, p + GetNodesSize() );
+		} else {
+				auto p = GetNodesData< EncodedNodeType >();
+				WriteReadableNodesOf( file, p, p + GetNodesSize() );
 		}
 }
 
 void MMappedPepTree::WriteReadableLeaves( FILE * file ) const {
-		uint32_t index = 0;
+		size_t index = 0;
 		size_t nodeNumber = 0;
-		ForEachLeaf( [&]( char const * str, uint32_t dataOffset ) {
-				fprintf( file, "(%05zu) %06X: %s -> %06X\n", nodeNumber++, index, str, dataOffset );
-				index += LeavesLinkSize( Depth() );
+		ForEachLeaf( [&]( char const * str, size_t dataOffset ) {
+				fprintf( file, "(%05zu) %06zX: %s -> %06zX\n", nodeNumber++, index, str, dataOffset );
+				index += leafSize;
 		});
 }
 
@@ -276,18 +665,18 @@ namespace {
 			FILE * file;
 			ReadablePrinterFunctor( FILE * f ): firstPos( true ), file( f ) { }
 
-			void ListSize( uint16_t ) {   }
+			void ListSize( size_t ) {   }
 
-			void AddHeader( uint16_t protIndex, uint16_t s ) {
-					fprintf( file, " %06hX[", protIndex );
+			void AddHeader( uint32_t protIndex, size_t ) {
+					fprintf( file, " %06X[", protIndex );
 			}
 			void StopHeader() {   }
 
-			void AddPos( uint16_t p ) {
+			void AddPos( size_t p ) {
 					if ( !firstPos ) {
 							fprintf( file, ", " );
 					}
-					fprintf( file, "%hu", p );
+					fprintf( file, "%zu", p );
 					firstPos = false;
 			}
 			void StopPos() {
@@ -299,10 +688,10 @@ namespace {
 }
 
 void MMappedPepTree::WriteReadableLeafPos( FILE * file ) const {
-		uint32_t index = 0;
+		size_t index = 0;
 		size_t nodeNumber = 0;
 		while ( index < GetLeafPosSize() ) {
-				fprintf( file, "(%05zu) %06X:", nodeNumber++, index );
+				fprintf( file, "(%05zu) %06zX:", nodeNumber++, index );
 				index += ForLeafPos( index, ReadablePrinterFunctor{ file } );
 				fprintf( file, "\n" );
 		}
@@ -317,54 +706,717 @@ void MMappedPepTree::WriteReadableTree( FILE * file ) const {
 }
 
 MMappedPepTree::MMappedPepTree( char const * filename )
-	: fd( open( filename, O_RDONLY ) ) {
-		if ( !fd ) {
-				throw std::runtime_error{ "Unable to open input FastIdx file\n" };
+	: fd( open( filename, O_RDONLY ) )
+	, fileSize( 0 )
+	, ptr( nullptr ) {
+		if ( fd < 0 ) {
+				throw std::runtime_error{ string{ "Unable to open input PepTree file \"" } + filename + '"' };
 		}
 		struct stat fStat;
 		fstat( fd, &fStat );
-		fileSize = static_cast< uint32_t >( fStat.st_size );
+		fileSize = static_cast< size_t >( fStat.st_size );
+		if ( fileSize < nodesOffsetV1 ) {
+				close( fd );
+				throw std::runtime_error{ string{ "Invalid PepTree file \"" } + filename + "\", abording" };
+		}
 		ptr = static_cast< char const * >( mmap( nullptr, fileSize, PROT_READ, MAP_SHARED, fd, 0 ) );
+
+		auto header = reinterpret_cast< uint32_t const * >( ptr );
+		if ( memcmp( ptr, PepTreeFormat::magic, sizeof( PepTreeFormat::magic ) ) != 0 ) {   // version 1 has no magic number
+				version       = 1;
+				depth         = header[0];
+				nodesOffset   = nodesOffsetV1;
+				leavesOffset  = header[1];
+				leafPosOffset = header[2];
+		} else {
+				version = header[1];
+				if ( version < 2 || version > PepTreeFormat::currentVersion || fileSize < nodesOffsetV2 ) {
+						throw std::runtime_error{ string{ "Unsupported PepTree file version in \"" } + filename + "\", abording" };
+				}
+				auto offsets = reinterpret_cast< uint64_t const * >( ptr + 4 * sizeof( uint32_t ) );
+				depth         = header[2];
+				nodesOffset   = nodesOffsetV2;
+				leavesOffset  = offsets[0];
+				leafPosOffset = offsets[1];
+		}
+		if ( HasPackedLeaves() && depth > PepTreeFormat::maxPackedDepth ) {
+				throw std::runtime_error{ string{ "Invalid PepTree file \"" } + filename + "\", packed leaves of more than 12 residues" };
+		}
+		leafSize = HasPackedLeaves() ? 2*sizeof( uint64_t ) : LeavesLinkSize( depth, IsWide() );
+		linkBits = IsWide() ? NodeLinkBits< WideEncodedNodeType >() : NodeLinkBits< EncodedNodeType >();
+		linkMask = IsWide() ? NodeLinkMask< WideEncodedNodeType >() : NodeLinkMask< EncodedNodeType >();
+		nbNodes  = (leavesOffset - nodesOffset) / (IsWide() ? sizeof( WideEncodedNodeType ) : sizeof( EncodedNodeType ));
+		nbLeaves = (leafPosOffset - leavesOffset) / leafSize;
 }
 
 MMappedPepTree::~MMappedPepTree() {
 		close( fd );
 }
 
-uint32_t MMappedPepTree::Depth() const {
-		return reinterpret_cast< uint32_t const * >( ptr )[0];
-}
-
-EncodedNodeType const * MMappedPepTree::GetNodesData() const {
-		return reinterpret_cast< EncodedNodeType const * >( ptr + nodesOffset );
+bool MMappedPepTree::Preload( bool lock ) const {
+		if ( lock && mlock( ptr, fileSize ) == 0 ) {   // locking faults the pages in
+				return true;
+		}
+		madvise( const_cast< char * >( ptr ), fileSize, MADV_WILLNEED );
+		size_t pageSize = static_cast< size_t >( sysconf( _SC_PAGESIZE ) );
+		char volatile touched = 0;
+		for ( size_t i = 0; i < fileSize; i += pageSize ) {
+				touched = ptr[i];
+		}
+		(void)touched;
+		return !lock;
 }
 
 size_t MMappedPepTree::GetNodesSize() const {
-		uint32_t leavesOffset = reinterpret_cast< uint32_t const * >( ptr )[1];
-		return (leavesOffset - nodesOffset) / sizeof( EncodedNodeType );
+		return nbNodes;
 }
 
 LeafBaseDataType const * MMappedPepTree::GetLeavesData() const {
-		uint32_t leavesOffset = reinterpret_cast< uint32_t const * >( ptr )[1];
 		return reinterpret_cast< LeafBaseDataType const * >( ptr + leavesOffset );
 }
 
 size_t MMappedPepTree::GetLeavesSize() const {
-		uint32_t leavesOffset  = reinterpret_cast< uint32_t const * >( ptr )[1];
-		uint32_t leafPosOffset = reinterpret_cast< uint32_t const * >( ptr )[2];
-		return (leafPosOffset - leavesOffset) / LeavesLinkSize( Depth() );
+		return nbLeaves;
 }
 
 LeafBaseDataType const * MMappedPepTree::GetLeafPosData() const {
-		uint32_t leafPosOffset = reinterpret_cast< uint32_t const * >( ptr )[2];
 		return reinterpret_cast< LeafBaseDataType const * >( ptr + leafPosOffset );
 }
 
 size_t MMappedPepTree::GetLeafPosSize() const {
-		uint32_t leafPosOffset = reinterpret_cast< uint32_t const * >( ptr )[2];
 		return fileSize - leafPosOffset;
 }
 
-uint32_t MMappedPepTree::GetNumberLeaves() const {
-		return GetLeavesSize() / LeavesLinkSize( Depth() );
+size_t MMappedPepTree::GetNumberLeaves() const {
+		return nbLeaves;
+}
+
+BitmapNodes::BitmapNodes( uint32_t depth_ )
+	: depth( depth_ )
+	, nbLeaves( 0 )
+	, levels( depth_ + 1 ) {
+		levels[0].masks        .push_back( 0 );   // root
+		levels[0].firstChildren.push_back( 0 );
+		levels[0].leafStarts   .push_back( 0 );
+}
+
+void BitmapNodes::AddLeaf( char const * word, size_t commonPrefix ) {
+		static struct ResidueBits {
+				uint8_t bits[256];
+
+				ResidueBits() {
+						memset( bits, 0xFF, sizeof( bits ) );
+						for ( size_t i = 0; PepTreeFormat::residuesInOrder[i]; ++i ) {
+								bits[ static_cast< unsigned char >( PepTreeFormat::residuesInOrder[i] ) ] = static_cast< uint8_t >( i );
+						}
+				}
+		} const residueBits;
+
+		if ( nbLeaves == numeric_limits< uint32_t >::max() ) {
+				throw runtime_error{ "Too many leaves for the bitmap node layout" };
+		}
+		for ( size_t d = commonPrefix + 1; d <= depth; ++d ) {
+				unsigned   bit    = residueBits.bits[ static_cast< unsigned char >( word[d-1] ) ];
+				Level    & parent = levels[d-1];
+				Level    & level  = levels[d];
+				uint32_t & mask   = parent.masks.back();
+				if ( bit == 0xFF || (mask >> bit) != 0 ) {
+						throw runtime_error{ "Invalid leaves, out of residues order" };
+				}
+				if ( mask == 0 ) {
+						parent.firstChildren.back() = static_cast< uint32_t >( level.leafStarts.size() );
+				}
+				mask |= uint32_t( 1 ) << bit;
+				level.leafStarts.push_back( static_cast< uint32_t >( nbLeaves ) );
+				if ( d < depth ) {
+						level.masks        .push_back( 0 );
+						level.firstChildren.push_back( 0 );
+				}
+		}
+		++nbLeaves;
+}
+
+void BitmapNodes::Finish() {
+		vector< size_t > levelOffsets( depth + 2, 0 );   // of the first node of each level
+		for ( size_t d = 0; d <= depth; ++d ) {
+				levelOffsets[d+1] = levelOffsets[d] + levels[d].leafStarts.size() + 1;   // and the end of the level
+		}
+		if ( levelOffsets.back() > numeric_limits< uint32_t >::max() ) {
+				throw runtime_error{ "Too many nodes for the bitmap node layout" };
+		}
+
+		masks        .reserve( levelOffsets[depth] );
+		firstChildren.reserve( levelOffsets[depth] );
+		leafStarts   .reserve( levelOffsets.back() );
+		for ( size_t d = 0; d <= depth; ++d ) {
+				Level & level = levels[d];
+				if ( d < depth ) {
+						masks.insert( masks.end(), level.masks.begin(), level.masks.end() );
+						masks.push_back( 0 );
+						for ( uint32_t first : level.firstChildren ) {
+								firstChildren.push_back( static_cast< uint32_t >( levelOffsets[d+1] + first ) );
+						}
+						firstChildren.push_back( 0 );
+				}
+				leafStarts.insert( leafStarts.end(), level.leafStarts.begin(), level.leafStarts.end() );
+				leafStarts.push_back( static_cast< uint32_t >( nbLeaves ) );
+				level = Level();
+		}
+}
+
+BitmapPepTree::BitmapPepTree( MMappedPepTree const & tree_ )
+	: tree( tree_ )
+	, nodes( tree_.Depth() ) {
+		string previous;
+		tree.ForEachLeaf( [&]( char const * str, size_t ) {
+				size_t common = 0;
+				while ( common != previous.size() && previous[common] == str[common] ) {
+						++common;
+				}
+				nodes.AddLeaf( str, common );
+				previous.assign( str, tree.Depth() );
+		});
+		nodes.Finish();
+}
+
+namespace {
+
+	// The code of a residue is its rank + 1
+	using PepTreeFormat::residuesInOrder;
+
+	void PutBigEndian( LeafBaseDataType * p, uint64_t value, size_t size ) {
+			for ( size_t i = size; i-- != 0; value >>= 8 ) {
+					p[i] = static_cast< LeafBaseDataType >( value );
+			}
+	}
+
+	// Sections kept in memory, for a MemPepTree
+	template< typename Node >
+	struct MemorySections {
+			typedef Node NodeType;
+
+			vector< Node >             arrayNodes;
+			vector< LeafBaseDataType > arrayLeaves;
+			vector< LeafBaseDataType > arrayLeafData;
+
+			MemorySections( size_t nbNodes, size_t leavesSize, size_t leafPosSize )
+				: arrayNodes( nbNodes, 0 ) {
+					arrayLeaves.reserve( leavesSize );
+					arrayLeafData.reserve( leafPosSize );
+			}
+
+			void AddNode( size_t, size_t index, Node value ) {
+					arrayNodes[index] = value;
+			}
+
+			void AddLeaf( LeafBaseDataType const * data, size_t size ) {
+					arrayLeaves.insert( arrayLeaves.end(), data, data + size );
+			}
+
+			void AddLeafPos( LeafBaseDataType const * data, size_t size ) {
+					arrayLeafData.insert( arrayLeafData.end(), data, data + size );
+			}
+	};
+
+	// Buffered reading of a run of sorted records
+	struct RunReader {
+			FILE                              * file;
+			size_t                              remaining;
+			vector< PackedFragments::Record >   buffer;
+			size_t                              next = 0;
+
+			bool Empty() const {   return next == buffer.size() && remaining == 0;   }
+
+			PackedFragments::Record const & Front() {
+					if ( next == buffer.size() ) {
+							buffer.resize( std::min( buffer.capacity(), remaining ) );
+							if ( fread( buffer.data(), sizeof( buffer[0] ), buffer.size(), file ) != buffer.size() ) {
+									throw std::runtime_error{ "Unable to read back sorted fragments, abording" };
+							}
+							remaining -= buffer.size();
+							next = 0;
+					}
+					return buffer[next];
+			}
+	};
+
+}
+
+PackedFragments::PackedFragments( uint32_t treeDepth, size_t nbThreads_, size_t memoryLimit )
+	: depth( treeDepth )
+	, nbThreads( nbThreads_ )
+	, maxRecords( memoryLimit / (2*sizeof( Record )) )   // records and sorting buffer
+	, nbSpilled( 0 ) {
+		if ( depth == 0 || depth > maxDepth ) {
+				throw std::runtime_error{ "Sorted PepTree construction requires a depth between 1 and 12, abording" };
+		}
+		if ( memoryLimit != 0 && maxRecords < minRunSize ) {
+				throw std::runtime_error{ "Memory limit too low for sorted PepTree construction, abording" };
+		}
+		memset( codes, 0, sizeof( codes ) );
+		for ( size_t i = 0; residuesInOrder[i]; ++i ) {
+				codes[ static_cast< unsigned char >( residuesInOrder[i] ) ] = static_cast< uint8_t >( i+1 );
+		}
+		if ( maxRecords != 0 ) {
+				records.reserve( maxRecords );
+		}
+}
+
+PackedFragments::~PackedFragments() {
+		for_each( runs, []( FILE * run ) {   fclose( run );   } );
+}
+
+char PackedFragments::ResidueAt( uint64_t word, size_t level ) const {
+		return residuesInOrder[ ((word >> 5*(depth - level)) & 31) - 1 ];
+}
+
+void PackedFragments::Sort() {
+		if ( runs.empty() ) {
+				SortRecords();
+		} else {
+				if ( !records.empty() ) {
+						Spill();
+				}
+				vector< Record >{}.swap( records );
+				while ( runs.size() > MaxMergedRuns() ) {
+						MergeRuns( runs.size() - MaxMergedRuns(), runs.size() );
+				}
+		}
+}
+
+// Stable LSD radix sort on the packed words, each pass counting then scattering
+// contiguous parts of the records concurrently
+void PackedFragments::SortRecords() {
+		static unsigned const digitBits = 11;
+		static size_t   const nbBuckets = size_t( 1 ) << digitBits;
+
+		WorkStealingPool pool( nbThreads );
+		size_t const nbParts = pool.NumThreads();
+		auto PartBegin = [&]( size_t p ) {   return p * records.size() / nbParts;   };
+
+		vector< Record > buffer( records.size() );
+		vector< size_t > offsets( nbParts * nbBuckets );
+		for ( unsigned shift = 0; shift < 5*depth; shift += digitBits ) {
+				fill( offsets.begin(), offsets.end(), 0 );
+				pool.Run( nbParts, [&]( size_t, size_t p ) {
+						auto count = offsets.data() + p*nbBuckets;
+						for ( size_t i = PartBegin( p ), e = PartBegin( p+1 ); i != e; ++i ) {
+								++count[ (records[i].word >> shift) & (nbBuckets-1) ];
+						}
+				});
+
+				// Bucket major, part minor, so that the parts keep their order within a bucket
+				bool sameDigit = false;
+				for ( size_t b = 0, offset = 0; b != nbBuckets; ++b ) {
+						size_t bucketStart = offset;
+						for ( size_t p = 0; p != nbParts; ++p ) {
+								auto count = offsets[p*nbBuckets + b];
+								offsets[p*nbBuckets + b] = offset;
+								offset += count;
+						}
+						sameDigit |= offset - bucketStart == records.size();
+				}
+				if ( sameDigit ) {   // nothing to reorder
+						continue;
+				}
+
+				pool.Run( nbParts, [&]( size_t, size_t p ) {
+						auto offset = offsets.data() + p*nbBuckets;
+						for ( size_t i = PartBegin( p ), e = PartBegin( p+1 ); i != e; ++i ) {
+								buffer[ offset[ (records[i].word >> shift) & (nbBuckets-1) ]++ ] = records[i];
+						}
+				});
+				records.swap( buffer );
+		}
+}
+
+void PackedFragments::Spill() {
+		SortRecords();
+
+		FILE * run = tmpfile();
+		if ( !run ) {
+				throw std::runtime_error{ "Unable to create temporary fragments file, abording" };
+		}
+		runs.push_back( run );
+		if ( fwrite( records.data(), sizeof( Record ), records.size(), run ) != records.size() ) {
+				throw std::runtime_error{ "Unable to write sorted fragments, abording" };
+		}
+		runSizes.push_back( records.size() );
+		runLevels.push_back( 0 );
+		++nbSpilledRuns;
+		nbSpilled += records.size();
+		records.clear();
+
+		// the levels of the runs never increase, the last ones being the smallest
+		size_t fanIn = MaxMergedRuns();
+		while ( runs.size() >= fanIn && runLevels[runs.size() - fanIn] == runLevels.back() ) {
+				MergeRuns( runs.size() - fanIn, runs.size() );
+		}
+}
+
+// The records being still allocated while spilling, the read buffers of the runs and the
+// output buffer of a merge share the sorting buffer part of the limit
+size_t PackedFragments::MaxMergedRuns() const {
+		return std::max< size_t >( std::min( maxRecords / minRunSize, maxOpenRuns ), 2 );
+}
+
+void PackedFragments::MergeRuns( size_t first, size_t last ) {
+		FILE * merged = tmpfile();
+		if ( !merged ) {
+				throw std::runtime_error{ "Unable to create temporary fragments file, abording" };
+		}
+		size_t bufferSize = maxRecords / (last - first + 1);
+		vector< Record > output;
+		output.reserve( bufferSize );
+		auto WriteOutput = [&]() {
+				if ( fwrite( output.data(), sizeof( Record ), output.size(), merged ) != output.size() ) {
+						fclose( merged );
+						throw std::runtime_error{ "Unable to write sorted fragments, abording" };
+				}
+				output.clear();
+		};
+		ForEachMergedRecord( first, last, bufferSize, [&]( Record const & record ) {
+				output.push_back( record );
+				if ( output.size() == bufferSize ) {
+						WriteOutput();
+				}
+		});
+		WriteOutput();
+
+		size_t size = 0, level = 0;
+		for ( size_t r = first; r != last; ++r ) {
+				fclose( runs[r] );
+				size  += runSizes[r];
+				level  = std::max( level, runLevels[r] + 1 );
+		}
+		runs     .erase( runs.begin()      + first + 1, runs.begin()      + last );
+		runSizes .erase( runSizes.begin()  + first + 1, runSizes.begin()  + last );
+		runLevels.erase( runLevels.begin() + first + 1, runLevels.begin() + last );
+		runs[first]      = merged;
+		runSizes[first]  = size;
+		runLevels[first] = level;
+}
+
+// Runs are merged by word then by run, runs being in fragments order, which keeps the
+// occurrences of a word by protein and position
+template< typename F >
+void PackedFragments::ForEachMergedRecord( size_t first, size_t last, size_t bufferSize, F && f ) const {
+		vector< RunReader > readers;
+		for ( size_t r = first; r != last; ++r ) {
+				rewind( runs[r] );
+				readers.push_back( RunReader{ runs[r], runSizes[r], {}, 0 } );
+				readers.back().buffer.reserve( bufferSize );
+		}
+
+		typedef pair< uint64_t, size_t > HeapEntry;   // word, run
+		priority_queue< HeapEntry, vector< HeapEntry >, greater< HeapEntry > > heap;
+		for ( size_t r = 0; r != readers.size(); ++r ) {
+				if ( !readers[r].Empty() ) {
+						heap.emplace( readers[r].Front().word, r );
+				}
+		}
+		while ( !heap.empty() ) {
+				auto & reader = readers[ heap.top().second ];
+				heap.pop();
+				f( reader.Front() );
+				++reader.next;
+				if ( !reader.Empty() ) {
+						heap.emplace( reader.Front().word, &reader - readers.data() );
+				}
+		}
+}
+
+template< typename F >
+void PackedFragments::ForEachWord( F && f ) const {
+		vector< Record > occurrences;
+		auto Group = [&]( Record const & record ) {
+				if ( !occurrences.empty() && occurrences.back().word != record.word ) {
+						f( occurrences.front().word, occurrences );
+						occurrences.clear();
+				}
+				occurrences.push_back( record );
+		};
+
+		if ( runs.empty() ) {
+				for_each( records, Group );
+		} else {
+				ForEachMergedRecord( 0, runs.size(), maxRecords / runs.size(), Group );
+		}
+
+		if ( !occurrences.empty() ) {
+				f( occurrences.front().word, occurrences );
+		}
+}
+
+namespace {
+
+	void EncodeOccurrences( LeafPosEncoder & encoder, vector< PackedFragments::Record > const & occurrences ) {
+			size_t nbProteins = 0;
+			for ( size_t i = 0, e = occurrences.size(); i != e; ++i ) {
+					nbProteins += i == 0 || occurrences[i].protein != occurrences[i-1].protein;
+			}
+			encoder.StartLeaf( nbProteins );
+			for ( size_t i = 0, e = occurrences.size(); i != e; ) {
+					size_t start = i;
+					for ( ; i != e && occurrences[i].protein == occurrences[start].protein; ++i ) {   }
+					encoder.AddProtein( occurrences[start].protein, i - start );
+					for ( size_t j = start; j != i; ++j ) {
+							encoder.AddPosition( occurrences[j].position );
+					}
+			}
+	}
+
+}
+
+PackedFragments::Layout PackedFragments::Measure() const {
+		Layout layout{ vector< size_t >( depth + 1, 0 ), vector< size_t >( depth + 2, 0 ), 0, 0, 0, false };
+		layout.levelSizes[0] = 1;
+		LeafPosSizes   sizes;
+		LeafPosEncoder legacyEncoder( 1 ), varintEncoder( PepTreeFormat::varintLeafPosVersion );
+		bool     first    = true;
+		uint64_t previous = 0;
+		ForEachWord( [&]( uint64_t word, vector< Record > const & occurrences ) {
+				for ( size_t d = first ? 1 : CommonPrefix( previous, word ) + 1; d <= depth; ++d ) {
+						++layout.levelSizes[d];
+				}
+				++layout.nbLeaves;
+				sizes.AddLeaf( legacyEncoder, varintEncoder, [&]( LeafPosEncoder & encoder ) {
+						EncodeOccurrences( encoder, occurrences );
+				});
+				previous = word;
+				first    = false;
+		});
+		sizes.Finish( legacyEncoder );
+		layout.legacyLeafPosSize = sizes.legacy;
+		layout.varintLeafPosSize = sizes.varint;
+		layout.legacyOverflow    = sizes.overflow;
+
+		// The root children list is at level 1, then every level holds the children lists
+		// of the nodes of the previous one, each ended by a 0 sentinel
+		for ( size_t d = 1; d <= depth; ++d ) {
+				layout.levelStarts[d+1] = layout.levelStarts[d] + 2*layout.levelSizes[d] + layout.levelSizes[d-1];
+		}
+		return layout;
+}
+
+uint32_t PackedFragments::ChooseVersion( Layout const & layout, uint32_t minVersion ) const {
+		return ::ChooseVersion( minVersion, depth, layout.levelStarts.back(), layout.nbLeaves, layout.legacyLeafPosSize, layout.legacyOverflow );
+}
+
+MemPepTree PackedFragments::LinearizeTree( uint32_t minVersion ) const {
+		auto layout  = Measure();
+		auto version = ChooseVersion( layout, minVersion );
+		auto leafPosSize = version >= PepTreeFormat::varintLeafPosVersion ? layout.varintLeafPosSize : layout.legacyLeafPosSize;
+		auto Linearize = [&]( auto sections ) {
+				Emit( layout, version, sections );
+				sections.arrayLeaves.push_back( '\0' );   // end of leaves sentinel
+				return MemPepTree{ depth, move( sections.arrayNodes ), move( sections.arrayLeaves ), move( sections.arrayLeafData ), version };
+		};
+		if ( version >= 2 ) {
+				return Linearize( MemorySections< WideEncodedNodeType >( layout.levelStarts.back(), layout.nbLeaves*LeavesLinkSize( depth, true ) + 1, leafPosSize ) );
+		}
+		return Linearize( MemorySections< EncodedNodeType >( layout.levelStarts.back(), layout.nbLeaves*LeavesLinkSize( depth ) + 1, leafPosSize ) );
+}
+
+// The sections are streamed to temporaries in a single pass over the sorted records, the
+// spilled runs being merged once, before the layout and thus the version are known: the
+// nodes of every level as wide nodes, their links relative to the level they point to,
+// and the leaves along with the offsets of their positions in both encodings.  They are
+// then appended to the file in the chosen version, the links being relocated.
+void PackedFragments::WriteTree( FILE * file, uint32_t minVersion ) const {
+		size_t bufferSize = maxRecords != 0 ? std::min( OutputBuffer::defaultCapacity, maxRecords*sizeof( Record ) / (depth + 5) )
+		                                    : OutputBuffer::defaultCapacity;
+		bool const packed     = minVersion >= PepTreeFormat::packedLeavesVersion;
+		bool const varintOnly = minVersion >= PepTreeFormat::varintLeafPosVersion;
+
+		vector< std::unique_ptr< OutputBuffer > > levels;
+		for ( size_t d = 0; d <= depth; ++d ) {
+				levels.emplace_back( new OutputBuffer( nullptr, bufferSize ) );
+		}
+		OutputBuffer leaves( nullptr, bufferSize );      // words, then both offsets unless packed
+		OutputBuffer leafLinks( nullptr, bufferSize );   // packed leaves only
+		OutputBuffer legacyPos( nullptr, bufferSize ), varintPos( nullptr, bufferSize );
+
+		vector< size_t > levelSizes( depth + 1, 0 );   // nodes written so far, sentinels included
+		auto PadLevel = [&]( size_t d, size_t size ) {
+				WideEncodedNodeType const zero = 0;
+				for ( ; levelSizes[d] < size; ++levelSizes[d] ) {
+						levels[d]->Write( &zero, sizeof( zero ) );
+				}
+		};
+		auto AddNode = [&]( size_t d, size_t index, WideEncodedNodeType value ) {   // index in the level
+				PadLevel( d, index );
+				levels[d]->Write( &value, sizeof( value ) );
+				++levelSizes[d];
+		};
+
+		Layout layout{ vector< size_t >( depth + 1, 0 ), vector< size_t >( depth + 2, 0 ), 0, 0, 0, false };
+		auto & ranks = layout.levelSizes;   // nodes met so far by level
+		ranks[0] = 1;
+		LeafPosSizes   sizes;
+		LeafPosEncoder legacyEncoder( 1 ), varintEncoder( PepTreeFormat::varintLeafPosVersion );
+		uint64_t previous = 0;
+		ForEachWord( [&]( uint64_t word, vector< Record > const & occurrences ) {
+				if ( layout.nbLeaves > NodeLinkMask< WideEncodedNodeType >() ) {
+						throw std::runtime_error{ "Leaf index overflow, abording" };
+				}
+				for ( size_t d = layout.nbLeaves == 0 ? 1 : CommonPrefix( previous, word ) + 1; d <= depth; ++d ) {
+						size_t rank  = ranks[d]++;
+						size_t index = 2*rank + ranks[d-1]-1;
+						AddNode( d, index  , EncodeNode( ResidueAt( word, d ), static_cast< WideEncodedNodeType >( layout.nbLeaves ) ) );
+						AddNode( d, index+1, d < depth ? 2*ranks[d+1] + rank : index );
+				}
+
+				uint64_t offsets[] = { word, sizes.legacy, sizes.varint };
+				sizes.AddLeaf( legacyEncoder, varintEncoder, [&]( LeafPosEncoder & encoder ) {
+						EncodeOccurrences( encoder, occurrences );
+				});
+				if ( packed ) {
+						leaves   .Write( &offsets[0], sizeof( offsets[0] ) );
+						leafLinks.Write( &offsets[2], sizeof( offsets[2] ) );
+				} else {
+						leaves.Write( offsets, sizeof( offsets ) );
+				}
+				if ( !varintOnly ) {
+						legacyPos.Write( legacyEncoder.Data().data(), legacyEncoder.Data().size() );
+				}
+				varintPos.Write( varintEncoder.Data().data(), varintEncoder.Data().size() );
+
+				++layout.nbLeaves;
+				previous = word;
+		});
+		sizes.Finish( legacyEncoder );
+		layout.legacyLeafPosSize = sizes.legacy;
+		layout.varintLeafPosSize = sizes.varint;
+		layout.legacyOverflow    = sizes.overflow;
+		for ( size_t d = 1; d <= depth; ++d ) {
+				layout.levelStarts[d+1] = layout.levelStarts[d] + 2*layout.levelSizes[d] + layout.levelSizes[d-1];
+		}
+		auto const & levelStarts = layout.levelStarts;
+		auto version = ChooseVersion( layout, minVersion );
+		bool const varint = version >= PepTreeFormat::varintLeafPosVersion;
+
+		auto Append = [&]( auto zero ) {
+				typedef decltype( zero ) Node;
+				bool const wide = sizeof( Node ) == sizeof( WideEncodedNodeType );
+				size_t const leafSize   = LeavesLinkSize( depth, wide );
+				size_t const leavesSize = packed ? 2*sizeof( uint64_t )*layout.nbLeaves : leafSize*layout.nbLeaves + 1/*sentinel*/;
+				WritePepTreeHeader( file, version, depth, levelStarts.back(), leavesSize, varint ? sizes.varint : sizes.legacy );
+
+				// Levels are completed with their remaining end of children sentinels, the
+				// link following every node
+				OutputBuffer out( file, bufferSize );
+				for ( size_t d = 1; d <= depth; ++d ) {
+						PadLevel( d, levelStarts[d+1] - levelStarts[d] );
+						size_t const linkBase = d < depth ? levelStarts[d+1] : levelStarts[d];
+						bool link = false;
+						levels[d]->Drain( sizeof( WideEncodedNodeType ), [&]( char const * data, size_t size ) {
+								for ( size_t i = 0; i != size; i += sizeof( WideEncodedNodeType ) ) {
+										WideEncodedNodeType value;
+										memcpy( &value, data + i, sizeof( value ) );
+										Node node = zero;
+										if ( link ) {
+												node = static_cast< Node >( linkBase + value );
+										} else if ( value != 0 ) {
+												auto leafIndex = NodeLink( value );
+												if ( leafIndex > NodeLinkMask< Node >() ) {
+														throw std::runtime_error{ "Leaf index overflow, abording" };
+												}
+												node = static_cast< Node >( static_cast< Node >( value >> NodeLinkBits< WideEncodedNodeType >() ) << NodeLinkBits< Node >() )
+												     | static_cast< Node >( leafIndex );
+										}
+										link = !link && value != 0;
+										out.Write( &node, sizeof( node ) );
+								}
+						});
+				}
+
+				// Leaves, string and link to their positions unless packed
+				if ( packed ) {
+						out.Flush();
+						leaves   .CopyTo( file );
+						leafLinks.CopyTo( file );
+				} else {
+						vector< LeafBaseDataType > leaf( leafSize );
+						leaves.Drain( 3*sizeof( uint64_t ), [&]( char const * data, size_t size ) {
+								for ( size_t i = 0; i != size; i += 3*sizeof( uint64_t ) ) {
+										uint64_t offsets[3];
+										memcpy( offsets, data + i, sizeof( offsets ) );
+										fill( leaf.begin(), leaf.end(), 0 );
+										for ( size_t d = 1; d <= depth; ++d ) {
+												leaf[d-1] = ResidueAt( offsets[0], d );
+										}
+										uint64_t leafPosSize = offsets[varint ? 2 : 1];
+										if ( !wide && leafPosSize > numeric_limits< uint32_t >::max() ) {
+												throw std::runtime_error{ "Leaf data index overflow, abording" };
+										}
+										PutBigEndian( leaf.data() + leafSize - (wide ? 8 : 4), leafPosSize, wide ? 8 : 4 );
+										out.Write( leaf.data(), leafSize );
+								}
+						});
+						LeafBaseDataType const sentinel = '\0';
+						out.Write( &sentinel, 1 );
+						out.Flush();
+				}
+				(varint ? varintPos : legacyPos).CopyTo( file );
+		};
+		if ( version >= 2 ) {
+				Append( WideEncodedNodeType{ 0 } );
+		} else {
+				Append( EncodedNodeType{ 0 } );
+		}
+}
+
+// The breadth first layout of Trie::LinearizeTree() is level major: the children lists
+// of level d are laid out by parent, each of them followed by its 0 sentinel.  Since
+// words come sorted, a node is first met with the first leaf of its subtree, and its
+// first child is the next node of the next level.
+template< typename Sections >
+void PackedFragments::Emit( Layout const & layout, uint32_t version, Sections & sections ) const {
+		typedef typename Sections::NodeType Node;
+		bool const wide = sizeof( Node ) == sizeof( WideEncodedNodeType );
+		size_t const leafSize = LeavesLinkSize( depth, wide );
+		auto const & levelStarts = layout.levelStarts;
+
+		vector< LeafBaseDataType > leaf( leafSize );
+		LeafPosEncoder             encoder( version );
+		vector< size_t > ranks( depth + 1, 0 );   // nodes met so far by level
+		ranks[0] = 1;
+		size_t   leafIndex = 0, leafPosSize = 0;
+		uint64_t previous  = 0;
+		ForEachWord( [&]( uint64_t word, vector< Record > const & occurrences ) {
+				if ( leafIndex > NodeLinkMask< Node >() ) {
+						throw std::runtime_error{ "Leaf index overflow, abording" };
+				}
+
+				// new nodes, from the first level which differs from the previous word
+				for ( size_t d = leafIndex == 0 ? 1 : CommonPrefix( previous, word ) + 1; d <= depth; ++d ) {
+						size_t rank  = ranks[d]++;
+						size_t index = levelStarts[d] + 2*rank + ranks[d-1]-1;
+						sections.AddNode( d, index  , EncodeNode( ResidueAt( word, d ), static_cast< Node >( leafIndex ) ) );
+						sections.AddNode( d, index+1, static_cast< Node >( d < depth ? levelStarts[d+1] + 2*ranks[d+1] + rank : index ) );
+				}
+
+				// leaf: string and link to its positions
+				fill( leaf.begin(), leaf.end(), 0 );
+				for ( size_t d = 1; d <= depth; ++d ) {
+						leaf[d-1] = ResidueAt( word, d );
+				}
+				if ( !wide && leafPosSize > numeric_limits< uint32_t >::max() ) {
+						throw std::runtime_error{ "Leaf data index overflow, abording" };
+				}
+				PutBigEndian( leaf.data() + leafSize - (wide ? 8 : 4), leafPosSize, wide ? 8 : 4 );
+				sections.AddLeaf( leaf.data(), leafSize );
+
+				// positions, by protein
+				EncodeOccurrences( encoder, occurrences );
+				if ( encoder.Overflow() ) {
+						throw std::runtime_error{ "Leaf data counts or positions overflow the 16 bits of the file version, abording" };
+				}
+				sections.AddLeafPos( encoder.Data().data(), encoder.Data().size() );
+				leafPosSize += encoder.Data().size();
+
+				++leafIndex;
+				previous = word;
+		});
 }
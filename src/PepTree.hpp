@@ -10,17 +10,73 @@
 #include <utility>
 #include <tuple>
 #include <sstream>
+#include <algorithm>
+#include <climits>
 
 #include "Fasta.hpp"
 
-// ~~~ Vector Based Tree ~~~ //
-#define NB_BITS_FOR_LINK 27U
-//#define BITS_FOR_LINK_MASK ((-1U)>>(32-NB_BITS_FOR_LINK))
-#define BITS_FOR_LINK_MASK ((unsigned)(1<<(NB_BITS_FOR_LINK))-1)
-#define BITS_FOR_CHAR_MASK ~BITS_FOR_LINK_MASK
+// ~~~ PepTree files ~~~ //
+// A PepTree file holds the nodes, leaves and leaf positions sections of a linearized trie.
+// Version 1 (legacy, no magic number):
+//    [depth:u32][leavesOffset:u32][leafPosOffset:u32][nodes:u32...][leaves][leafPos]
+// nodes being (residue+1)<<27 | link, and every leaf its padded string followed by
+// the 32 bits big endian offset of its positions.  Version 2 lifts the 4 GB file and
+// 2^27 leaves limits:
+//    ["PTRE"][version:u32][depth:u32][0:u32][leavesOffset:u64][leafPosOffset:u64][nodes:u64...][leaves][leafPos]
+// nodes being (residue+1)<<59 | link, and leaf position offsets 64 bits big endian.
+// The leaf positions of a leaf are, in versions 1 and 2, big endian:
+//    [nbProteins:u16] then by protein [protein:u32][nbPositions:u16][position:u16...]
+// Version 3 has the layout of version 2 with LEB128 varint leaf positions, lifting their
+// 16 bits limits, proteins and positions being delta coded from the previous ones:
+//    [nbProteins] then by protein [protein-previous][nbPositions][position-previous...]
+// Version 4 has the layout of version 3 with the leaves in two aligned columns, packed
+// words then links, and no sentinel:
+//    [word:u64...][leafPosOffset:u64...]
+// words holding the codes of their residues (rank in residuesInOrder + 1) on 5 bits, the
+// first residue in the high bits, for trees of at most 12 residues fragments.
+// Writers only use version 2 when a tree does not fit version 1, and version 3 when its
+// positions do not fit either (or when asked to), version 4 only when asked to; readers
+// map all of them.
+namespace PepTreeFormat {
+
+	char     const magic[4]             = { 'P', 'T', 'R', 'E' };
+	uint32_t const currentVersion       = 4;
+	uint32_t const varintLeafPosVersion = 3;
+	uint32_t const packedLeavesVersion  = 4;
+	uint32_t const maxPackedDepth       = 12;   // 5 bits residues in a 64 bits word
+
+	// Valid residues in ASCII order, the order of the children of every node
+	char     const residuesInOrder[]    = "*ABCDEFGHIJKLMNPQRSTVWXYZ";
+
+	// String of depth residues of a packed leaf word, str holding depth+1 chars
+	inline void UnpackLeaf( uint64_t word, uint32_t depth, char * str ) {
+			str[depth] = '\0';
+			for ( uint32_t i = depth; i-- != 0; word >>= 5 ) {
+					str[i] = residuesInOrder[ (word & 31) - 1 ];
+			}
+	}
+
+	inline uint64_t GetVarint( unsigned char const * & p ) {
+			uint64_t value = *p++;
+			if ( value < 0x80 ) {   // most counts and deltas
+					return value;
+			}
+			value &= 0x7F;
+			for ( unsigned shift = 7; ; shift += 7 ) {
+					uint64_t byte = *p++;
+					value |= (byte & 0x7F) << shift;
+					if ( byte < 0x80 ) {
+							return value;
+					}
+			}
+	}
+
+} // namespace PepTreeFormat
 
+// ~~~ Vector Based Tree ~~~ //
 typedef unsigned char Byte;
-typedef uint32_t      EncodedNodeType;
+typedef uint32_t      EncodedNodeType;       // version 1 nodes
+typedef uint64_t      WideEncodedNodeType;   // version 2 nodes
 typedef Byte          LeafBaseDataType;
 
 inline uint32_t StringBufferSizeInWords( size_t strSz ) {
@@ -28,20 +84,31 @@ inline uint32_t StringBufferSizeInWords( size_t strSz ) {
 		return bufSz / sizeof( uint32_t ) + ((bufSz % sizeof( uint32_t )) != 0 ? 1 : 0);
 }
 
-inline uint32_t LeavesLinkSize( size_t treeDepth ) {
-		return (StringBufferSizeInWords( treeDepth ) + 1)*sizeof( uint32_t );
+// Size of a leaf: its string buffer and the offset of its positions
+inline uint32_t LeavesLinkSize( size_t treeDepth, bool wide = false ) {
+		return StringBufferSizeInWords( treeDepth )*sizeof( uint32_t ) + (wide ? sizeof( uint64_t ) : sizeof( uint32_t ));
 }
 
-typedef std::pair< char, uint32_t > Components;
-inline char     GetAAChar( Components const & comp ) {   return std::get< 0 >( comp );   }
-inline uint32_t GetIndex( Components const & comp )  {   return std::get< 1 >( comp );   }
-inline EncodedNodeType CompressComponents( Components const & comp ) {
-		uint32_t charPart = (Fasta::Char2Index( GetAAChar( comp ) )+1) << NB_BITS_FOR_LINK;
-		uint32_t linkPart = GetIndex( comp );   // & BITS_FOR_LINK_MASK;
-		return charPart | linkPart;
+// Nodes keep the residue in their 5 upper bits, the link in the others
+template< typename Node >
+constexpr unsigned NodeLinkBits() {   return 8*sizeof( Node ) - 5;   }
+
+template< typename Node >
+constexpr Node NodeLinkMask() {   return (Node( 1 ) << NodeLinkBits< Node >()) - 1;   }
+
+template< typename Node >
+inline Node EncodeNode( char c, Node link ) {
+		return (static_cast< Node >( Fasta::Char2Index( c )+1 ) << NodeLinkBits< Node >()) | link;
 }
-inline Components ExtractComponents( EncodedNodeType val ) {
-		return { Fasta::Index2Char( (val>>NB_BITS_FOR_LINK)-1 ), val & BITS_FOR_LINK_MASK };
+
+template< typename Node >
+inline char NodeChar( Node val ) {
+		return Fasta::Index2Char( static_cast< Fasta::AAIndex >( (val >> NodeLinkBits< Node >())-1 ) );
+}
+
+template< typename Node >
+inline Node NodeLink( Node val ) {
+		return val & NodeLinkMask< Node >();
 }
 
 class MemPepTree {
@@ -50,16 +117,42 @@ class MemPepTree {
 		          , std::vector< EncodedNodeType >  && nodes
 		          , std::vector< LeafBaseDataType > && leaves
 		          , std::vector< LeafBaseDataType > && leafPos
+		          , uint32_t version = 1
+		          );
+
+		// Version 2 to 4, depending on the encoding of the leaf positions and leaves.  Leaves
+		// are always kept as strings and links, and only packed when written.
+		MemPepTree( uint32_t depth
+		          , std::vector< WideEncodedNodeType > && nodes
+		          , std::vector< LeafBaseDataType >    && leaves
+		          , std::vector< LeafBaseDataType >    && leafPos
+		          , uint32_t version = 2
 		          );
 
 	public:
+		uint32_t Version() const {   return version;   }
+
+		bool IsWide() const {   return wide;   }
+
 		void Write( FILE * file ) const;
 
+		// Whether a tree of the given sections sizes (in nodes, leaves and bytes) needs version 2
+		static bool NeedsWideFormat( uint32_t depth, size_t nbNodes, size_t nbLeaves, size_t leafPosSize );
+
+		// Joins the trees of the fragments starting with each residue, given by increasing
+		// residue (empty ones being skipped), into the tree of all the fragments, as
+		// Trie::LinearizeTree() would have laid it out.  Shards are all of version 2, or
+		// all of version 3 which the whole tree then keeps.
+		static MemPepTree Stitch( uint32_t depth, std::vector< MemPepTree > && shards, uint32_t minVersion = 1 );
+
 	private:
 		uint32_t depth;
-		std::vector< EncodedNodeType >  nodes;
-		std::vector< LeafBaseDataType > leaves;
-		std::vector< LeafBaseDataType > leafPos;
+		uint32_t version;
+		bool     wide;
+		std::vector< EncodedNodeType >     nodes;
+		std::vector< WideEncodedNodeType > wideNodes;
+		std::vector< LeafBaseDataType >    leaves;
+		std::vector< LeafBaseDataType >    leafPos;
 };
 
 class MMappedPepTree {
@@ -69,17 +162,38 @@ class MMappedPepTree {
 		~MMappedPepTree();
 
 	public:
-		uint32_t Depth() const;
+		// Faults every page of the file in and, with lock, locks them in memory; false when
+		// they could not be locked (they are faulted in all the same)
+		bool Preload( bool lock ) const;
+
+		size_t FileSize() const {   return fileSize;   }
+
+		uint32_t Version() const {   return version;   }
+
+		bool IsWide() const {   return version >= 2;   }
+
+		bool HasVarintLeafPos() const {   return version >= PepTreeFormat::varintLeafPosVersion;   }
 
-		uint32_t GetNumberLeaves() const;
+		bool HasPackedLeaves() const {   return version >= PepTreeFormat::packedLeavesVersion;   }
+
+		// Packed residues of the leaf at index, for trees with packed leaves
+		uint64_t GetPackedLeaf( size_t index ) const {
+				return reinterpret_cast< uint64_t const * >( ptr + leavesOffset )[index];
+		}
+
+		uint32_t Depth() const {   return depth;   }
+
+		size_t GetNumberLeaves() const;
 
 		void WriteReadableTree   ( FILE * file ) const;
 		void WriteReadableNodes  ( FILE * file ) const;
 		void WriteReadableLeaves ( FILE * file ) const;
 		void WriteReadableLeafPos( FILE * file ) const;
 
-		EncodedNodeType const * GetNodesData() const;
-		size_t                  GetNodesSize() const;
+		// Nodes of the version of the tree, EncodedNodeType or WideEncodedNodeType
+		template< typename Node >
+		Node const * GetNodesData() const {   return reinterpret_cast< Node const * >( ptr + nodesOffset );   }
+		size_t       GetNodesSize() const;
 
 		LeafBaseDataType const * GetLeavesData() const;
 		size_t                   GetLeavesSize() const;
@@ -88,67 +202,82 @@ class MMappedPepTree {
 		size_t                   GetLeafPosSize() const;
 
 	public:
+		// Calls f( childNumber, char, childIndex, leafStart, leafStop ) for every child of the list at index
 		template< typename F >
-		inline void ForNodeChildren( uint32_t index, F && f ) const {
-				auto data = GetNodesData();
+		inline void ForNodeChildren( size_t index, F && f ) const {
 				size_t childNumber = 0;
 				while ( true ) {
-						EncodedNodeType val = data[index];
+						size_t val = NodeAt( index );
 						if ( val == 0 ) {
 								break;
 						}
-						auto comp = ExtractComponents( val );
-
-						EncodedNodeType leafStart = GetIndex( comp );
-						EncodedNodeType leafStop;
-						if ( index+2 < GetNodesSize() - 1 ) {
-								if ( data[index+2] == 0 ) {   // presence of end-of-children sentinel
-										leafStop = GetIndex( ExtractComponents( data[index+3] ) );
-								} else {
-										leafStop = GetIndex( ExtractComponents( data[index+2] ) );
+
+						size_t leafStart = val & linkMask;
+						size_t leafStop;
+						if ( index+2 < nbNodes - 1 ) {
+								size_t next = NodeAt( index+2 );
+								if ( next == 0 ) {   // presence of end-of-children sentinel
+										next = NodeAt( index+3 );
 								}
+								leafStop = next & linkMask;
 
 								if ( leafStop <= leafStart ) {   // new tree depth threshold (might be == for first node)
-										leafStop = GetLeavesSize();
+										leafStop = nbLeaves;
 								}
 						} else {
-								leafStop = GetLeavesSize();
+								leafStop = nbLeaves;
 						}
-						f( childNumber, GetAAChar( comp ), data[index+1], leafStart, leafStop );
+						f( childNumber, Fasta::Index2Char( static_cast< Fasta::AAIndex >( (val >> linkBits)-1 ) ), NodeAt( index+1 ), leafStart, leafStop );
 						++childNumber;
 						index += 2;
 				}
 		}
 
 		template< typename F >
-		inline void ForLeaf( uint32_t index, F && f ) const {
-				auto data = GetLeavesData() + (index * LeavesLinkSize( Depth() ));
-				size_t alignedBufSz = StringBufferSizeInWords( Depth() );
-				ExtractLeafCallF( data, alignedBufSz, std::forward< F >( f ) );
+		inline void ForLeaf( size_t index, F && f ) const {
+				if ( HasPackedLeaves() ) {
+						ExtractPackedLeafCallF( index, std::forward< F >( f ) );
+						return;
+				}
+				auto data = GetLeavesData() + (index * leafSize);
+				ExtractLeafCallF( data, std::forward< F >( f ) );
 		}
 
 		template< typename F >
-		inline void ForLeafRange( uint32_t start, uint32_t stop, F && f ) {
-				auto data = GetLeavesData() + (start * LeavesLinkSize( Depth() ));
-				size_t alignedBufSz = StringBufferSizeInWords( Depth() );
-				while ( start < stop ) {
-						ExtractLeafCallF( data, alignedBufSz, std::forward< F >( f ) );
-						start += alignedBufSz + 1;
+		inline void ForLeafRange( size_t start, size_t stop, F && f ) const {
+				if ( HasPackedLeaves() ) {
+						for ( ; start < stop; ++start ) {
+								ExtractPackedLeafCallF( start, std::forward< F >( f ) );
+						}
+						return;
+				}
+				auto data = GetLeavesData() + (start * leafSize);
+				for ( ; start < stop; ++start, data += leafSize ) {
+						ExtractLeafCallF( data, std::forward< F >( f ) );
 				}
 		}
 
 		template< typename F >
 		inline void ForEachLeaf( F && f ) const {
+				if ( HasPackedLeaves() ) {
+						ForLeafRange( 0, nbLeaves, std::forward< F >( f ) );
+						return;
+				}
 				auto data = GetLeavesData();
-				size_t alignedBufSz = StringBufferSizeInWords( Depth() );
 				while ( *data != '\0' ) {
-						ExtractLeafCallF( data, alignedBufSz, std::forward< F >( f ) );
-						data += (alignedBufSz + 1)*sizeof( uint32_t );
+						ExtractLeafCallF( data, std::forward< F >( f ) );
+						data += leafSize;
 				}
 		}
 
+		// Calls f.ListSize( nbProteins ), then for every protein f.AddHeader( protein, nbPositions ),
+		// f.AddPos( position ) for each of its positions and f.StopPos(), then f.StopHeader()
 		template< typename F >
-		inline uint32_t ForLeafPos( uint32_t index, F && f ) const {
+		inline size_t ForLeafPos( size_t index, F && f ) const {
+				if ( HasVarintLeafPos() ) {
+						return ForVarintLeafPos( index, std::forward< F >( f ) );
+				}
+
 				auto base = GetLeafPosData() + index;
 				auto data = base;
 
@@ -173,24 +302,172 @@ class MMappedPepTree {
 						f.StopPos();
 				}
 				f.StopHeader();
-				return (uint32_t)(data - base);
+				return static_cast< size_t >( data - base );
 		}
 
 	private:
-		int fd;
-		uint32_t fileSize;
+		int          fd;
+		size_t       fileSize;
 		char const * ptr;
 
+		uint32_t version;
+		uint32_t depth;
+		size_t   nodesOffset;
+		size_t   leavesOffset;
+		size_t   leafPosOffset;
+		size_t   leafSize;
+		size_t   nbNodes;
+		size_t   nbLeaves;
+		unsigned linkBits;
+		size_t   linkMask;
+
 	private:
+		// Nodes of either version, the branch being the same for the whole traversal
+		size_t NodeAt( size_t i ) const {
+				return IsWide() ? GetNodesData< WideEncodedNodeType >()[i] : GetNodesData< EncodedNodeType >()[i];
+		}
+
+		template< typename F >
+		inline size_t ForVarintLeafPos( size_t index, F && f ) const {
+				using PepTreeFormat::GetVarint;
+				auto base = GetLeafPosData() + index;
+				auto data = base;
+
+				size_t listSize = GetVarint( data );
+				f.ListSize( listSize );
+				uint32_t protIndex = 0;
+				for ( size_t i = 0; i != listSize; ++i ) {
+						protIndex += static_cast< uint32_t >( GetVarint( data ) );
+						size_t nb = GetVarint( data );
+						f.AddHeader( protIndex, nb );
+
+						size_t pos = 0;
+						for ( size_t j = 0; j != nb; ++j ) {
+								pos += GetVarint( data );
+								f.AddPos( pos );
+						}
+						f.StopPos();
+				}
+				f.StopHeader();
+				return static_cast< size_t >( data - base );
+		}
+
 		template< typename F >
-		inline void ExtractLeafCallF( Byte const * data, size_t alignedBufSz, F && f ) const {
-				Byte const * p = data + alignedBufSz*sizeof( uint32_t );
-				uint32_t offset = *p++ << 24;
-				offset         += *p++ << 16;
-				offset         += *p++ <<  8;
-				offset         += *p;
+		inline void ExtractLeafCallF( Byte const * data, F && f ) const {
+				auto BigEndian32 = []( Byte const * p ) -> size_t {
+						return (uint32_t( p[0] ) << 24) | (uint32_t( p[1] ) << 16) | (uint32_t( p[2] ) << 8) | uint32_t( p[3] );
+				};
+				size_t offset = BigEndian32( data + leafSize - sizeof( uint32_t ) );
+				if ( IsWide() ) {
+						offset |= BigEndian32( data + leafSize - sizeof( uint64_t ) ) << 32;
+				}
 				f( (char const *)data, offset );
 		}
+
+		// Packed leaves are unpacked for the call only
+		template< typename F >
+		inline void ExtractPackedLeafCallF( size_t index, F && f ) const {
+				char str[PepTreeFormat::maxPackedDepth + 1];
+				PepTreeFormat::UnpackLeaf( GetPackedLeaf( index ), depth, str );
+				f( (char const *)str, static_cast< size_t >( reinterpret_cast< uint64_t const * >( ptr + leavesOffset )[nbLeaves + index] ) );
+		}
+};
+
+// ~~~ Bitmap Node Layout ~~~ //
+// Node layout for the traversals, built from the leaves of a tree in order.  The
+// children of a node are given by the mask of their residues (bit i for the i-th of
+// PepTreeFormat::residuesInOrder, the order of the children) and the number of the
+// first of them, the children of the nodes of a level being contiguous and the levels
+// stored one after the other.  As the nodes of a level are in leaves order, a node
+// leaves range from its first leaf to the first leaf of the next node, every level
+// ending with the number of leaves: no sentinel to look for nor next node to peek at.
+class BitmapNodes {
+	public:
+		explicit BitmapNodes( uint32_t depth );
+
+	public:
+		// Leaves are added in order, word sharing its commonPrefix first residues with the
+		// previous leaf
+		void AddLeaf( char const * word, size_t commonPrefix );
+
+		// Lays the levels out, once every leaf is added
+		void Finish();
+
+		uint32_t Depth() const {   return depth;   }
+
+		size_t NumLeaves() const {   return nbLeaves;   }
+
+		// Number of node numbers having children, indexing the nodes as the traversal
+		size_t Size() const {   return masks.size();   }
+
+		// Same interface as MMappedPepTree::ForNodeChildren, index being a node number
+		template< typename F >
+		inline void ForNodeChildren( size_t index, F && f ) const {
+				uint32_t mask  = masks[index];
+				size_t   child = firstChildren[index];
+				for ( size_t childNumber = 0; mask != 0; mask &= mask - 1, ++childNumber, ++child ) {
+						f( childNumber, PepTreeFormat::residuesInOrder[ __builtin_ctz( mask ) ], child, leafStarts[child], leafStarts[child+1] );
+				}
+		}
+
+	private:
+		struct Level {
+				std::vector< uint32_t > masks;           // up to the last level excluded
+				std::vector< uint32_t > firstChildren;   // in the next level
+				std::vector< uint32_t > leafStarts;
+		};
+
+	private:
+		uint32_t depth;
+		size_t   nbLeaves;
+
+		std::vector< Level > levels;   // while leaves are added
+
+		std::vector< uint32_t > masks;           // by node number, up to the last level excluded
+		std::vector< uint32_t > firstChildren;   // by node number, up to the last level excluded
+		std::vector< uint32_t > leafStarts;      // by node number, each level followed by the number of leaves
+};
+
+// Mapped tree traversed through the bitmap node layout, built once from its leaves;
+// leaves are read from the mapped tree
+class BitmapPepTree {
+	public:
+		explicit BitmapPepTree( MMappedPepTree const & tree );
+
+	public:
+		uint32_t Depth() const {   return tree.Depth();   }
+
+		size_t GetNumberLeaves() const {   return tree.GetNumberLeaves();   }
+
+		size_t GetNodesSize() const {   return nodes.Size();   }
+
+		template< typename F >
+		inline void ForNodeChildren( size_t index, F && f ) const {
+				nodes.ForNodeChildren( index, std::forward< F >( f ) );
+		}
+
+		template< typename F >
+		inline void ForLeaf( size_t index, F && f ) const {
+				tree.ForLeaf( index, std::forward< F >( f ) );
+		}
+
+		template< typename F >
+		inline void ForLeafRange( size_t start, size_t stop, F && f ) const {
+				tree.ForLeafRange( start, stop, std::forward< F >( f ) );
+		}
+
+		template< typename F >
+		inline size_t ForLeafPos( size_t index, F && f ) const {
+				return tree.ForLeafPos( index, std::forward< F >( f ) );
+		}
+
+		bool HasPackedLeaves() const {   return tree.HasPackedLeaves();   }
+
+		uint64_t GetPackedLeaf( size_t index ) const {   return tree.GetPackedLeaf( index );   }
+
+	private:
+		MMappedPepTree const & tree;
+		BitmapNodes            nodes;
 };
 
 // ~~~ Node Based Tree ~~~ //
@@ -227,7 +504,11 @@ struct Trie {
 
 		size_t GetLeafCreatePath( char const * seq );
 
-		MemPepTree LinearizeTree() const;
+		// Whether some leaf positions do not fit the 16 bits of versions 1 and 2
+		bool NeedsVarintLeafPos() const;
+
+		// Uses the first version at least minVersion the tree fits
+		MemPepTree LinearizeTree( uint32_t minVersion = 1 ) const;
 
 	private:
 		uint32_t depth;
@@ -247,4 +528,127 @@ struct Trie {
 		}
 };
 
+// ~~~ Sort Based Tree ~~~ //
+// Builds the same linearized tree as Trie without any node structure: every fragment
+// is packed with its protein and position into a record, the records are radix sorted
+// on the packed words (stably, so that the occurrences of a word stay by protein and
+// position), and the sections are emitted in one pass over the sorted records.
+// With a memory limit, sorted runs of records are spilled to temporary files whenever
+// the records would exceed it, and merged back while emitting the sections.  Runs are
+// merged at most MaxMergedRuns() at once, a read buffer each within the limit: past that
+// many, runs are first merged into larger ones, as many runs of a level making a run of
+// the next level.
+class PackedFragments {
+	public:
+		struct Record {
+				uint64_t word;       // 5 bits per residue, the first residue in the high bits
+				uint32_t protein;
+				uint32_t position;
+		};
+
+		static size_t const maxDepth    = 12;
+		static size_t const minRunSize  = 1 << 16;   // records
+		static size_t const maxOpenRuns = 256;       // temporary files merged at once
+
+	public:
+		// A memory limit of 0 keeps all the records in memory
+		PackedFragments( uint32_t treeDepth, size_t nbThreads = 1, size_t memoryLimit = 0 );
+
+		PackedFragments( PackedFragments const & ) = delete;
+		PackedFragments & operator=( PackedFragments const & ) = delete;
+
+		~PackedFragments();
+
+	public:
+		uint32_t Depth() const {   return depth;   }
+
+		size_t Size() const {   return nbSpilled + records.size();   }
+
+		size_t NumRuns() const {   return nbSpilledRuns;   }   // before being merged
+
+		// Fragments are expected by protein then position, as the trie builder visits them
+		void Add( char const * word, uint32_t protein, size_t position ) {
+				records.push_back( Record{ Pack( word ), protein
+				                         , static_cast< uint32_t >( std::min< size_t >( position, UINT32_MAX ) )
+				                         } );
+				if ( records.size() == maxRecords ) {
+						Spill();
+				}
+		}
+
+		// Sorts the records, or spills the last run of them when some were already spilled
+		void Sort();
+
+		// Once sorted, uses the first version at least minVersion the tree fits
+		MemPepTree LinearizeTree( uint32_t minVersion = 1 ) const;
+
+		// Same as LinearizeTree() then MemPepTree::Write(), streaming the sections to the file
+		void WriteTree( FILE * file, uint32_t minVersion = 1 ) const;
+
+	private:
+		struct Layout {
+				std::vector< size_t > levelSizes;    // nodes by level, the root being level 0
+				std::vector< size_t > levelStarts;   // in the nodes section, by level (up to depth+1)
+				size_t                nbLeaves;
+				size_t                legacyLeafPosSize;   // versions 1 and 2
+				size_t                varintLeafPosSize;   // version 3
+				bool                  legacyOverflow;      // positions not fitting versions 1 and 2
+		};
+
+	private:
+		uint32_t depth;
+		size_t   nbThreads;
+		size_t   maxRecords;   // 0 when unlimited
+		size_t   nbSpilled;
+		size_t   nbSpilledRuns = 0;
+		uint8_t  codes[256];
+
+		std::vector< Record > records;
+		std::vector< FILE * > runs;
+		std::vector< size_t > runSizes;
+		std::vector< size_t > runLevels;   // 0 when spilled, merged ones a level above their runs
+
+	private:
+		// Residue codes follow the ASCII order of the residues, which is the order of
+		// the children of the trie nodes
+		uint64_t Pack( char const * word ) const {
+				uint64_t packed = 0;
+				for ( size_t i = 0; i != depth; ++i ) {
+						packed = (packed << 5) | codes[ static_cast< unsigned char >( word[i] ) ];
+				}
+				return packed;
+		}
+
+		// Residue of the packed word at the given level (1 for the first residue)
+		char ResidueAt( uint64_t word, size_t level ) const;
+
+		// Number of leading residues two different packed words share
+		size_t CommonPrefix( uint64_t a, uint64_t b ) const {
+				return depth - 1 - (63 - __builtin_clzll( a ^ b ))/5;
+		}
+
+		void SortRecords();
+		void Spill();
+
+		size_t MaxMergedRuns() const;
+
+		// Replaces the runs [first, last) by their merge
+		void MergeRuns( size_t first, size_t last );
+
+		// Calls f( record ) for every record of the runs [first, last) in order, reading
+		// each of them through a buffer of bufferSize records
+		template< typename F >
+		void ForEachMergedRecord( size_t first, size_t last, size_t bufferSize, F && f ) const;
+
+		// Calls f( word, occurrences ) for every word of the sorted records, in memory or spilled
+		template< typename F >
+		void ForEachWord( F && f ) const;
+
+		Layout   Measure() const;
+		uint32_t ChooseVersion( Layout const & layout, uint32_t minVersion ) const;
+
+		template< typename Sections >
+		void Emit( Layout const & layout, uint32_t version, Sections & sections ) const;
+};
+
 #endif
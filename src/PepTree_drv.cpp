@@ -8,19 +8,37 @@
 #include <cstring>
 #include <chrono>
 #include <limits>
+#include <memory>
 #include <cstdint>
+#include <stdexcept>
 
 #include "Matrices.hpp"
 #include "Fasta.hpp"
 #include "PepTree.hpp"
 #include "FastIdx.hpp"
+#include "LeafSamples.hpp"
+#include "LeafAbundances.hpp"
+#include "ThreadPool.hpp"
 
 using namespace std;
 
 void UsageError( char * argv[] ) {
 		fprintf( stderr
-		       , "Usage: %s -c input-FastIdx-file fragments-size\n"
+		       , "Usage: %s [options] -c input-FastIdx-file fragments-size\n"
 		         "          create the PepTree file from the input FastIdx file\n"
+		         "   or: %s [options] -s name input-FastIdx-file... fragments-size\n"
+		         "          create the PepTree file name.pepTree.fragments-size of the fragments of several samples, one\n"
+		         "          per input FastIdx file (at most 64), with the samples of its leaves in the same name plus .samples\n"
+		         "   where options are:\n"
+		         "     --v2           -> force the 64 bits file format, otherwise only used for trees too large for the legacy one\n"
+		         "     --v3           -> force the 64 bits file format with varint leaf positions, otherwise only used for\n"
+		         "                       positions or counts over 65535\n"
+		         "     --v4           -> use the version 4 format (version 3 with leaves packed in 64 bits words), for fragments of at most 12 residues\n"
+		         "     --sort         -> build the tree by sorting packed fragments instead of through a trie (same file)\n"
+		         "     --mem-limit MB -> build the tree by sorting as --sort, spilling sorted fragments to temporary files past MB megabytes\n"
+		         "     -j threads     -> number of threads sorting, or building the trie shards of each first residue (default: 1)\n"
+		         "     --abundances   -> also write the abundance of every leaf, from the read counts of its proteins (\"size=\" or\n"
+		         "                       \"count=\" header fields, 1 otherwise), to the tree name plus .abundances\n"
 		         "   or: %s -%% pepTree-file\n"
 		         "   where %% is one of:\n"
 		         "     d -> print the tree depth\n"
@@ -28,24 +46,26 @@ void UsageError( char * argv[] ) {
 		         "     n -> print the tree nodes in human 'interpretable' format\n"
 		         "     l -> print the tree leaves in human 'interpretable' format\n"
 		         "     p -> print the tree leaf positions in human 'interpretable' format\n"
-		       , argv[ 0 ], argv[ 0 ]
+		       , argv[ 0 ], argv[ 0 ], argv[ 0 ]
 		       );
 		exit( 1 );
 }
 
-void PepTreeCreation( char * argv[] ) {
-		auto fragSize = static_cast< size_t >( atoi( argv[ 3 ] ) );
-		MMappedFastIdx idx( argv[2] );
+struct CreationOptions {
+		uint32_t minVersion  = 1;
+		bool     sorted      = false;
+		size_t   nbThreads   = 1;
+		size_t   memoryLimit = 0;   // bytes, sorted construction through temporary files if not 0
+		bool     abundances  = false;
+};
 
-		printf( "Creating PepTree of depth %zu from \"%s\"...\n", fragSize, argv[ 2 ] );
-		auto startTimer = chrono::high_resolution_clock::now();
-		auto indices   = idx.GetIndicesData();
-		auto names     = idx.GetNamesData();
+// Calls f( fragment, proteinIndex, position ) for every fragment of valid residues, by
+// protein then position, warning about the fragments ignored unless told not to
+template< typename F >
+void ForEachFragment( MMappedFastIdx const & idx, size_t fragSize, F && f, bool warn = true ) {
 		auto sequences = idx.GetSequencesData();
 		auto seqSize   = idx.GetSequencesSize();
 
-		Trie trie( fragSize );
-
 		auto proteinIndex  = size_t{ 0 };
 		auto fragmentStart = size_t{ 0 }, sequenceStart = size_t{ 0 };
 		for ( size_t i = 0; i < seqSize; ++i ) {
@@ -53,7 +73,7 @@ void PepTreeCreation( char * argv[] ) {
 						if ( sequences[ i ] == '\0' ) {
 								++proteinIndex;
 								sequenceStart = i+1;
-						} else {
+						} else if ( warn ) {
 								auto startStr = sequences + (i - fragmentStart < fragSize ? fragmentStart : i-fragSize+1);
 								auto endStr   = startStr + 2*fragSize-1;
 								fprintf( stderr
@@ -61,7 +81,7 @@ void PepTreeCreation( char * argv[] ) {
 								         "in %s (centered at position %zu) "
 								         "in \"%s\" [%zu]: fragments contain "
 								       , string( startStr, endStr ).c_str()
-								       , i - sequenceStart, names + indices[ proteinIndex*2 ], proteinIndex
+								       , i - sequenceStart, idx.GetName( proteinIndex ), proteinIndex
 								       );
 								switch ( sequences[ i ] ) {
 									case 'U': {   fprintf( stderr, "selenocysteine (U)\n" );                       } break;
@@ -72,49 +92,342 @@ void PepTreeCreation( char * argv[] ) {
 
 						i = fragmentStart = i+1;
 						if ( i >= seqSize ) {   // last character was invalid
-								goto End_Outer_Loop;
+								return;
 						}
 				}
 				if ( i - fragmentStart == fragSize-1 ) {
-						auto leafIndex = trie.GetLeafCreatePath( sequences + fragmentStart );
-						trie.GetLeaf( leafIndex )->positions[ proteinIndex ].push_back( fragmentStart - sequenceStart );
-
+						f( sequences + fragmentStart, proteinIndex, fragmentStart - sequenceStart );
 						++fragmentStart;
 				}
 		}
-	End_Outer_Loop:
+}
+
+// FastIdx files of the samples of a multi-sample tree, their proteins being numbered one
+// sample after the other
+struct SampleFastIdxs {
+		vector< unique_ptr< MMappedFastIdx > > idxs;
+		vector< size_t >                       proteinStarts;
+};
+
+template< typename F >
+void ForEachFragment( SampleFastIdxs const & samples, size_t fragSize, F && f, bool warn = true ) {
+		for ( size_t s = 0; s != samples.idxs.size(); ++s ) {
+				ForEachFragment( *samples.idxs[s], fragSize, [&]( char const * fragment, size_t proteinIndex, size_t position ) {
+						f( fragment, samples.proteinStarts[s] + proteinIndex, position );
+				}, warn );
+		}
+}
+
+template< typename Source >
+MemPepTree TrieCreation( Source const & idx, size_t fragSize, CreationOptions const & options ) {
+		auto startTimer = chrono::high_resolution_clock::now();
+
+		Trie trie( fragSize );
+		ForEachFragment( idx, fragSize, [&trie]( char const * fragment, size_t proteinIndex, size_t position ) {
+				auto leafIndex = trie.GetLeafCreatePath( fragment );
+				trie.GetLeaf( leafIndex )->positions[ proteinIndex ].push_back( position );
+		});
+
 		auto finishTimer = chrono::high_resolution_clock::now();
 		auto elapsed1 = finishTimer - startTimer;
 		printf( "   ...PepTree trie created in %ld seconds.\n"
 		      , chrono::duration_cast< chrono::seconds >( elapsed1 ).count()
 		      );
 
+		auto nbNodes = trie.NumLeaves() + trie.NumNodes();
+		printf( "Linearizing tree structure (%zu node%s: %zu internal%s, %zu lea%s)...\n"
+		      , nbNodes, nbNodes > 1 ? "s" : ""
+		      , trie.NumNodes(), trie.NumNodes() > 1 ? "s" : ""
+		      , trie.NumLeaves(), trie.NumLeaves() > 1 ? "ves" : "f"
+		      );
+		startTimer = chrono::high_resolution_clock::now();
+
+		auto tree = trie.LinearizeTree( options.minVersion );
+
+		finishTimer = chrono::high_resolution_clock::now();
+		auto elapsed2 = finishTimer - startTimer;
+		printf( "   ...linearized in %ld seconds .\n"
+		      , chrono::duration_cast< chrono::seconds >( elapsed2 ).count()
+		      );
+		return tree;
+}
+
+// A fragment of a shard, pointing into the sequences of the mapped FastIdx files
+struct ShardFragment {
+		char const * fragment;
+		uint32_t     proteinIndex;
+		uint32_t     position;
+};
+
+// Fragments are partitioned by their first residue in a single pass over the sequences,
+// each part being built as a trie and linearized concurrently, the linearized shards
+// being then stitched together
+template< typename Source >
+MemPepTree ShardedTrieCreation( Source const & idx, size_t fragSize, CreationOptions const & options ) {
+		auto startTimer = chrono::high_resolution_clock::now();
+
+		vector< char > residues;   // by increasing residue, as the children of the trie nodes
+		int shardOf[128];
+		for ( int c = 0; c != 128; ++c ) {
+				shardOf[c] = -1;
+				if ( Fasta::IsValidAA( static_cast< char >( c ) ) ) {
+						shardOf[c] = static_cast< int >( residues.size() );
+						residues.push_back( static_cast< char >( c ) );
+				}
+		}
+
+		// By protein then position within every shard, as a single trie inserts them
+		vector< vector< ShardFragment > > fragments( residues.size() );
+		ForEachFragment( idx, fragSize, [&]( char const * fragment, size_t proteinIndex, size_t position ) {
+				fragments[ shardOf[ static_cast< unsigned char >( fragment[0] ) ] ].push_back( ShardFragment{
+						fragment, static_cast< uint32_t >( proteinIndex ), static_cast< uint32_t >( position )
+				});
+		});
+
+		vector< Trie >   tries( residues.size(), Trie( fragSize ) );
+		vector< size_t > nbNodes( residues.size(), 0 ), nbLeaves( residues.size(), 0 );
+		vector< char >   needsVarint( residues.size(), 0 );
+		WorkStealingPool pool( options.nbThreads );
+		pool.Run( residues.size(), [&]( size_t, size_t s ) {
+				auto & trie = tries[s];
+				for ( auto const & f : fragments[s] ) {
+						auto leafIndex = trie.GetLeafCreatePath( f.fragment );
+						trie.GetLeaf( leafIndex )->positions[ f.proteinIndex ].push_back( f.position );
+				}
+				vector< ShardFragment >().swap( fragments[s] );   // release
+				nbNodes[s]     = trie.NumNodes() - 1;   // without the root
+				nbLeaves[s]    = trie.NumLeaves();
+				needsVarint[s] = trie.NeedsVarintLeafPos();
+		});
+
+		// Shards share the encoding of their leaf positions, as they are stitched as is
+		uint32_t shardVersion = std::max< uint32_t >( options.minVersion, 2 );
+		if ( find( needsVarint.begin(), needsVarint.end(), 1 ) != needsVarint.end() ) {
+				shardVersion = std::max( shardVersion, PepTreeFormat::varintLeafPosVersion );
+		}
+		vector< unique_ptr< MemPepTree > > linearized( residues.size() );
+		pool.Run( residues.size(), [&]( size_t, size_t s ) {
+				linearized[s].reset( new MemPepTree( tries[s].LinearizeTree( shardVersion ) ) );
+				tries[s] = Trie( fragSize );   // release
+		});
+		vector< MemPepTree > shards;
+		shards.reserve( residues.size() );
+		for ( auto & shard : linearized ) {
+				shards.push_back( move( *shard ) );
+				shard.reset();
+		}
+
+		auto finishTimer = chrono::high_resolution_clock::now();
+		auto elapsed1 = finishTimer - startTimer;
+		size_t nbInternals = 1, nbLeavesTotal = 0;
+		for ( size_t s = 0; s != residues.size(); ++s ) {
+				nbInternals   += nbNodes[s];
+				nbLeavesTotal += nbLeaves[s];
+		}
+		printf( "   ...PepTree trie shards created and linearized in %ld seconds.\n"
+		      , chrono::duration_cast< chrono::seconds >( elapsed1 ).count()
+		      );
+
+		printf( "Stitching tree shards (%zu node%s: %zu internal%s, %zu lea%s)...\n"
+		      , nbInternals + nbLeavesTotal, nbInternals + nbLeavesTotal > 1 ? "s" : ""
+		      , nbInternals, nbInternals > 1 ? "s" : ""
+		      , nbLeavesTotal, nbLeavesTotal > 1 ? "ves" : "f"
+		      );
+		startTimer = chrono::high_resolution_clock::now();
+
+		auto tree = MemPepTree::Stitch( static_cast< uint32_t >( fragSize ), move( shards ), options.minVersion );
+
+		finishTimer = chrono::high_resolution_clock::now();
+		auto elapsed2 = finishTimer - startTimer;
+		printf( "   ...stitched in %ld seconds .\n"
+		      , chrono::duration_cast< chrono::seconds >( elapsed2 ).count()
+		      );
+		return tree;
+}
+
+template< typename Source >
+MemPepTree SortedCreation( Source const & idx, size_t fragSize, CreationOptions const & options ) {
+		auto startTimer = chrono::high_resolution_clock::now();
+
+		PackedFragments fragments( fragSize, options.nbThreads );
+		ForEachFragment( idx, fragSize, [&fragments]( char const * fragment, size_t proteinIndex, size_t position ) {
+				fragments.Add( fragment, static_cast< uint32_t >( proteinIndex ), position );
+		});
+		fragments.Sort();
+
+		auto finishTimer = chrono::high_resolution_clock::now();
+		auto elapsed1 = finishTimer - startTimer;
+		printf( "   ...%zu fragment%s packed and sorted in %ld seconds.\n"
+		      , fragments.Size(), fragments.Size() > 1 ? "s" : ""
+		      , chrono::duration_cast< chrono::seconds >( elapsed1 ).count()
+		      );
+
+		printf( "Linearizing tree structure...\n" );
+		startTimer = chrono::high_resolution_clock::now();
+
+		auto tree = fragments.LinearizeTree( options.minVersion );
+
+		finishTimer = chrono::high_resolution_clock::now();
+		auto elapsed2 = finishTimer - startTimer;
+		printf( "   ...linearized in %ld seconds .\n"
+		      , chrono::duration_cast< chrono::seconds >( elapsed2 ).count()
+		      );
+		return tree;
+}
+
+// Sorted runs of fragments are spilled past the memory limit, then merged while the
+// sections are streamed to the output file
+template< typename Source >
+void ExternalSortedCreation( Source const & idx, size_t fragSize, CreationOptions const & options, FILE * outputFile ) {
+		auto startTimer = chrono::high_resolution_clock::now();
+
+		PackedFragments fragments( fragSize, options.nbThreads, options.memoryLimit );
+		ForEachFragment( idx, fragSize, [&fragments]( char const * fragment, size_t proteinIndex, size_t position ) {
+				fragments.Add( fragment, static_cast< uint32_t >( proteinIndex ), position );
+		});
+		fragments.Sort();
+
+		auto finishTimer = chrono::high_resolution_clock::now();
+		auto elapsed1 = finishTimer - startTimer;
+		printf( "   ...%zu fragment%s packed and sorted in %ld seconds (%zu run%s spilled).\n"
+		      , fragments.Size(), fragments.Size() > 1 ? "s" : ""
+		      , chrono::duration_cast< chrono::seconds >( elapsed1 ).count()
+		      , fragments.NumRuns(), fragments.NumRuns() > 1 ? "s" : ""
+		      );
+
+		printf( "Merging and writing tree structure...\n" );
+		startTimer = chrono::high_resolution_clock::now();
+
+		fragments.WriteTree( outputFile, options.minVersion );
+
+		finishTimer = chrono::high_resolution_clock::now();
+		auto elapsed2 = finishTimer - startTimer;
+		printf( "   ...written in %ld seconds .\n"
+		      , chrono::duration_cast< chrono::seconds >( elapsed2 ).count()
+		      );
+}
+
+// The output file is removed when the tree cannot be created, no partial tree being left
+template< typename Source >
+void TreeCreation( Source const & idx, size_t fragSize, CreationOptions const & options, string const & outputPepTreeFilename ) {
+		auto outputPepTreeFile = fopen( outputPepTreeFilename.c_str(), "wb" );
+		if ( !outputPepTreeFile ) {
+				throw std::runtime_error{ "Unable to open output file \"" + outputPepTreeFilename + '"' };
+		}
 		try {
-				auto nbNodes = trie.NumLeaves() + trie.NumNodes();
-				printf( "Linearizing tree structure (%zu node%s: %zu internal%s, %zu lea%s)...\n"
-				      , nbNodes, nbNodes > 1 ? "s" : ""
-				      , trie.NumNodes(), trie.NumNodes() > 1 ? "s" : ""
-				      , trie.NumLeaves(), trie.NumLeaves() > 1 ? "ves" : "f"
-				      );
-				startTimer = chrono::high_resolution_clock::now();
+				if ( options.memoryLimit != 0 ) {
+						ExternalSortedCreation( idx, fragSize, options, outputPepTreeFile );
+				} else {
+						auto tree = options.sorted        ? SortedCreation     ( idx, fragSize, options )
+						          : options.nbThreads > 1 ? ShardedTrieCreation( idx, fragSize, options )
+						          :                         TrieCreation       ( idx, fragSize, options );
+						tree.Write( outputPepTreeFile );
+				}
+		} catch( ... ) {
+				fclose( outputPepTreeFile );
+				remove( outputPepTreeFilename.c_str() );
+				throw;
+		}
+		if ( fclose( outputPepTreeFile ) != 0 ) {
+				remove( outputPepTreeFilename.c_str() );
+				throw std::runtime_error{ "Unable to write output file \"" + outputPepTreeFilename + '"' };
+		}
+}
 
-				auto tree = trie.LinearizeTree();
+// Abundances of the leaves of the tree just written, proteins being numbered one index
+// after the other
+void AbundancesCreation( string const & treeFilename, vector< MMappedFastIdx const * > const & idxs ) {
+		auto startTimer = chrono::high_resolution_clock::now();
 
-				finishTimer = chrono::high_resolution_clock::now();
-				auto elapsed2 = finishTimer - startTimer;
-				printf( "   ...linearized in %ld seconds .\n"
-				      , chrono::duration_cast< chrono::seconds >( elapsed2 ).count()
-				      );
+		vector< uint32_t > proteinCounts;
+		for ( auto idx : idxs ) {
+				for ( size_t p = 0; p != idx->Size(); ++p ) {
+						proteinCounts.push_back( HeaderReadCount( idx->GetName( p ) ) );
+				}
+		}
+		MMappedPepTree tree( treeFilename.c_str() );
+		string abundancesFilename = treeFilename + ".abundances";
+		auto abundancesFile = fopen( abundancesFilename.c_str(), "wb" );
+		if ( !abundancesFile ) {
+				fprintf( stderr, "Unable to open output file \"%s\"\n", abundancesFilename.c_str() );
+				exit( 1 );
+		}
+		WriteLeafAbundances( abundancesFile, tree, proteinCounts );
+		fclose( abundancesFile );
 
-				ostringstream outputPepTreeFilenameStream;
-				outputPepTreeFilenameStream << argv[ 2 ] << ".pepTree." << fragSize;
-				auto outputPepTreeFile = fopen( outputPepTreeFilenameStream.str().c_str(), "wb" );
-				if ( !outputPepTreeFile ) {
-						fprintf( stderr, "Unable to open output file \"%s\"\n", outputPepTreeFilenameStream.str().c_str() );
+		auto finishTimer = chrono::high_resolution_clock::now();
+		auto elapsed = finishTimer - startTimer;
+		printf( "   ...abundances of %zu lea%s written in %ld seconds.\n"
+		      , tree.GetNumberLeaves(), tree.GetNumberLeaves() > 1 ? "ves" : "f"
+		      , chrono::duration_cast< chrono::seconds >( elapsed ).count()
+		      );
+}
+
+void PepTreeCreation( char const * fastIdxFilename, size_t fragSize, CreationOptions const & options ) {
+		MMappedFastIdx idx( fastIdxFilename );
+
+		ostringstream outputPepTreeFilenameStream;
+		outputPepTreeFilenameStream << fastIdxFilename << ".pepTree." << fragSize;
+
+		printf( "Creating PepTree of depth %zu from \"%s\"...\n", fragSize, fastIdxFilename );
+		try {
+				TreeCreation( idx, fragSize, options, outputPepTreeFilenameStream.str() );
+				if ( options.abundances ) {
+						AbundancesCreation( outputPepTreeFilenameStream.str(), { &idx } );
+				}
+		} catch( std::exception & e ) {
+				fprintf( stderr, "%s\n", e.what() );
+				exit( 1 );
+		}
+}
+
+// The tree of all the samples fragments is written first, the samples of its leaves
+// being then read from their positions
+void SamplesPepTreeCreation( char const * name, vector< string > const & fastIdxFilenames, size_t fragSize, CreationOptions const & options ) {
+		if ( fastIdxFilenames.size() > LeafSamplesFormat::maxSamples ) {
+				fprintf( stderr, "Too many samples (%zu), at most %zu are supported\n", fastIdxFilenames.size(), LeafSamplesFormat::maxSamples );
+				exit( 1 );
+		}
+		SampleFastIdxs samples;
+		size_t nbProteins = 0;
+		for ( auto const & filename : fastIdxFilenames ) {
+				samples.idxs.emplace_back( new MMappedFastIdx( filename.c_str() ) );
+				samples.proteinStarts.push_back( nbProteins );
+				nbProteins += samples.idxs.back()->Size();
+		}
+
+		ostringstream outputPepTreeFilenameStream;
+		outputPepTreeFilenameStream << name << ".pepTree." << fragSize;
+
+		printf( "Creating PepTree of depth %zu from %zu sample%s...\n", fragSize, fastIdxFilenames.size(), fastIdxFilenames.size() > 1 ? "s" : "" );
+		try {
+				TreeCreation( samples, fragSize, options, outputPepTreeFilenameStream.str() );
+				if ( options.abundances ) {
+						vector< MMappedFastIdx const * > idxs;
+						for ( auto const & idx : samples.idxs ) {
+								idxs.push_back( idx.get() );
+						}
+						AbundancesCreation( outputPepTreeFilenameStream.str(), idxs );
+				}
+
+				auto startTimer = chrono::high_resolution_clock::now();
+
+				MMappedPepTree tree( outputPepTreeFilenameStream.str().c_str() );
+				string samplesFilename = outputPepTreeFilenameStream.str() + ".samples";
+				auto samplesFile = fopen( samplesFilename.c_str(), "wb" );
+				if ( !samplesFile ) {
+						fprintf( stderr, "Unable to open output file \"%s\"\n", samplesFilename.c_str() );
 						exit( 1 );
 				}
-				tree.Write( outputPepTreeFile );
-				fclose( outputPepTreeFile );
+				WriteLeafSamples( samplesFile, tree, samples.proteinStarts, fastIdxFilenames );
+				fclose( samplesFile );
+
+				auto finishTimer = chrono::high_resolution_clock::now();
+				auto elapsed = finishTimer - startTimer;
+				printf( "   ...samples of %zu lea%s written in %ld seconds.\n"
+				      , tree.GetNumberLeaves(), tree.GetNumberLeaves() > 1 ? "ves" : "f"
+				      , chrono::duration_cast< chrono::seconds >( elapsed ).count()
+				      );
 		} catch( std::exception & e ) {
 				fprintf( stderr, "%s\n", e.what() );
 				exit( 1 );
@@ -122,22 +435,52 @@ void PepTreeCreation( char * argv[] ) {
 }
 
 int main( int argc, char * argv[] ) {
-		if ( argc < 3 || argc > 4 || argv[ 1 ][ 0 ] != '-' || strlen( argv[ 1 ] ) != 2 ) {
+		CreationOptions options;
+		int argi = 1;
+		while ( argi < argc ) {
+				if ( strcmp( argv[ argi ], "--v2" ) == 0 || strcmp( argv[ argi ], "--v3" ) == 0 || strcmp( argv[ argi ], "--v4" ) == 0 ) {
+						options.minVersion = std::max< uint32_t >( options.minVersion, argv[ argi ][ 3 ] - '0' );
+						++argi;
+				} else if ( strcmp( argv[ argi ], "--sort" ) == 0 ) {
+						options.sorted = true;
+						++argi;
+				} else if ( strcmp( argv[ argi ], "--abundances" ) == 0 ) {
+						options.abundances = true;
+						++argi;
+				} else if ( argc - argi > 1 && strcmp( argv[ argi ], "--mem-limit" ) == 0 && atoi( argv[ argi+1 ] ) > 0 ) {
+						options.memoryLimit = static_cast< size_t >( atoi( argv[ argi+1 ] ) ) << 20;
+						argi += 2;
+				} else if ( argc - argi > 1 && strcmp( argv[ argi ], "-j" ) == 0 && atoi( argv[ argi+1 ] ) > 0 ) {
+						options.nbThreads = static_cast< size_t >( atoi( argv[ argi+1 ] ) );
+						argi += 2;
+				} else {
+						break;
+				}
+		}
+		if ( argc - argi < 2 || argv[ argi ][ 0 ] != '-' || strlen( argv[ argi ] ) != 2
+		  || (argc - argi > 3 && argv[ argi ][ 1 ] != 's')
+		   ) {
 				UsageError( argv );
 		}
 
-		if ( argv[ 1 ][ 1 ] == 'c' ) {
-				if ( argc != 4 ) {
+		if ( argv[ argi ][ 1 ] == 's' ) {
+				if ( argc - argi < 4 ) {
+						UsageError( argv );
+				}
+				vector< string > fastIdxFilenames( argv + argi + 2, argv + argc - 1 );
+				SamplesPepTreeCreation( argv[ argi+1 ], fastIdxFilenames, static_cast< size_t >( atoi( argv[ argc-1 ] ) ), options );
+		} else if ( argv[ argi ][ 1 ] == 'c' ) {
+				if ( argc - argi != 3 ) {
 						UsageError( argv );
 				}
-				PepTreeCreation( argv );
+				PepTreeCreation( argv[ argi+1 ], static_cast< size_t >( atoi( argv[ argi+2 ] ) ), options );
 		} else {
-				if ( argc != 3 ) {
+				if ( argc - argi != 2 || argi != 1 ) {
 						UsageError( argv );
 				}
-				MMappedPepTree tree( argv[ 2 ] );
+				MMappedPepTree tree( argv[ argi+1 ] );
 
-				switch ( argv[ 1 ][ 1 ] ) {
+				switch ( argv[ argi ][ 1 ] ) {
 					case 'd': {   fprintf( stdout, "Depth: %u\n", tree.Depth() );   } break;
 					case 'v': {   tree.WriteReadableTree   ( stdout );              } break;
 					case 'n': {   tree.WriteReadableNodes  ( stdout );              } break;
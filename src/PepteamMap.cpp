@@ -9,153 +9,1174 @@
 #include <utility>
 #include <algorithm>
 #include <cstring>
+#include <cctype>
 #include <chrono>
 #include <climits>
+#include <cmath>
+#include <cstdlib>
+#include <mutex>
+#include <atomic>
+#include <memory>
 #include <boost/range/algorithm/for_each.hpp>
 
 #include "Matrices.hpp"
 #include "Fasta.hpp"
+#include "FastIdx.hpp"
 #include "PepTree.hpp"
+#include "Profile.hpp"
+#include "Similarity.hpp"
+#include "SimilarityKernel.hpp"
+#include "OutputBuffer.hpp"
+#include "Mapping.hpp"
+#include "ThreadPool.hpp"
+#include "SuffixIdx.hpp"
+#include "LeafSamples.hpp"
+#include "LeafAbundances.hpp"
+#include "PepteamMap.hpp"
 
 using namespace std;
 using boost::range::for_each;
 
 static size_t fragSize;
 static double cutoffHomology;
+static int64_t cutoffNum = 0, cutoffDen = 1;   // cutoffHomology as an exact decimal fraction
+static Matrix::Id homologyMatrixId = Matrix::Id::Pam30;
+static string     homologyMatrixTag;   // in the mapping filenames, empty for the default PAM30
 static int homologyMatrix[24][24];
 static int maxHomology = INT_MIN;
 static int minHomology = INT_MAX;
+static unique_ptr< BatchSimilarity > batchSimilarity;
+static MMappedFastIdx const * subjectFastIdx  = nullptr;   // profiles mode only
+static LeafSamples    const * querySamples    = nullptr;   // multi-sample query tree only
+static LeafAbundances const * queryAbundances = nullptr;   // abundance weighted profiles only
+
+// Tables derived from the matrix once at startup: the residue index of every
+// character (those outside of the matrix being scored as X) and of every packed leaf
+// residue code, the self-score of every residue, and the score increment of every
+// (query, subject) residue pair
+struct HomologyTables {
+		int8_t          charIndex[256];
+		int8_t          packedIndex[32];
+		int             selfScore[24];
+		SimilarityScore pairScore[24][24];   // { 2*M[a][b], M[a][a] + M[b][b] }
+		SimilarityScore codeScore[32][32];   // pairScore of packed leaf residue codes
+};
+static HomologyTables homologyTables;
+
+// Pruning constants of each depth, for a score Num/Den reached at that depth:
+//    refuse  (Num + slack) / (Den + slack) < cutoff
+//    accept  (Num + minGain) / (Den + slack) >= cutoff
+// with slack = 2*(fragSize-depth)*maxHomology and minGain = 2*(fragSize-depth)*minHomology.
+// As long as Den + slack > 0 both reduce to comparing
+//    cutoffDen*Num - cutoffNum*Den
+// against the refuse and accept thresholds.
+struct DepthBounds {
+		int64_t slack;
+		int64_t minGain;
+		int64_t refuse;
+		int64_t accept;
+};
+static vector< DepthBounds > depthBounds;
+
+// Subtree bounds of the trees (SubtreeBounds), those of the subject read from a resident
+// tree when it has them
+static bool                  tightBounds = false;
+static SubtreeBounds         queryBounds;
+static SubtreeBounds         loadedSubjectBounds;
+static SubtreeBounds const * subjectBounds = &loadedSubjectBounds;
+
+// Below a (query node, subject node) pair of at most cutoverPairs leaf pairs, all the
+// pairs are scored at once instead of going on with the traversal
+static size_t const defaultCutoverPairs = 64;
+static size_t       cutoverPairs        = defaultCutoverPairs;
+static bool         calibrateCutover    = false;
+static size_t const cutoverSimdSubjects = 16;   // narrower subject ranges are only walked
+
+// With --top-k, only the topK best hits of every query leaf are kept and written
+static size_t topK        = 0;
+static size_t topKQueries = 0;   // query leaves, once the trees are loaded
+
+// Residue codes of the leaves of the trees (rank in residuesInOrder + 1, as in packed
+// leaves), fragSize per leaf, read by the cutovers instead of the leaves themselves; empty
+// for trees with packed leaves, whose words are read directly.  Those of the subject are
+// read from a resident tree when it has them.
+static vector< uint8_t > queryCodes;
+static vector< uint8_t > loadedSubjectCodes;
+static uint8_t const *   subjectCodes = nullptr;
 
 namespace {
 
-	inline void InitHomology() {
-			memcpy( homologyMatrix, Matrix::Pam30, sizeof(homologyMatrix) );
+	// matrixName is either a built-in matrix name or a matrix file
+	inline void InitHomology( char const * matrixName ) {
+			homologyMatrixTag.clear();
+			if ( !Matrix::GetBuiltin( matrixName, homologyMatrixId, homologyMatrix ) ) {
+					Matrix::LoadFile( matrixName, homologyMatrix );
+					homologyMatrixId = Matrix::Id::File;
+			}
+			if ( homologyMatrixId == Matrix::Id::File ) {   // the file name, without its directories
+					homologyMatrixTag = matrixName;
+					homologyMatrixTag.erase( 0, homologyMatrixTag.rfind( '/' ) + 1 );
+			} else if ( homologyMatrixId != Matrix::Id::Pam30 ) {
+					homologyMatrixTag = Matrix::Name( homologyMatrixId );
+					transform( homologyMatrixTag.begin(), homologyMatrixTag.end(), homologyMatrixTag.begin(), ::tolower );
+			}
 			maxHomology = *max_element( &homologyMatrix[0][0] + 0, &homologyMatrix[23][23] + 1 );
 			minHomology = *min_element( &homologyMatrix[0][0] + 0, &homologyMatrix[23][23] + 1 );
-			printf( "MaxHomology: %d, MinHomology: %d\n", maxHomology, minHomology );
+			batchSimilarity.reset( new BatchSimilarity( homologyMatrix ) );
+
+			auto & t = homologyTables;
+			for ( size_t c = 0; c != 256; ++c ) {
+					t.charIndex[c] = EncodedWords::Encode( static_cast< char >( c ) );
+			}
+			for ( size_t code = 0; code != 32; ++code ) {   // rank in residuesInOrder + 1
+					char c = 0 < code && code < sizeof( PepTreeFormat::residuesInOrder ) ? PepTreeFormat::residuesInOrder[code-1] : 'X';
+					t.packedIndex[code] = t.charIndex[ static_cast< unsigned char >( c ) ];
+			}
+			for ( size_t a = 0; a != 24; ++a ) {
+					t.selfScore[a] = homologyMatrix[a][a];
+			}
+			for ( size_t a = 0; a != 24; ++a ) {
+					for ( size_t b = 0; b != 24; ++b ) {
+							t.pairScore[a][b] = { 2*homologyMatrix[a][b], t.selfScore[a] + t.selfScore[b] };
+					}
+			}
+			for ( size_t a = 0; a != 32; ++a ) {
+					for ( size_t b = 0; b != 32; ++b ) {
+							t.codeScore[a][b] = t.pairScore[ t.packedIndex[a] ][ t.packedIndex[b] ];
+					}
+			}
+	}
+
+	inline int8_t ResidueIndex( char c ) {
+			return homologyTables.charIndex[ static_cast< unsigned char >( c ) ];
+	}
+
+	bool IsDiagonallyDominant( int const (&matrix)[24][24] ) {
+			for ( size_t a = 0; a != 24; ++a ) {
+					for ( size_t b = 0; b != 24; ++b ) {
+							if ( 2*matrix[a][b] > matrix[a][a] + matrix[b][b] ) {
+									return false;
+							}
+					}
+			}
+			return true;
 	}
 
-	typedef pair< int, int > SimilarityScore;
-	inline int GetScoreNum( SimilarityScore const & s ) {   return get< 0 >( s );   }
-	inline int GetScoreDen( SimilarityScore const & s ) {   return get< 1 >( s );   }
+	// Fills the bounds of the children list at listIndex, whose nodes are at depth, and returns them
+	template< typename Tree >
+	pair< int, int > ComputeSubtreeBounds( SubtreeBounds & bounds, Tree const & tree, size_t listIndex, size_t depth ) {
+			int maxRest = INT_MIN, minRest = INT_MAX;
+			tree.ForNodeChildren( listIndex, [&]( size_t, char c, size_t childIndex, size_t, size_t ) {
+					int self = homologyTables.selfScore[ ResidueIndex( c ) ];
+					pair< int, int > rest{ 0, 0 };
+					if ( depth < fragSize ) {
+							rest = ComputeSubtreeBounds( bounds, tree, childIndex, depth + 1 );
+					}
+					maxRest = max( maxRest, self + rest.first );
+					minRest = min( minRest, self + rest.second );
+			});
+			if ( maxRest == INT_MIN ) {   // empty tree
+					maxRest = minRest = 0;
+			}
+			bounds.maxRest[listIndex] = static_cast< int16_t >( maxRest );
+			bounds.minRest[listIndex] = static_cast< int16_t >( minRest );
+			return { maxRest, minRest };
+	}
 
-	inline double WordsSimilarityFunction( char const * q, char const * s ) {
-			int subjectCost = 0, queryCost = 0, homologyCost = 0;
-			while ( *q != '\0' ) {
-					Fasta::AAIndex qIdx = Fasta::Char2Index( *q );
-					Fasta::AAIndex sIdx = Fasta::Char2Index( *s );
+	template< typename Tree >
+	void InitSubtreeBounds( SubtreeBounds & bounds, Tree const & tree ) {
+			bounds.maxRest.assign( tree.GetNodesSize(), 0 );
+			bounds.minRest.assign( tree.GetNodesSize(), 0 );
+			if ( tree.GetNodesSize() != 0 ) {
+					ComputeSubtreeBounds( bounds, tree, 0, 1 );
+			}
+	}
 
-					queryCost    += homologyMatrix[qIdx][qIdx];
-					subjectCost  += homologyMatrix[sIdx][sIdx];
-					homologyCost += homologyMatrix[qIdx][sIdx];
+	template< typename Tree >
+	void InitLeafCodes( vector< uint8_t > & codes, Tree const & tree ) {
+			if ( tree.HasPackedLeaves() ) {
+					vector< uint8_t >().swap( codes );
+					return;
+			}
+			size_t const wordSize = tree.Depth();
+			codes.resize( tree.GetNumberLeaves() * wordSize );
+			uint8_t charCode[256] = { 0 };
+			for ( size_t i = 0; PepTreeFormat::residuesInOrder[i]; ++i ) {
+					charCode[ static_cast< unsigned char >( PepTreeFormat::residuesInOrder[i] ) ] = static_cast< uint8_t >( i+1 );
+			}
+			auto dst = codes.begin();
+			tree.ForLeafRange( 0, tree.GetNumberLeaves(), [&]( char const * str, size_t ) {
+					for ( size_t i = 0; i != wordSize; ++i ) {
+							*dst++ = charCode[ static_cast< unsigned char >( str[i] ) ];
+					}
+			});
+	}
 
-					++q;
-					++s;
+	// Must be called once fragSize is known
+	void InitDepthBounds() {
+			depthBounds.resize( fragSize + 1 );
+			for ( size_t depth = 0; depth <= fragSize; ++depth ) {
+					auto & b = depthBounds[depth];
+					b.slack   = 2 * static_cast< int64_t >( fragSize - depth ) * maxHomology;
+					b.minGain = 2 * static_cast< int64_t >( fragSize - depth ) * minHomology;
+					b.refuse  = (cutoffNum - cutoffDen) * b.slack;
+					b.accept  = cutoffNum * b.slack - cutoffDen * b.minGain;
 			}
-			return 2.0*homologyCost/static_cast< double >(queryCost + subjectCost);
+	}
+
+	// Parses a decimal cutoff ("0.25", "1", ".4", ...) into both cutoffHomology and
+	// the exact fraction cutoffNum/cutoffDen.  At most 9 significant digits and 9 decimals
+	// are accepted, so that both are below 10^9 and their products with scores, or with
+	// the terms of another cutoff, fit in 64 bits
+	bool ParseCutoff( char const * str ) {
+			static size_t  const maxDecimals = 9;
+			static int64_t const maxNum      = 999999999;
+			char const * p = str;
+			bool negative = *p == '-';
+			if ( *p == '-' || *p == '+' ) {
+					++p;
+			}
+			int64_t num = 0, den = 1;
+			size_t nbDigits = 0, nbDecimals = 0;
+			for ( ; isdigit( *p ) && num <= maxNum; ++p, ++nbDigits ) {
+					num = 10*num + (*p - '0');
+			}
+			if ( *p == '.' ) {
+					for ( ++p; isdigit( *p ) && num <= maxNum && nbDecimals != maxDecimals; ++p, ++nbDecimals ) {
+							num = 10*num + (*p - '0');
+							den *= 10;
+					}
+			}
+			if ( *p != '\0' || nbDigits + nbDecimals == 0 || num > maxNum ) {
+					return false;
+			}
+			cutoffNum = negative ? -num : num;
+			cutoffDen = den;
+			cutoffHomology = atof( str );
+			return true;
+	}
+
+	// Exact num/den < cutoff, whatever the sign of den (0/0 never compares)
+	inline bool RatioBelowCutoff( int64_t num, int64_t den ) {
+			if ( den > 0 ) {
+					return num * cutoffDen < cutoffNum * den;
+			} else if ( den < 0 ) {
+					return num * cutoffDen > cutoffNum * den;
+			}
+			return num < 0;
+	}
+
+	// Exact num/den >= cNum/cDen (cDen > 0), whatever the sign of den
+	inline bool RatioReaches( int64_t num, int64_t den, int64_t cNum, int64_t cDen ) {
+			if ( den > 0 ) {
+					return num * cDen >= cNum * den;
+			} else if ( den < 0 ) {
+					return num * cDen <= cNum * den;
+			}
+			return num > 0;
+	}
+
+	// Exact num/den >= cutoff, whatever the sign of den
+	inline bool RatioReachesCutoff( int64_t num, int64_t den ) {
+			return RatioReaches( num, den, cutoffNum, cutoffDen );
 	}
 
 	inline SimilarityScore SimilarityFunction( char qChar, char sChar, SimilarityScore const & s ) {
-			int n = 2*homologyMatrix[Fasta::Char2Index( qChar )][Fasta::Char2Index( sChar )];
-			int d = homologyMatrix[Fasta::Char2Index( qChar )][Fasta::Char2Index( qChar )]
-			      + homologyMatrix[Fasta::Char2Index( sChar )][Fasta::Char2Index( sChar )];
-			return { GetScoreNum( s ) + n, GetScoreDen( s ) + d };
+			auto const & inc = homologyTables.pairScore[ ResidueIndex( qChar ) ][ ResidueIndex( sChar ) ];
+			return { GetScoreNum( s ) + GetScoreNum( inc ), GetScoreDen( s ) + GetScoreDen( inc ) };
 	}
 
-	bool Refuse( SimilarityScore const & s, size_t depth ) {
-			double k = 2.0*((fragSize-depth)*(double)maxHomology);
-			return (GetScoreNum( s ) + k) / (GetScoreDen( s ) + k) < cutoffHomology;   // early refuse
+	inline bool Refuse( SimilarityScore const & s, size_t depth ) {
+			auto const & b = depthBounds[depth];
+			int64_t num = GetScoreNum( s ), den = GetScoreDen( s );
+			if ( den + b.slack > 0 ) {
+					return cutoffDen*num - cutoffNum*den < b.refuse;   // early refuse
+			}
+			return RatioBelowCutoff( num + b.slack, den + b.slack );
 	}
 
-	bool Accept( SimilarityScore const & s, size_t depth ) {
-			double k = 2.0*((fragSize-depth)*(double)maxHomology);
-			double l = 2.0*((fragSize-depth)*(double)minHomology);
-			return (GetScoreNum( s ) + l) / (GetScoreDen( s ) + k) >= cutoffHomology;   // early accept
+	// Refuse() with the subtree bounds of the query and subject children when enabled
+	inline bool Refuse( SimilarityScore const & s, size_t depth, size_t queryChildIndex, size_t subjectChildIndex ) {
+			if ( tightBounds && depth < fragSize ) {
+					int64_t num = GetScoreNum( s ), den = GetScoreDen( s );
+					int64_t maxRest = queryBounds.maxRest[queryChildIndex] + subjectBounds->maxRest[subjectChildIndex];
+					int64_t minRest = queryBounds.minRest[queryChildIndex] + subjectBounds->minRest[subjectChildIndex];
+					if ( den + minRest > 0 ) {
+							return RatioBelowCutoff( num + maxRest, den + maxRest );
+					}
+			}
+			return Refuse( s, depth );
 	}
 
-	size_t nbStringSimilarity = 0;
+	// Upper bound of the final scores below a (query child, subject child) pair, the one
+	// Refuse() compares to the cutoff
+	inline SimilarityScore UpperBound( SimilarityScore const & s, size_t depth, size_t queryChildIndex, size_t subjectChildIndex ) {
+			int num = GetScoreNum( s ), den = GetScoreDen( s );
+			if ( tightBounds && depth < fragSize ) {
+					int maxRest = queryBounds.maxRest[queryChildIndex] + subjectBounds->maxRest[subjectChildIndex];
+					int minRest = queryBounds.minRest[queryChildIndex] + subjectBounds->minRest[subjectChildIndex];
+					if ( den + minRest > 0 ) {
+							return { num + maxRest, den + maxRest };
+					}
+			}
+			int slack = static_cast< int >( depthBounds[depth].slack );
+			return { num + slack, den + slack };
+	}
+
+	inline bool Accept( SimilarityScore const & s, size_t depth ) {
+			auto const & b = depthBounds[depth];
+			int64_t num = GetScoreNum( s ), den = GetScoreDen( s );
+			if ( den + b.slack > 0 ) {
+					return cutoffDen*num - cutoffNum*den >= b.accept;   // early accept
+			}
+			return RatioReachesCutoff( num + b.minGain, den + b.slack );
+	}
+
+	// Fragment size of the traversal, a compile time constant for the common sizes
+	template< size_t FragSize >
+	inline size_t FragLength() {   return FragSize;   }
+
+	template<>
+	inline size_t FragLength< 0 >() {   return fragSize;   }
+
+	struct MappingStats {
+			size_t nbStringSimilarity = 0;
+#if defined( PROFILE_PERF )
+			vector< tuple< size_t, size_t, size_t > > refuseStats;
+			vector< tuple< size_t, size_t, size_t > > acceptStats;
+			vector< tuple< size_t, size_t, size_t > > cutoverStats;   // node pairs, leaf pairs scored, pairs kept
+#endif
+
+			MappingStats() {
+#if defined( PROFILE_PERF )
+					refuseStats.resize( fragSize );
+					acceptStats.resize( fragSize );
+					cutoverStats.resize( fragSize );
+#endif
+			}
+
+			void Merge( MappingStats const & o ) {
+					nbStringSimilarity += o.nbStringSimilarity;
 #if defined( PROFILE_PERF )
-	static vector< tuple< size_t, size_t, size_t > > refuseStats;
-	static vector< tuple< size_t, size_t, size_t > > acceptStats;
+					auto Add = []( vector< tuple< size_t, size_t, size_t > > & dst
+					             , vector< tuple< size_t, size_t, size_t > > const & src
+					             ) {
+							for ( size_t i = 0, e = dst.size(); i != e; ++i ) {
+									get< 0 >( dst[i] ) += get< 0 >( src[i] );
+									get< 1 >( dst[i] ) += get< 1 >( src[i] );
+									get< 2 >( dst[i] ) += get< 2 >( src[i] );
+							}
+					};
+					Add( refuseStats, o.refuseStats );
+					Add( acceptStats, o.acceptStats );
+					Add( cutoverStats, o.cutoverStats );
 #endif
+			}
+	};
+
+	// a < b for scores of any sign, a null denominator standing for an infinite score
+	inline bool ScoreLess( SimilarityScore a, SimilarityScore b ) {
+			auto Normalize = []( SimilarityScore & s ) {
+					if ( GetScoreDen( s ) < 0 ) {
+							s = { -GetScoreNum( s ), -GetScoreDen( s ) };
+					} else if ( GetScoreDen( s ) == 0 && GetScoreNum( s ) == 0 ) {
+							s = { 0, 1 };
+					}
+			};
+			Normalize( a );
+			Normalize( b );
+			if ( GetScoreDen( a ) == 0 && GetScoreDen( b ) == 0 ) {
+					return GetScoreNum( a ) < GetScoreNum( b );
+			}
+			return static_cast< int64_t >( GetScoreNum( a ) ) * GetScoreDen( b ) < static_cast< int64_t >( GetScoreNum( b ) ) * GetScoreDen( a );
+	}
+
+	// Best hits of every query leaf: a bounded heap per query leaf, its worst hit on top,
+	// and a min tree over the query leaves of the worst hit of the full heaps, the score
+	// that a hit of a query range has to reach for any of its leaves to keep it.  Hits
+	// are ranked by score, then by subject leaf, so that the kept hits do not depend on
+	// the order they come in.
+	// The workers share a single TopHits: the heaps, only allocated for the query leaves
+	// that get hits, are guarded by striped locks, and the min tree is read and updated
+	// without locks.  The worst hit of a heap only ever gets better, so a racing update
+	// can only leave a node of the tree under the minimum of its leaves, which refuses
+	// less but never a hit that would be kept.
+	class TopHits {
+		public:
+			struct Hit {
+					uint64_t        subject;
+					SimilarityScore score;
+			};
 
-	inline size_t GetRangeNumLeaves( uint32_t start, uint32_t stop ) {
+		public:
+			TopHits( size_t nbQueries_, size_t k_ )
+				: nbQueries( nbQueries_ )
+				, k( k_ )
+				, nbFull( 0 )
+				, locks( k_ != 0 ? nbLocks : 0 )
+				, heaps( k_ != 0 ? nbQueries_ : 0 )
+				, worst( k_ != 0 ? 2 * nbQueries_ : 0 ) {
+					for ( auto & w : worst ) {
+							w.store( Pack( None() ), memory_order_relaxed );
+					}
+			}
+
+		public:
+			void Add( size_t query, uint64_t subject, int32_t scoreNum, int32_t scoreDen ) {
+					Hit hit{ subject, { scoreNum, scoreDen } };
+					// Not kept by a full heap, no need to lock it
+					if ( ScoreLess( hit.score, Unpack( worst[query + nbQueries].load( memory_order_relaxed ) ) ) ) {
+							return;
+					}
+					lock_guard< mutex > lock( locks[query % nbLocks] );
+					auto & heap = heaps[query];
+					if ( heap.size() < k ) {
+							heap.push_back( hit );
+							push_heap( heap.begin(), heap.end(), Better );
+							if ( heap.size() == k ) {
+									nbFull.fetch_add( 1, memory_order_relaxed );
+									SetWorst( query, heap[0].score );
+							}
+					} else if ( Better( hit, heap[0] ) ) {
+							pop_heap( heap.begin(), heap.end(), Better );
+							heap[k-1] = hit;
+							push_heap( heap.begin(), heap.end(), Better );
+							SetWorst( query, heap[0].score );
+					}
+			}
+
+			// True when no hit of score at most bound can be kept by the queries of [start, stop)
+			bool Refuse( size_t start, size_t stop, SimilarityScore bound ) const {
+					if ( nbFull.load( memory_order_relaxed ) == 0 ) {
+							return false;
+					}
+					SimilarityScore threshold = Infinite();
+					for ( start += nbQueries, stop += nbQueries; start < stop; start >>= 1, stop >>= 1 ) {
+							if ( start & 1 ) {
+									threshold = Min( threshold, Unpack( worst[start++].load( memory_order_relaxed ) ) );
+							}
+							if ( stop & 1 ) {
+									threshold = Min( threshold, Unpack( worst[--stop].load( memory_order_relaxed ) ) );
+							}
+					}
+					return ScoreLess( bound, threshold );
+			}
+
+			// Writes the hits query leaf by query leaf, best first, and returns their number
+			template< typename Writer >
+			size_t Write( Writer & out ) const {
+					vector< Hit > sorted;
+					size_t nbHits = 0;
+					for ( size_t q = 0; q != heaps.size(); ++q ) {
+							sorted.assign( heaps[q].begin(), heaps[q].end() );
+							sort( sorted.begin(), sorted.end(), Better );
+							for ( auto const & hit : sorted ) {
+									out.Add( q, hit.subject, GetScoreNum( hit.score ), GetScoreDen( hit.score ) );
+							}
+							nbHits += sorted.size();
+					}
+					return nbHits;
+			}
+
+		private:
+			static size_t const nbLocks = 4096;
+
+			size_t           nbQueries;
+			size_t           k;
+			atomic< size_t > nbFull;
+
+			vector< mutex >               locks;   // of the heaps, by query leaf modulo nbLocks
+			vector< vector< Hit > >       heaps;   // up to k hits per query leaf
+			vector< atomic< uint64_t > >  worst;   // packed min tree, leaves from nbQueries on
+
+		private:
+			static SimilarityScore None()     {   return { -1, 0 };   }   // heap not full, anything goes
+			static SimilarityScore Infinite() {   return {  1, 0 };   }
+
+			static uint64_t Pack( SimilarityScore s ) {
+					return static_cast< uint64_t >( static_cast< uint32_t >( GetScoreNum( s ) ) ) << 32 | static_cast< uint32_t >( GetScoreDen( s ) );
+			}
+			static SimilarityScore Unpack( uint64_t v ) {
+					return { static_cast< int32_t >( v >> 32 ), static_cast< int32_t >( static_cast< uint32_t >( v ) ) };
+			}
+
+			static bool Better( Hit const & a, Hit const & b ) {
+					if ( ScoreLess( b.score, a.score ) ) {
+							return true;
+					}
+					return !ScoreLess( a.score, b.score ) && a.subject < b.subject;
+			}
+
+			static SimilarityScore Min( SimilarityScore a, SimilarityScore b ) {
+					return ScoreLess( b, a ) ? b : a;
+			}
+
+			void SetWorst( size_t query, SimilarityScore score ) {
+					size_t i = query + nbQueries;
+					worst[i].store( Pack( score ), memory_order_relaxed );
+					for ( i >>= 1; i != 0; i >>= 1 ) {
+							auto m = Min( Unpack( worst[2*i].load( memory_order_relaxed ) ), Unpack( worst[2*i+1].load( memory_order_relaxed ) ) );
+							worst[i].store( Pack( m ), memory_order_relaxed );
+					}
+			}
+	};
+
+	// A leaf pair of a cutover reaching the cutoff, with the depth and the score its node
+	// pair is accepted at; leaves are numbered from the start of their ranges
+	struct CutoverPair {
+			size_t          query, subject;
+			size_t          depth;
+			SimilarityScore score;
+	};
+
+	// Per-thread state of the traversal
+	struct MappingWorker {
+			explicit MappingWorker( TopHits * topHits_ = nullptr )
+				: profiles( querySamples ? 1 + querySamples->NbSamples() : 1, ProfileAccumulator( fragSize, queryAbundances != nullptr ) )
+				, topHits( topHits_ ) {
+			}
+
+			MappingStats stats;
+
+			// profiles mode coverage, of the query tree then of each of its samples
+			vector< ProfileAccumulator > profiles;
+
+			// top-k mode hits, shared by the workers
+			TopHits * topHits;
+
+			// early accept rescoring buffers
+			EncodedWords      subjects;
+			vector< int32_t > subjectSelfScores;
+			vector< int32_t > homology;
+			vector< int8_t >  word;
+
+			// cutover buffers
+			EncodedWords          cutoverSubjects;
+			vector< int32_t >     cutoverSelfScores;
+			vector< int32_t >     cutoverHomology;
+			vector< int8_t >      cutoverWord;
+			vector< CutoverPair > cutoverPairs;
+	};
+
+	inline size_t GetRangeNumLeaves( size_t start, size_t stop ) {
 			return (stop - start) / LeavesLinkSize( fragSize );
 	}
 
-	template< typename F >
-	void ResolveMapping( FILE * file
-	                   , MMappedPepTree const & query  , uint32_t queryStartIndex  , uint32_t queryStopIndex
-	                   , MMappedPepTree const & subject, uint32_t subjectStartIndex, uint32_t subjectStopIndex
+	template< typename Writer, typename Query, typename Subject, typename F >
+	void ResolveMapping( Writer & out, MappingWorker & worker
+	                   , Query   const & query  , size_t queryStartIndex  , size_t queryStopIndex
+	                   , Subject const & subject, size_t subjectStartIndex, size_t subjectStopIndex
 	                   , F && scoreFunc
 	                   ) {
-			for ( uint32_t qIdx = queryStartIndex; qIdx != queryStopIndex; ++qIdx ) {
-					for ( uint32_t sIdx = subjectStartIndex; sIdx != subjectStopIndex; ++sIdx ) {
-							query.ForLeaf( qIdx, [=]( char const * qStr, uint32_t ) {
-									subject.ForLeaf( sIdx, [=]( char const * sStr, uint32_t ) {
-											fprintf( file, "%u %u %g\n", qIdx, sIdx, scoreFunc( qStr, sStr ) );
+			for ( size_t qIdx = queryStartIndex; qIdx != queryStopIndex; ++qIdx ) {
+					for ( size_t sIdx = subjectStartIndex; sIdx != subjectStopIndex; ++sIdx ) {
+							query.ForLeaf( qIdx, [&,qIdx,sIdx]( char const * qStr, size_t ) {
+									subject.ForLeaf( sIdx, [&,qIdx,sIdx]( char const * sStr, size_t ) {
+											auto score = scoreFunc( qStr, sStr );
+											out.Add( qIdx, sIdx, GetScoreNum( score ), GetScoreDen( score ) );
 									});
 							});
-							++nbStringSimilarity;
+							++worker.stats.nbStringSimilarity;
+					}
+			}
+	}
+
+	// Writes every pair of the accepted leaf ranges
+	template< size_t FragSize, typename Writer, typename Query, typename Subject >
+	void EmitAccepted( Writer & out, MappingWorker & worker
+	                 , Query   const & query  , size_t queryStartLeaf  , size_t queryStopLeaf
+	                 , Subject const & subject, size_t subjectStartLeaf, size_t subjectStopLeaf
+	                 , SimilarityScore score, size_t depth
+	                 ) {
+			size_t const wordSize = FragLength< FragSize >();
+			if ( depth == wordSize ) {
+					ResolveMapping( out, worker
+					              , query  , queryStartLeaf  , queryStopLeaf
+					              , subject, subjectStartLeaf, subjectStopLeaf
+					              , [score]( char const *, char const * ) {   return score;   }
+					              );
+			} else {
+					// Early accept: the subject range is encoded once, then every query leaf is
+					// scored against all of it at once
+					auto & subjects = worker.subjects;
+					auto & selfS    = worker.subjectSelfScores;
+					auto & homology = worker.homology;
+					subjects.Resize( wordSize, subjectStopLeaf - subjectStartLeaf );
+					selfS.resize( subjects.Size() );
+					homology.resize( subjects.Stride() );
+					// Packed leaves are read as encoded, without going through their strings
+					auto & word = worker.word;
+					word.resize( wordSize );
+					auto EncodeLeaf = [&]( auto const & tree, size_t leaf ) {
+							if ( tree.HasPackedLeaves() ) {
+									uint64_t packed = tree.GetPackedLeaf( leaf );
+									for ( size_t i = wordSize; i-- != 0; packed >>= 5 ) {
+											word[i] = homologyTables.packedIndex[ packed & 31 ];
+									}
+							} else {
+									tree.ForLeaf( leaf, [&]( char const * str, size_t ) {
+											for ( size_t i = 0; i != wordSize; ++i ) {
+													word[i] = ResidueIndex( str[i] );
+											}
+									});
+							}
+							return batchSimilarity->SelfScore( word.data(), wordSize );
+					};
+					for ( size_t sIdx = subjectStartLeaf; sIdx != subjectStopLeaf; ++sIdx ) {
+							selfS[sIdx - subjectStartLeaf] = EncodeLeaf( subject, sIdx );
+							subjects.Set( sIdx - subjectStartLeaf, word.data() );
+					}
+					for ( size_t qIdx = queryStartLeaf; qIdx != queryStopLeaf; ++qIdx ) {
+							int selfQ = EncodeLeaf( query, qIdx );
+							batchSimilarity->Homology( word.data(), subjects, homology.data() );
+							for ( size_t j = 0, e = subjects.Size(); j != e; ++j ) {
+									out.Add( qIdx, subjectStartLeaf + j, 2*homology[j], selfQ + selfS[j] );
+							}
+							worker.stats.nbStringSimilarity += subjects.Size();
+					}
+			}
+	}
+
+	// In blocks mode the accepted ranges are written as is, scores being recomputed by the consumers needing them
+	template< size_t FragSize, typename Query, typename Subject >
+	void EmitAccepted( Mapping::BlockWriter & out, MappingWorker & worker
+	                 , Query   const &, size_t queryStartLeaf  , size_t queryStopLeaf
+	                 , Subject const &, size_t subjectStartLeaf, size_t subjectStopLeaf
+	                 , SimilarityScore, size_t depth
+	                 ) {
+			out.AddBlock( queryStartLeaf, queryStopLeaf, subjectStartLeaf, subjectStopLeaf, static_cast< uint32_t >( depth ) );
+			worker.stats.nbStringSimilarity += static_cast< size_t >( queryStopLeaf - queryStartLeaf ) * (subjectStopLeaf - subjectStartLeaf);
+	}
+
+	// In profiles mode nothing is written, the accepted subject leaves directly feed
+	// the coverage profiles of the worker, weighted by the number (or the abundance) of
+	// the query leaves, and those of the samples of a multi-sample query tree by the
+	// number of their leaves
+	struct ProfileWriter {
+			explicit ProfileWriter( OutputBuffer & ) {   }
+
+			void Finish() {   }
+	};
+
+	template< size_t FragSize, typename Query, typename Subject >
+	void EmitAccepted( ProfileWriter &, MappingWorker & worker
+	                 , Query   const &       , size_t queryStartLeaf  , size_t queryStopLeaf
+	                 , Subject const & subject, size_t subjectStartLeaf, size_t subjectStopLeaf
+	                 , SimilarityScore, size_t
+	                 ) {
+			uint64_t weight = queryAbundances ? queryAbundances->Sum( queryStartLeaf, queryStopLeaf ) : queryStopLeaf - queryStartLeaf;
+			for ( size_t sIdx = subjectStartLeaf; sIdx != subjectStopLeaf; ++sIdx ) {
+					worker.profiles[0].AddLeaf( subject, *subjectFastIdx, sIdx, weight );
+			}
+			for ( size_t s = 0; querySamples && s != querySamples->NbSamples(); ++s ) {
+					auto weight = querySamples->Rank( s, queryStopLeaf ) - querySamples->Rank( s, queryStartLeaf );
+					for ( size_t sIdx = subjectStartLeaf; weight != 0 && sIdx != subjectStopLeaf; ++sIdx ) {
+							worker.profiles[1+s].AddLeaf( subject, *subjectFastIdx, sIdx, weight );
+					}
+			}
+			worker.stats.nbStringSimilarity += static_cast< size_t >( queryStopLeaf - queryStartLeaf ) * (subjectStopLeaf - subjectStartLeaf);
+	}
+
+	// In top-k mode nothing is written either, the accepted pairs are scored into the
+	// shared hits, which are written once the traversal is over
+	struct TopHitsWriter {
+			explicit TopHitsWriter( OutputBuffer & ) {   }
+
+			void Finish() {   }
+	};
+
+	template< size_t FragSize, typename Query, typename Subject >
+	void EmitAccepted( TopHitsWriter &, MappingWorker & worker
+	                 , Query   const & query  , size_t queryStartLeaf  , size_t queryStopLeaf
+	                 , Subject const & subject, size_t subjectStartLeaf, size_t subjectStopLeaf
+	                 , SimilarityScore score, size_t depth
+	                 ) {
+			EmitAccepted< FragSize >( *worker.topHits, worker
+			            , query  , queryStartLeaf  , queryStopLeaf
+			            , subject, subjectStartLeaf, subjectStopLeaf
+			            , score, depth
+			            );
+	}
+
+	// Residue codes of the leaves of a leaf range, by leaf from the start of the range, read
+	// by a cutover from the codes extracted when the tree was loaded...
+	template< size_t FragSize >
+	struct ByteLeafCodes {
+			uint8_t const * codes;   // of the first leaf of the range
+
+			uint8_t operator()( size_t leaf, size_t i ) const {
+					return codes[leaf * FragLength< FragSize >() + i];
+			}
+	};
+
+	// ...or straight from the packed words of a tree having them
+	template< size_t FragSize, typename Tree >
+	struct PackedLeafCodes {
+			Tree const & tree;
+			size_t       start;
+
+			uint8_t operator()( size_t leaf, size_t i ) const {
+					return static_cast< uint8_t >( (tree.GetPackedLeaf( start + leaf ) >> (5*(FragLength< FragSize >() - 1 - i))) & 31 );
+			}
+	};
+
+	// Cutover of the traversal under a (query node, subject node) pair reached at depth with
+	// score: every leaf pair of their ranges is scored at once, and those the traversal
+	// would accept are emitted in the accepted blocks, and the order, it would have.  A
+	// pair is accepted at the first depth its prefix score is accepted at, unless refused
+	// before; pairs of the same accepted node pair share their prefixes down to that depth,
+	// and other pairs are ordered as their first differing query, else subject, residue.
+	template< size_t FragSize, typename Writer, typename Query, typename Subject, typename QueryCodes, typename SubjectCodes >
+	void MapLeafRanges( Writer & out, MappingWorker & worker
+	                  , Query   const & query  , size_t queryStartLeaf  , size_t queryStopLeaf  , QueryCodes   const & qCodes
+	                  , Subject const & subject, size_t subjectStartLeaf, size_t subjectStopLeaf, SubjectCodes const & sCodes
+	                  , SimilarityScore score, size_t depth
+	                  ) {
+			size_t const wordSize   = FragLength< FragSize >();
+			size_t const nbQueries  = queryStopLeaf - queryStartLeaf;
+			size_t const nbSubjects = subjectStopLeaf - subjectStartLeaf;
+			bool   const simd       = nbSubjects >= cutoverSimdSubjects;
+			auto & subjects = worker.cutoverSubjects;
+			auto & selfS    = worker.cutoverSelfScores;
+			auto & homology = worker.cutoverHomology;
+			auto & word     = worker.cutoverWord;
+			auto & pairs    = worker.cutoverPairs;
+			// Wide subject ranges are first filtered on their full scores, computed at once
+			auto Encode = [&]( auto const & codes, size_t leaf ) {
+					for ( size_t i = 0; i != wordSize; ++i ) {
+							word[i] = homologyTables.packedIndex[ codes( leaf, i ) ];
+					}
+					return batchSimilarity->SelfScore( word.data(), wordSize );
+			};
+			if ( simd ) {
+					subjects.Resize( wordSize, nbSubjects );
+					homology.resize( subjects.Stride() );
+					selfS.resize( nbSubjects );
+					word.resize( wordSize );
+					for ( size_t j = 0; j != nbSubjects; ++j ) {
+							selfS[j] = Encode( sCodes, j );
+							subjects.Set( j, word.data() );
+					}
+			}
+
+			pairs.clear();
+			for ( size_t i = 0; i != nbQueries; ++i ) {
+					int selfQ = 0;
+					if ( simd ) {
+							selfQ = Encode( qCodes, i );
+							batchSimilarity->Homology( word.data(), subjects, homology.data() );
+					}
+					for ( size_t j = 0; j != nbSubjects; ++j ) {
+							if ( simd && !Accept( { 2*homology[j], selfQ + selfS[j] }, wordSize ) ) {
+									continue;
+							}
+							auto s = score;
+							for ( size_t d = depth + 1; d <= wordSize; ++d ) {
+									auto const & inc = homologyTables.codeScore[ qCodes( i, d-1 ) ][ sCodes( j, d-1 ) ];
+									s = { GetScoreNum( s ) + GetScoreNum( inc ), GetScoreDen( s ) + GetScoreDen( inc ) };
+									if ( Refuse( s, d ) ) {
+											break;
+									}
+									if ( Accept( s, d ) ) {
+											pairs.push_back( CutoverPair{ i, j, d, s } );
+											break;
+									}
+							}
+					}
+			}
+#if defined( PROFILE_PERF )
+			get< 0 >( worker.stats.cutoverStats[depth-1] ) += 1;
+			get< 1 >( worker.stats.cutoverStats[depth-1] ) += nbQueries * nbSubjects;
+			get< 2 >( worker.stats.cutoverStats[depth-1] ) += pairs.size();
+#endif
+
+			// residues shared by two leaves past the common prefix of the ranges
+			auto Common = [&]( auto const & codes, size_t a, size_t b ) {
+					size_t d = depth;
+					while ( d != wordSize && codes( a, d ) == codes( b, d ) ) {
+							++d;
+					}
+					return d;
+			};
+			auto CommonQueries  = [&]( size_t a, size_t b ) {   return Common( qCodes, a, b );   };
+			auto CommonSubjects = [&]( size_t a, size_t b ) {   return Common( sCodes, a, b );   };
+			sort( pairs.begin(), pairs.end(), [&]( CutoverPair const & a, CutoverPair const & b ) {
+					size_t commonQ = CommonQueries( a.query, b.query ), commonS = CommonSubjects( a.subject, b.subject );
+					if ( a.depth <= min( commonQ, commonS ) ) {   // same accepted node pair
+							return a.query != b.query ? a.query < b.query : a.subject < b.subject;
+					}
+					return commonQ <= commonS ? a.query < b.query : a.subject < b.subject;
+			});
+
+			for ( size_t p = 0; p != pairs.size(); ) {
+					auto const & first = pairs[p];
+					size_t queryStop = first.query + 1, subjectStop = first.subject + 1;
+					for ( ++p; p != pairs.size() && pairs[p].depth == first.depth
+					         && CommonQueries( first.query, pairs[p].query ) >= first.depth
+					         && CommonSubjects( first.subject, pairs[p].subject ) >= first.depth; ++p ) {
+							queryStop   = pairs[p].query + 1;
+							subjectStop = max( subjectStop, pairs[p].subject + 1 );
+					}
+					EmitAccepted< FragSize >( out, worker
+					            , query  , queryStartLeaf   + first.query  , queryStartLeaf   + queryStop
+					            , subject, subjectStartLeaf + first.subject, subjectStartLeaf + subjectStop
+					            , first.score, first.depth
+					            );
+#if defined( PROFILE_PERF )
+					get< 0 >( worker.stats.acceptStats[first.depth-1] ) += 1;
+					get< 1 >( worker.stats.acceptStats[first.depth-1] ) += queryStop   - first.query;
+					get< 2 >( worker.stats.acceptStats[first.depth-1] ) += subjectStop - first.subject;
+#endif
+			}
+	}
+
+	// The leaf codes of both ranges are read from their packed words when the trees have them.
+	// Kept out of MapChildren: inlined, the cutovers bloat its frame, paid by every node pair.
+	template< size_t FragSize, typename Writer, typename Query, typename Subject >
+	__attribute__(( noinline ))
+	void MapLeafRanges( Writer & out, MappingWorker & worker
+	                  , Query   const & query  , size_t queryStartLeaf  , size_t queryStopLeaf
+	                  , Subject const & subject, size_t subjectStartLeaf, size_t subjectStopLeaf
+	                  , SimilarityScore score, size_t depth
+	                  ) {
+			auto WithSubjectCodes = [&]( auto const & qCodes ) {
+					if ( subject.HasPackedLeaves() ) {
+							MapLeafRanges< FragSize >( out, worker
+							             , query  , queryStartLeaf  , queryStopLeaf  , qCodes
+							             , subject, subjectStartLeaf, subjectStopLeaf, PackedLeafCodes< FragSize, Subject >{ subject, subjectStartLeaf }
+							             , score, depth
+							             );
+					} else {
+							MapLeafRanges< FragSize >( out, worker
+							             , query  , queryStartLeaf  , queryStopLeaf  , qCodes
+							             , subject, subjectStartLeaf, subjectStopLeaf, ByteLeafCodes< FragSize >{ subjectCodes + subjectStartLeaf * FragLength< FragSize >() }
+							             , score, depth
+							             );
 					}
+			};
+			if ( query.HasPackedLeaves() ) {
+					WithSubjectCodes( PackedLeafCodes< FragSize, Query >{ query, queryStartLeaf } );
+			} else {
+					WithSubjectCodes( ByteLeafCodes< FragSize >{ &queryCodes[queryStartLeaf * FragLength< FragSize >()] } );
 			}
 	}
 
-	void MapTrees( FILE * file
-	             , MMappedPepTree const & query  , uint32_t queryIndex
-	             , MMappedPepTree const & subject, uint32_t subjectIndex
+	template< size_t FragSize, typename Writer, typename Query, typename Subject >
+	void MapTrees( Writer & out, MappingWorker & worker
+	             , Query   const & query  , size_t queryIndex
+	             , Subject const & subject, size_t subjectIndex
+	             , SimilarityScore curScore, size_t depth
+	             );
+
+	// Processes one (query child, subject child) pair reached at the given depth
+	template< size_t FragSize, typename Writer, typename Query, typename Subject >
+	inline __attribute__(( always_inline ))
+	void MapChildren( Writer & out, MappingWorker & worker
+	                , Query   const & query
+	                , char queryChar, size_t queryChildIndex, size_t queryStartLeaf, size_t queryStopLeaf
+	                , Subject const & subject
+	                , char subjectChar, size_t subjectChildIndex, size_t subjectStartLeaf, size_t subjectStopLeaf
+	                , SimilarityScore curScore, size_t depth
+	                ) {
+			auto newScore = SimilarityFunction( queryChar, subjectChar, curScore );
+			if ( Refuse( newScore, depth, queryChildIndex, subjectChildIndex )
+			  || (topK != 0 && worker.topHits->Refuse( queryStartLeaf, queryStopLeaf, UpperBound( newScore, depth, queryChildIndex, subjectChildIndex ) ))
+			   ) {
+#if defined( PROFILE_PERF )
+					get< 0 >( worker.stats.refuseStats[depth-1] ) += 1;
+					get< 1 >( worker.stats.refuseStats[depth-1] ) += GetRangeNumLeaves( queryStartLeaf  , queryStopLeaf   );
+					get< 2 >( worker.stats.refuseStats[depth-1] ) += GetRangeNumLeaves( subjectStartLeaf, subjectStopLeaf );
+#endif
+			} else if ( Accept( newScore, depth ) && (topK == 0 || depth == FragLength< FragSize >()) ) {
+					EmitAccepted< FragSize >( out, worker
+					            , query  , queryStartLeaf  , queryStopLeaf
+					            , subject, subjectStartLeaf, subjectStopLeaf
+					            , newScore, depth
+					            );
+#if defined( PROFILE_PERF )
+					get< 0 >( worker.stats.acceptStats[depth-1] ) += 1;
+					get< 1 >( worker.stats.acceptStats[depth-1] ) += GetRangeNumLeaves( queryStartLeaf  , queryStopLeaf   );
+					get< 2 >( worker.stats.acceptStats[depth-1] ) += GetRangeNumLeaves( subjectStartLeaf, subjectStopLeaf );
+#endif
+			} else if ( depth < FragLength< FragSize >() ) {
+					if ( (queryStopLeaf - queryStartLeaf) * (subjectStopLeaf - subjectStartLeaf) <= cutoverPairs ) {
+							MapLeafRanges< FragSize >( out, worker
+							             , query  , queryStartLeaf  , queryStopLeaf
+							             , subject, subjectStartLeaf, subjectStopLeaf
+							             , newScore, depth
+							             );
+					} else {
+							MapTrees< FragSize >( out, worker
+							        , query, queryChildIndex, subject, subjectChildIndex
+							        , newScore, depth + 1
+							        );
+					}
+			}
+	}
+
+	template< size_t FragSize, typename Writer, typename Query, typename Subject >
+	void MapTrees( Writer & out, MappingWorker & worker
+	             , Query   const & query  , size_t queryIndex
+	             , Subject const & subject, size_t subjectIndex
 	             , SimilarityScore curScore, size_t depth
 	             ) {
 			query.ForNodeChildren( queryIndex
 			               , [&,subjectIndex,depth,curScore]( size_t
-			                                                , char queryChar, uint32_t queryChildIndex
-			                                                , uint32_t queryStartLeaf, uint32_t queryStopLeaf
+			                                                , char queryChar, size_t queryChildIndex
+			                                                , size_t queryStartLeaf, size_t queryStopLeaf
 			                                                ) {
 					subject.ForNodeChildren( subjectIndex
 					               , [&,depth,curScore]( size_t
-					                                   , char subjectChar, uint32_t subjectChildIndex
-					                                   , uint32_t subjectStartLeaf, uint32_t subjectStopLeaf
+					                                   , char subjectChar, size_t subjectChildIndex
+					                                   , size_t subjectStartLeaf, size_t subjectStopLeaf
 					                                   ) {
+							MapChildren< FragSize >( out, worker
+							           , query  , queryChar  , queryChildIndex  , queryStartLeaf  , queryStopLeaf
+							           , subject, subjectChar, subjectChildIndex, subjectStartLeaf, subjectStopLeaf
+							           , curScore, depth
+							           );
+					});
+			});
+	}
+
+	// A (query child, subject child) pair to be processed as an independent task
+	struct MappingTask {
+			char     queryChar;
+			size_t   queryChildIndex, queryStartLeaf, queryStopLeaf;
+			char     subjectChar;
+			size_t   subjectChildIndex, subjectStartLeaf, subjectStopLeaf;
+			SimilarityScore curScore;
+			size_t   depth;
+	};
+
+	// Lists, in serial traversal order, the node pairs under (queryIndex, subjectIndex)
+	// down to splitDepth; pairs refused or accepted before splitDepth are kept as is
+	template< typename Query, typename Subject >
+	void SplitTasks( vector< MappingTask > & tasks
+	               , Query   const & query  , size_t queryIndex
+	               , Subject const & subject, size_t subjectIndex
+	               , SimilarityScore curScore, size_t depth, size_t splitDepth
+	               ) {
+			query.ForNodeChildren( queryIndex
+			               , [&]( size_t
+			                    , char queryChar, size_t queryChildIndex
+			                    , size_t queryStartLeaf, size_t queryStopLeaf
+			                    ) {
+					subject.ForNodeChildren( subjectIndex
+					               , [&]( size_t
+					                    , char subjectChar, size_t subjectChildIndex
+					                    , size_t subjectStartLeaf, size_t subjectStopLeaf
+					                    ) {
 							auto newScore = SimilarityFunction( queryChar, subjectChar, curScore );
-							if ( Refuse( newScore, depth ) ) {
-#if defined( PROFILE_PERF )
-									get< 0 >( refuseStats[depth-1] ) += 1;
-									get< 1 >( refuseStats[depth-1] ) += GetRangeNumLeaves( queryStartLeaf  , queryStopLeaf   );
-									get< 2 >( refuseStats[depth-1] ) += GetRangeNumLeaves( subjectStartLeaf, subjectStopLeaf );
-#endif
-							} else if ( Accept( newScore, depth ) ) {
-									if ( depth == fragSize ) {
-											double scoreVal = GetScoreNum( newScore ) / (double)GetScoreDen( newScore );
-											ResolveMapping( file
-											              , query  , queryStartLeaf  , queryStopLeaf
-											              , subject, subjectStartLeaf, subjectStopLeaf
-											              , [scoreVal]( char const *, char const * ) {   return scoreVal;   }
-											              );
-									} else {
-											ResolveMapping( file
-											              , query  , queryStartLeaf  , queryStopLeaf
-											              , subject, subjectStartLeaf, subjectStopLeaf
-											              , &WordsSimilarityFunction
-											              );
-									}
-#if defined( PROFILE_PERF )
-									get< 0 >( acceptStats[depth-1] ) += 1;
-									get< 1 >( acceptStats[depth-1] ) += GetRangeNumLeaves( queryStartLeaf  , queryStopLeaf   );
-									get< 2 >( acceptStats[depth-1] ) += GetRangeNumLeaves( subjectStartLeaf, subjectStopLeaf );
-#endif
-							} else if ( depth < fragSize ) {
-									MapTrees( file
-									        , query, queryChildIndex, subject, subjectChildIndex
-									        , newScore, depth + 1
-									        );
+							if ( depth < splitDepth && depth < fragSize
+							  && !Refuse( newScore, depth, queryChildIndex, subjectChildIndex ) && !Accept( newScore, depth )
+							   ) {
+									SplitTasks( tasks
+									          , query, queryChildIndex, subject, subjectChildIndex
+									          , newScore, depth + 1, splitDepth
+									          );
+							} else {
+									tasks.push_back( MappingTask{ queryChar, queryChildIndex, queryStartLeaf, queryStopLeaf
+									                            , subjectChar, subjectChildIndex, subjectStartLeaf, subjectStopLeaf
+									                            , curScore, depth
+									                            } );
 							}
 					});
 			});
 	}
 
+	// Times the tasks of a sample of the node pairs at depth 2, spread over the whole
+	// traversal, under every candidate cutover and returns the fastest.  The sample grows
+	// until the traversal without cutover takes long enough to be timed.
+	template< size_t FragSize, typename Writer, typename Query, typename Subject >
+	size_t CalibrateCutover( Query const & query, Subject const & subject ) {
+			static size_t const candidates[] = { 0, 16, 64, 256, 1024, 4096 };
+			static double const minSampleSeconds = 0.05;
+			static size_t const nbRuns = 2;
+
+			vector< MappingTask > tasks, sample;
+			SplitTasks( tasks, query, 0, subject, 0, { 0, 0 }, 1, 2 );
+			auto Time = [&]( size_t pairs ) {
+					cutoverPairs = pairs;
+					double best = 0;
+					for ( size_t run = 0; run != nbRuns; ++run ) {
+							TopHits       hits( topK != 0 ? topKQueries : 0, topK );
+							MappingWorker worker( &hits );
+							OutputBuffer  out;
+							auto startTimer = chrono::high_resolution_clock::now();
+							{
+									Writer writer( out );
+									for ( auto const & task : sample ) {
+											MapChildren< FragSize >( writer, worker
+											           , query  , task.queryChar  , task.queryChildIndex  , task.queryStartLeaf  , task.queryStopLeaf
+											           , subject, task.subjectChar, task.subjectChildIndex, task.subjectStartLeaf, task.subjectStopLeaf
+											           , task.curScore, task.depth
+											           );
+									}
+									writer.Finish();
+							}
+							double elapsed = chrono::duration< double >( chrono::high_resolution_clock::now() - startTimer ).count();
+							best = run == 0 ? elapsed : min( best, elapsed );
+					}
+					return best;
+			};
+
+			double baseline = 0;
+			for ( size_t step = tasks.size(); step > 1 && baseline < minSampleSeconds; ) {
+					step = max< size_t >( step / 8, 1 );
+					sample.clear();
+					for ( size_t t = 0; t < tasks.size(); t += step ) {
+							sample.push_back( tasks[t] );
+					}
+					baseline = Time( 0 );
+			}
+			size_t bestPairs = 0;
+			double bestTime  = baseline;
+			for ( size_t pairs : candidates ) {
+					double t = pairs == 0 ? baseline : Time( pairs );
+					if ( t < bestTime ) {
+							bestPairs = pairs;
+							bestTime  = t;
+					}
+			}
+			return bestPairs;
+	}
+
+}
+
+// Profiles mode: the profiles of the workers are merged into profiles, those of the query
+// tree then of its samples
+// Top-k mode: the workers score their hits into topHits
+template< typename Writer, size_t FragSize, typename Query, typename Subject >
+MappingStats MapTreesOfSize( FILE * file, Query const & query, Subject const & subject, size_t nbThreads
+                           , vector< ProfileAccumulator > * profiles, TopHits * topHits
+                           ) {
+		if ( calibrateCutover ) {
+				cutoverPairs = CalibrateCutover< FragSize, Writer >( query, subject );
+				printf( "Cutover calibrated to %zu leaf pairs\n", cutoverPairs );
+		}
+
+		if ( nbThreads <= 1 ) {
+				MappingWorker worker( topHits );
+				OutputBuffer out( file );
+				{
+						Writer writer( out );
+						MapTrees< FragSize >( writer, worker, query, 0, subject, 0, { 0, 0 }, 1 );
+						writer.Finish();
+				}
+				out.Flush();
+				for ( size_t i = 0; profiles && i != profiles->size(); ++i ) {
+						(*profiles)[i].Merge( worker.profiles[i] );
+				}
+				return worker.stats;
+		}
+
+		// Split the first levels of the traversal into enough tasks to keep every worker busy
+		static size_t const tasksPerThread = 16;
+		vector< MappingTask > tasks;
+		for ( size_t splitDepth = 1; splitDepth <= 2; ++splitDepth ) {
+				tasks.clear();
+				SplitTasks( tasks, query, 0, subject, 0, { 0, 0 }, 1, splitDepth );
+				if ( tasks.size() >= tasksPerThread * nbThreads ) {
+						break;
+				}
+		}
+
+		// Task outputs are written back in task order as soon as all their predecessors are,
+		// which reproduces the output of the serial traversal
+		WorkStealingPool pool( nbThreads );
+		vector< MappingWorker > workers( pool.NumThreads(), MappingWorker( topHits ) );
+		vector< OutputBuffer > outputs( tasks.size() );
+		vector< char >         done( tasks.size(), 0 );
+		size_t                 nextToWrite = 0;
+		mutex                  writeMutex;
+
+		pool.Run( tasks.size(), [&]( size_t worker, size_t t ) {
+				auto const & task = tasks[t];
+				{
+						Writer writer( outputs[t] );
+						MapChildren< FragSize >( writer, workers[worker]
+						           , query  , task.queryChar  , task.queryChildIndex  , task.queryStartLeaf  , task.queryStopLeaf
+						           , subject, task.subjectChar, task.subjectChildIndex, task.subjectStartLeaf, task.subjectStopLeaf
+						           , task.curScore, task.depth
+						           );
+						writer.Finish();
+				}
+
+				lock_guard< mutex > lock( writeMutex );
+				done[t] = 1;
+				while ( nextToWrite != tasks.size() && done[nextToWrite] ) {
+						outputs[nextToWrite].CopyTo( file );
+						++nextToWrite;
+				}
+		});
+
+		MappingStats stats;
+		for_each( workers, [&]( MappingWorker const & w ) {
+				stats.Merge( w.stats );
+				for ( size_t i = 0; profiles && i != profiles->size(); ++i ) {
+						(*profiles)[i].Merge( w.profiles[i] );
+				}
+		});
+		return stats;
+}
+
+// The traversal is instantiated for the common fragment sizes so that its bounds are constants
+template< typename Writer, typename Query, typename Subject >
+MappingStats MapTrees( FILE * file, Query const & query, Subject const & subject, size_t nbThreads
+                     , vector< ProfileAccumulator > * profiles = nullptr, TopHits * topHits = nullptr
+                     ) {
+		switch ( fragSize ) {
+				case 7:  return MapTreesOfSize< Writer, 7  >( file, query, subject, nbThreads, profiles, topHits );
+				case 12: return MapTreesOfSize< Writer, 12 >( file, query, subject, nbThreads, profiles, topHits );
+				default: return MapTreesOfSize< Writer, 0  >( file, query, subject, nbThreads, profiles, topHits );
+		}
+}
+
+// Top-k mode: the hits are written query leaf by query leaf once the traversal is over
+template< typename Writer, typename Query, typename Subject >
+MappingStats MapTopHits( FILE * file, Query const & query, Subject const & subject, size_t nbThreads ) {
+		TopHits hits( topKQueries, topK );
+		auto stats = MapTrees< TopHitsWriter >( file, query, subject, nbThreads, nullptr, &hits );
+		OutputBuffer out( file );
+		{
+				Writer writer( out );
+				stats.nbStringSimilarity = hits.Write( writer );
+				writer.Finish();
+		}
+		out.Flush();
+		return stats;
+}
+
+// Named after the integer part and the first two decimals of the cutoff, preceded by the
+// matrix when it is not the default PAM30 (query.mapping.blosum62.0_25)
+string MappingFilename( char const * queryFilename, double cutoff ) {
+		ostringstream s;
+		s << queryFilename << ".mapping.";
+		if ( !homologyMatrixTag.empty() ) {
+				s << homologyMatrixTag << '.';
+		}
+		s << (int)cutoff << '_' << (int)floor( 100*(cutoff - (int)cutoff) );
+		return s.str();
 }
 
-void MapTrees( FILE * file, MMappedPepTree const & query, MMappedPepTree const & subject ) {
+// Mapping file of a sample of a multi-sample query tree, as named for the PepTree of the
+// sample alone
+string SampleMappingFilename( size_t sample ) {
+		ostringstream s;
+		s << querySamples->GetName( sample ) << ".pepTree." << fragSize;
+		return MappingFilename( s.str().c_str(), cutoffHomology );
+}
+
+enum class OutputFormat { Binary, Text, Blocks, Profiles };
+
+// The subject side tables are read from residentCodes and residentBounds (the bounds of
+// the layout of subject by built-in matrix) when given, built otherwise
+template< typename Query, typename Subject >
+MappingStats MapTrees( FILE * file, Query const & query, Subject const & subject
+                     , size_t nbThreads, OutputFormat format
+                     , vector< uint8_t > const * residentCodes = nullptr, map< Matrix::Id, SubtreeBounds > const * residentBounds = nullptr
+                     ) {
 		fragSize = query.Depth();
 		size_t d = subject.Depth();
 		if ( d != fragSize ) {
@@ -163,25 +1184,251 @@ void MapTrees( FILE * file, MMappedPepTree const & query, MMappedPepTree const &
 				s << "Unable to map query over subject, different fragments sizes (" << d << " vs. " << fragSize << ')';
 				throw std::runtime_error{ s.str() };
 		}
+		InitDepthBounds();
+		if ( tightBounds ) {
+				if ( !IsDiagonallyDominant( homologyMatrix ) ) {
+						throw std::runtime_error{ "Subtree bounds require a diagonally dominant matrix, abording" };
+				}
+				InitSubtreeBounds( queryBounds, query );
+				auto resident = residentBounds ? residentBounds->find( homologyMatrixId ) : map< Matrix::Id, SubtreeBounds >::const_iterator{};
+				if ( residentBounds && resident != residentBounds->end() ) {
+						subjectBounds = &resident->second;
+				} else {
+						InitSubtreeBounds( loadedSubjectBounds, subject );
+						subjectBounds = &loadedSubjectBounds;
+				}
+		}
+		if ( cutoverPairs != 0 || calibrateCutover ) {
+				InitLeafCodes( queryCodes, query );
+				if ( residentCodes ) {
+						subjectCodes = residentCodes->data();
+				} else {
+						InitLeafCodes( loadedSubjectCodes, subject );
+						subjectCodes = loadedSubjectCodes.data();
+				}
+		}
+		if ( topK != 0 ) {
+				topKQueries = query.GetNumberLeaves();
+		}
 
-#if defined( PROFILE_PERF )
-		refuseStats.resize( fragSize );
-		acceptStats.resize( fragSize );
-#endif
+		if ( format == OutputFormat::Text ) {
+				if ( topK != 0 ) {
+						return MapTopHits< Mapping::TextWriter >( file, query, subject, nbThreads );
+				}
+				return MapTrees< Mapping::TextWriter >( file, query, subject, nbThreads );
+		}
+		if ( format == OutputFormat::Profiles ) {
+				vector< ProfileAccumulator > profiles( querySamples ? 1 + querySamples->NbSamples() : 1, ProfileAccumulator( fragSize, queryAbundances != nullptr ) );
+				auto stats = MapTrees< ProfileWriter >( file, query, subject, nbThreads, &profiles );
+				profiles[0].Write( file, *subjectFastIdx );
+				for ( size_t s = 0; querySamples && s != querySamples->NbSamples(); ++s ) {
+						auto filename = SampleMappingFilename( s ) + ".profiles";
+						FILE * sampleFile = fopen( filename.c_str(), "wb" );
+						if ( !sampleFile ) {
+								throw std::runtime_error{ "Unable to open output file \"" + filename + '"' };
+						}
+						profiles[1+s].Write( sampleFile, *subjectFastIdx );
+						fclose( sampleFile );
+				}
+				return stats;
+		}
+
+		Mapping::Header header;
+		header.version  = Mapping::currentVersion;
+		header.flags    = format == OutputFormat::Blocks ? Mapping::Blocks : 0;
+		header.depth    = static_cast< uint32_t >( fragSize );
+		header.matrixId = static_cast< uint32_t >( homologyMatrixId );
+		header.cutoff   = cutoffHomology;
+		for ( size_t i = 0; i != 24; ++i ) {
+				for ( size_t j = 0; j != 24; ++j ) {
+						header.matrix[i][j] = homologyMatrix[i][j];
+				}
+		}
+		Mapping::WriteHeader( file, header );
+		if ( format == OutputFormat::Blocks ) {
+				return MapTrees< Mapping::BlockWriter >( file, query, subject, nbThreads );
+		}
+		if ( topK != 0 ) {
+				return MapTopHits< Mapping::BinaryWriter >( file, query, subject, nbThreads );
+		}
+		return MapTrees< Mapping::BinaryWriter >( file, query, subject, nbThreads );
+}
+
+// Removes the temporary mapping file of a sweep or of samples once split, or when the
+// mapping fails, whichever way the job leaves
+class TemporaryFile {
+	public:
+		explicit TemporaryFile( string filename_ = string{} )
+			: filename( std::move( filename_ ) ) {   }
+
+		~TemporaryFile() {
+				if ( !filename.empty() ) {
+						remove( filename.c_str() );
+				}
+		}
+
+		TemporaryFile( TemporaryFile const & ) = delete;
+		TemporaryFile & operator=( TemporaryFile const & ) = delete;
+
+	private:
+		string filename;
+};
+
+// A cutoff of a threshold sweep, with the file of its mappings
+struct SweepCutoff {
+		double  homology;
+		int64_t num, den;   // homology as an exact decimal fraction
+		string  filename;
+
+		// Cross products in 128 bits: 9 digits numerators and denominators up to 10^9 would
+		// already fit, but the order must not depend on the cap of ParseCutoff
+		bool operator<( SweepCutoff const & o ) const {
+				return static_cast< __int128 >( num ) * o.den < static_cast< __int128 >( o.num ) * den;
+		}
+		bool operator==( SweepCutoff const & o ) const {
+				return static_cast< __int128 >( num ) * o.den == static_cast< __int128 >( o.num ) * den;
+		}
+};
+
+// Output files of a split of a mapping file, with their buffers and writers
+template< typename Writer >
+struct SplitOutputs {
+		vector< FILE * >                     files;
+		vector< unique_ptr< OutputBuffer > > outs;
+		vector< unique_ptr< Writer > >       writers;
+
+		// Binary files start with header, text ones if it is null
+		void Open( string const & filename, Mapping::Header const * header ) {
+				files.push_back( fopen( filename.c_str(), "wb" ) );
+				if ( !files.back() ) {
+						throw std::runtime_error{ "Unable to open output file \"" + filename + '"' };
+				}
+				if ( header ) {
+						Mapping::WriteHeader( files.back(), *header );
+				}
+				outs   .emplace_back( new OutputBuffer( files.back() ) );
+				writers.emplace_back( new Writer( *outs.back() ) );
+		}
 
-		MapTrees( file, query, 0, subject, 0, { 0.0, 0.0 }, 1 );
+		void Close() {
+				for ( size_t i = 0; i != files.size(); ++i ) {
+						writers[i]->Finish();
+						outs[i]->Flush();
+						fclose( files[i] );
+				}
+		}
+};
+
+// Threshold sweep: the trees are mapped once with the loosest cutoff into a binary file,
+// split here into the files of the cutoffs from first on, every pair being tagged with
+// the strictest cutoff it reaches and written, in order, to the files of that one and of
+// the looser ones.  Returns the number of mappings of every cutoff.
+template< typename Writer >
+vector< size_t > SplitSweep( char const * filename, vector< SweepCutoff > const & cutoffs, size_t first, bool withHeaders ) {
+		Mapping::Reader reader( filename );
+		SplitOutputs< Writer > outputs;
+		for ( size_t i = first; i != cutoffs.size(); ++i ) {
+				auto header = reader.GetHeader();
+				header.cutoff = cutoffs[i].homology;
+				outputs.Open( cutoffs[i].filename, withHeaders ? &header : nullptr );
+		}
+
+		vector< size_t > counts( cutoffs.size(), 0 );
+		reader.ForEachRawMapping( [&]( uint64_t query, uint64_t subject, int32_t scoreNum, int32_t scoreDen ) {
+				size_t strictest = 0;
+				while ( strictest + 1 != cutoffs.size()
+				     && RatioReaches( scoreNum, scoreDen, cutoffs[strictest+1].num, cutoffs[strictest+1].den )
+				      ) {
+						++strictest;
+				}
+				for ( size_t i = 0; i <= strictest; ++i ) {
+						++counts[i];
+						if ( i >= first ) {
+								outputs.writers[i - first]->Add( query, subject, scoreNum, scoreDen );
+						}
+				}
+		});
+		outputs.Close();
+		return counts;
+}
+
+// Every mapping goes to the samples of its query leaf
+template< typename Writer >
+void SplitSampleRecords( Mapping::Reader & reader, SplitOutputs< Writer > & outputs, vector< size_t > & counts ) {
+		reader.ForEachRawMapping( [&]( uint64_t query, uint64_t subject, int32_t scoreNum, int32_t scoreDen ) {
+				for ( auto mask = querySamples->Mask( query ); mask != 0; mask &= mask - 1 ) {
+						size_t s = static_cast< size_t >( __builtin_ctzll( mask ) );
+						outputs.writers[s]->Add( querySamples->Rank( s, query ), subject, scoreNum, scoreDen );
+						++counts[s];
+				}
+		});
+}
+
+// Every block goes to the samples having leaves in its query range
+void SplitSampleRecords( Mapping::Reader & reader, SplitOutputs< Mapping::BlockWriter > & outputs, vector< size_t > & counts ) {
+		reader.ForEachBlock( [&]( uint64_t queryStart, uint64_t queryStop, uint64_t subjectStart, uint64_t subjectStop, uint32_t depth ) {
+				for ( size_t s = 0; s != querySamples->NbSamples(); ++s ) {
+						auto start = querySamples->Rank( s, queryStart ), stop = querySamples->Rank( s, queryStop );
+						if ( start != stop ) {
+								outputs.writers[s]->AddBlock( start, stop, subjectStart, subjectStop, depth );
+								counts[s] += (stop - start) * (subjectStop - subjectStart);
+						}
+				}
+		});
+}
+
+// Multi-sample query tree: the trees are mapped once into the binary (or blocks) mapping
+// file of the query tree, split here into the files of its samples, named as those of
+// their own PepTrees.  Query leaves are numbered as in the tree of each sample, whose
+// leaves are the ones of the sample in the same order, so that mappings keep their order
+// and blocks their query ranges, shrunk to the leaves of the sample.  Returns the number
+// of mappings of every sample.
+template< typename Writer >
+vector< size_t > SplitSamples( char const * filename, bool withHeaders ) {
+		Mapping::Reader reader( filename );
+		SplitOutputs< Writer > outputs;
+		for ( size_t s = 0; s != querySamples->NbSamples(); ++s ) {
+				outputs.Open( SampleMappingFilename( s ), withHeaders ? &reader.GetHeader() : nullptr );
+		}
+		vector< size_t > counts( querySamples->NbSamples(), 0 );
+		SplitSampleRecords( reader, outputs, counts );
+		outputs.Close();
+		return counts;
 }
 
 void UsageError( char * argv[] ) {
-		fprintf( stderr, "Usage: %s pepTree-query-file pepTree-subject-file cutoff-homology\n", argv[0] );
+		fprintf( stderr
+		       , "Usage: %s [options] pepTree-query-file pepTree-subject-file cutoff-homology[,cutoff-homology...]\n"
+		         "          several comma separated cutoffs are swept in a single traversal with the loosest one, the\n"
+		         "          mappings of every cutoff being written to its own file (not with --blocks or --profiles)\n"
+		         "   where options are:\n"
+		         "     -j threads       -> number of mapping threads (default: 1)\n"
+		         "     --text           -> write the mappings in the legacy text format\n"
+		         "     --blocks         -> write accepted leaf ranges instead of every leaf pair\n"
+		         "     --tight-bounds   -> prune with per-subtree score bounds (same mappings, fewer visits)\n"
+		         "     --cutover n|auto -> score all the leaf pairs below node pairs of at most n of them (default: %zu, 0 never),\n"
+		         "                         or the fastest on a sample of the traversal with auto (same mappings)\n"
+		         "     --bitmap-nodes   -> traverse the trees through a child bitmap node layout built at load (same mappings)\n"
+		         "     --suffix-subject subject-fastIdx-file -> the subject is the SuffixIdx of subject-fastIdx-file, read as its\n"
+		         "                    PepTree of the query depth (same mappings)\n"
+		         "     --matrix m       -> substitution matrix, PAM30 (default), BLOSUM62 or a matrix file in the NCBI format\n"
+		         "     --profiles subject-fastIdx-file -> write the subject proteins profiles instead of the mappings\n"
+		         "     --abundances     -> weight the profiles by the abundances of the query leaves, read from the query tree\n"
+		         "                         name plus .abundances (PepTree --abundances; with --profiles, not with --samples)\n"
+		         "     --top-k n        -> only write the n best subject leaves of every query leaf, best first (not with\n"
+		         "                         --blocks or --profiles)\n"
+		         "     --samples        -> the query is a multi-sample tree (PepTree -s), the mappings or profiles of every sample\n"
+		         "                         are also written to the files of its own tree (not with several cutoffs)\n"
+		       , argv[0], defaultCutoverPairs
+		       );
 		exit( 1 );
 }
 
 #if defined( PROFILE_PERF )
-void PrintExecutionStats( FILE * file ) {
+void PrintExecutionStats( FILE * file, MappingStats const & stats ) {
 		fprintf( file, "Refuses:\n" );
 		size_t height = 0;
-		for_each( refuseStats, [&]( tuple< size_t, size_t, size_t > const & v ) {
+		for_each( stats.refuseStats, [&]( tuple< size_t, size_t, size_t > const & v ) {
 				size_t size = get< 0 >( v );
 				size_t totalQueryCut   = get< 1 >( v );
 				size_t totalSubjectCut = get< 2 >( v );
@@ -192,7 +1439,7 @@ void PrintExecutionStats( FILE * file ) {
 		});
 		fprintf( file, "Accepts:\n" );
 		height = 0;
-		for_each( acceptStats, [&]( tuple< size_t, size_t, size_t > const & v ) {
+		for_each( stats.acceptStats, [&]( tuple< size_t, size_t, size_t > const & v ) {
 				size_t size = get< 0 >( v );
 				size_t totalQueryCut   = get< 1 >( v );
 				size_t totalSubjectCut = get< 2 >( v );
@@ -201,46 +1448,288 @@ void PrintExecutionStats( FILE * file ) {
 				       );
 				++height;
 		});
+		fprintf( file, "Cutovers:\n" );
+		height = 0;
+		for_each( stats.cutoverStats, [&]( tuple< size_t, size_t, size_t > const & v ) {
+				fprintf( file, "%zu: %10zu | %10zu -> %10zu\n"
+				       , height, get< 0 >( v ), get< 1 >( v ), get< 2 >( v )
+				       );
+				++height;
+		});
 }
 #endif
 
-int main( int argc, char * argv[] ) {
-		if ( argc != 4 ) {
+string CanonicalPath( char const * filename ) {
+		char * path = realpath( filename, nullptr );
+		if ( !path ) {
+				return filename;
+		}
+		string canonical( path );
+		free( path );
+		return canonical;
+}
+
+void ResidentSubjects::Prepare( bool bitmapNodes, bool tightBounds ) {
+		for ( auto & pathTree : trees ) {
+				auto & t = pathTree.second;
+				fragSize = t.tree->Depth();
+				InitLeafCodes( t.leafCodes, *t.tree );
+				if ( bitmapNodes ) {
+						t.bitmap.reset( new BitmapPepTree( *t.tree ) );
+				}
+				for ( auto id : { Matrix::Id::Pam30, Matrix::Id::Blosum62 } ) {
+						if ( !tightBounds ) {
+								break;
+						}
+						InitHomology( Matrix::Name( id ) );
+						InitSubtreeBounds( t.bounds[id], *t.tree );
+						if ( t.bitmap ) {
+								InitSubtreeBounds( t.bitmapBounds[id], *t.bitmap );
+						}
+				}
+		}
+}
+
+ResidentTree const * ResidentSubjects::FindTree( char const * filename ) const {
+		auto it = trees.find( CanonicalPath( filename ) );
+		return it != trees.end() ? &it->second : nullptr;
+}
+
+MMappedFastIdx const * ResidentSubjects::FindFastIdx( char const * filename ) const {
+		auto it = fastIdxs.find( CanonicalPath( filename ) );
+		return it != fastIdxs.end() ? it->second.get() : nullptr;
+}
+
+int PepteamMap( int argc, char * argv[], ResidentSubjects const * resident ) {
+		size_t nbThreads = 1;
+		bool bitmapNodes = false;
+		char const * suffixSubjectFastIdxFilename = nullptr;
+		auto format = OutputFormat::Binary;
+		char const * matrixName = "pam30";
+		char const * subjectFastIdxFilename = nullptr;
+		bool samples = false;
+		bool abundances = false;
+		int argi = 1;
+		for ( ; argi < argc && argv[argi][0] == '-'; ++argi ) {
+				if ( strcmp( argv[argi], "-j" ) == 0 && argi+1 < argc && atoi( argv[argi+1] ) > 0 ) {
+						nbThreads = static_cast< size_t >( atoi( argv[++argi] ) );
+				} else if ( strcmp( argv[argi], "--text" ) == 0 && format == OutputFormat::Binary ) {
+						format = OutputFormat::Text;
+				} else if ( strcmp( argv[argi], "--blocks" ) == 0 && format == OutputFormat::Binary ) {
+						format = OutputFormat::Blocks;
+				} else if ( strcmp( argv[argi], "--tight-bounds" ) == 0 ) {
+						tightBounds = true;
+				} else if ( strcmp( argv[argi], "--cutover" ) == 0 && argi+1 < argc && strcmp( argv[argi+1], "auto" ) == 0 ) {
+						calibrateCutover = true;
+						++argi;
+				} else if ( strcmp( argv[argi], "--cutover" ) == 0 && argi+1 < argc && isdigit( argv[argi+1][0] ) ) {
+						cutoverPairs = static_cast< size_t >( atol( argv[++argi] ) );
+				} else if ( strcmp( argv[argi], "--bitmap-nodes" ) == 0 ) {
+						bitmapNodes = true;
+				} else if ( strcmp( argv[argi], "--suffix-subject" ) == 0 && argi+1 < argc ) {
+						suffixSubjectFastIdxFilename = argv[++argi];
+				} else if ( strcmp( argv[argi], "--top-k" ) == 0 && argi+1 < argc && atoi( argv[argi+1] ) > 0 ) {
+						topK = static_cast< size_t >( atoi( argv[++argi] ) );
+				} else if ( strcmp( argv[argi], "--samples" ) == 0 ) {
+						samples = true;
+				} else if ( strcmp( argv[argi], "--abundances" ) == 0 ) {
+						abundances = true;
+				} else if ( strcmp( argv[argi], "--matrix" ) == 0 && argi+1 < argc ) {
+						matrixName = argv[++argi];
+				} else if ( strcmp( argv[argi], "--profiles" ) == 0 && argi+1 < argc && format == OutputFormat::Binary ) {
+						format = OutputFormat::Profiles;
+						subjectFastIdxFilename = argv[++argi];
+				} else {
+						UsageError( argv );
+				}
+		}
+		if ( argc - argi != 3 ) {
+				UsageError( argv );
+		}
+		char const * queryFilename   = argv[argi];
+		char const * subjectFilename = argv[argi+1];
+
+		try {   // names the mapping files
+				InitHomology( matrixName );
+		} catch( std::exception & e ) {
+				fprintf( stderr, "%s\n", e.what() );
+				return 1;
+		}
+		printf( "Matrix: %s\n", homologyMatrixId == Matrix::Id::File ? matrixName : Matrix::Name( homologyMatrixId ) );
+		printf( "MaxHomology: %d, MinHomology: %d\n", maxHomology, minHomology );
+
+		vector< SweepCutoff > cutoffs;
+		{
+				istringstream list( argv[argi+2] );
+				string cutoff;
+				while ( getline( list, cutoff, ',' ) ) {
+						if ( !ParseCutoff( cutoff.c_str() ) ) {
+								fprintf( stderr, "Invalid cutoff \"%s\", a decimal number of at most 9 significant digits and 9 decimals is expected\n", cutoff.c_str() );
+								UsageError( argv );
+						}
+						cutoffs.push_back( { cutoffHomology, cutoffNum, cutoffDen, MappingFilename( queryFilename, cutoffHomology ) } );
+				}
+		}
+		sort( cutoffs.begin(), cutoffs.end() );
+		cutoffs.erase( unique( cutoffs.begin(), cutoffs.end() ), cutoffs.end() );
+		bool sweep = cutoffs.size() > 1;
+		if ( cutoffs.empty() || (sweep && (samples || format == OutputFormat::Blocks || format == OutputFormat::Profiles))
+		  || (topK != 0 && (format == OutputFormat::Blocks || format == OutputFormat::Profiles))
+		  || (abundances && (samples || format != OutputFormat::Profiles))
+		   ) {
 				UsageError( argv );
 		}
+		for ( size_t i = 1; i < cutoffs.size(); ++i ) {
+				if ( cutoffs[i].filename == cutoffs[i-1].filename ) {
+						fprintf( stderr, "Cutoffs %g and %g would be written to the same file \"%s\"\n"
+						       , cutoffs[i-1].homology, cutoffs[i].homology, cutoffs[i].filename.c_str()
+						       );
+						UsageError( argv );
+				}
+		}
+		cutoffHomology = cutoffs[0].homology;   // the traversal prunes with the loosest cutoff
+		cutoffNum      = cutoffs[0].num;
+		cutoffDen      = cutoffs[0].den;
 
-		cutoffHomology = atof( argv[3] );
+		printf( "Similarity threshold%s:", sweep ? "s" : "" );
+		for ( auto const & cutoff : cutoffs ) {
+				printf( " %f", cutoff.homology );
+		}
+		printf( "\n" );
 
-		printf( "Similarity threshold: %f\n", cutoffHomology );
+		printf( "Similarity kernel: %s\n", batchSimilarity->KernelName() );
 
+		// A text sweep, or the text mappings of a multi-sample tree, are mapped into a
+		// temporary binary file, split into the text files once done
+		auto mapFormat = (sweep || samples) && format == OutputFormat::Text ? OutputFormat::Binary : format;
 		ostringstream outputFilenameStream;
-		outputFilenameStream << argv[1] << ".mapping."
-		                     << (int)cutoffHomology << '_' << (int)floor( 100*(cutoffHomology - (int)cutoffHomology) );
-		FILE * outputFile = fopen( outputFilenameStream.str().c_str(), "w" );
+		outputFilenameStream << cutoffs[0].filename;
+		if ( format == OutputFormat::Profiles ) {   // named as PepteamProfile would from the mapping file
+				outputFilenameStream << ".profiles";
+		} else if ( mapFormat != format ) {
+				outputFilenameStream << (sweep ? ".sweep" : ".samples");
+		}
+		FILE * outputFile = fopen( outputFilenameStream.str().c_str(), "wb" );
 		if ( !outputFile ) {
 				fprintf( stderr, "Unable to open output file \"%s\"\n", outputFilenameStream.str().c_str() );
 				UsageError( argv );   // exit here to avoid creation of the other files if input file is invalid
 		}
+		TemporaryFile temporaryMapping( mapFormat != format ? outputFilenameStream.str() : string{} );
 
-		MMappedPepTree query( argv[1] );
-		MMappedPepTree subject( argv[2] );
+		MMappedPepTree query( queryFilename );
+		MMappedPepTree const *         subjectTree = nullptr;
+		ResidentTree const *           residentSubject = nullptr;
+		unique_ptr< MMappedPepTree >   loadedSubjectTree;
+		unique_ptr< MMappedSuffixIdx > subjectSuffixes;
+		unique_ptr< MMappedFastIdx >   subjectSuffixesIdx;
+		if ( suffixSubjectFastIdxFilename ) {
+				subjectSuffixes   .reset( new MMappedSuffixIdx( subjectFilename ) );
+				subjectSuffixesIdx.reset( new MMappedFastIdx( suffixSubjectFastIdxFilename ) );
+		} else if ( resident && (residentSubject = resident->FindTree( subjectFilename )) ) {
+				subjectTree = residentSubject->tree.get();
+		} else {
+				loadedSubjectTree.reset( new MMappedPepTree( subjectFilename ) );
+				subjectTree = loadedSubjectTree.get();
+		}
+		unique_ptr< MMappedFastIdx > subjectIdx;
+		if ( subjectFastIdxFilename ) {
+				if ( !resident || !(subjectFastIdx = resident->FindFastIdx( subjectFastIdxFilename )) ) {
+						subjectIdx.reset( new MMappedFastIdx( subjectFastIdxFilename ) );
+						subjectFastIdx = subjectIdx.get();
+				}
+		}
+		unique_ptr< LeafSamples > queryLeafSamples;
+		if ( samples ) {
+				try {
+						queryLeafSamples.reset( new LeafSamples( (string{ queryFilename } + ".samples").c_str() ) );
+				} catch( std::exception & e ) {
+						fprintf( stderr, "%s\n", e.what() );
+						return 1;
+				}
+				if ( queryLeafSamples->GetNumberLeaves() != query.GetNumberLeaves() ) {
+						fprintf( stderr, "Samples of another tree than \"%s\"\n", queryFilename );
+						return 1;
+				}
+				querySamples = queryLeafSamples.get();
+		}
+		unique_ptr< LeafAbundances > queryLeafAbundances;
+		if ( abundances ) {
+				try {
+						queryLeafAbundances.reset( new LeafAbundances( (string{ queryFilename } + ".abundances").c_str() ) );
+				} catch( std::exception & e ) {
+						fprintf( stderr, "%s\n", e.what() );
+						return 1;
+				}
+				if ( queryLeafAbundances->GetNumberLeaves() != query.GetNumberLeaves() ) {
+						fprintf( stderr, "Abundances of another tree than \"%s\"\n", queryFilename );
+						return 1;
+				}
+				queryAbundances = queryLeafAbundances.get();
+		}
 
-		InitHomology();
 
 		try {
 				printf( "Intersecting peptides and proteins fragments sets...\n" );
 				auto startTimer = chrono::high_resolution_clock::now();
 
-				MapTrees( outputFile, query, subject );
+				MappingStats stats;
+				if ( subjectSuffixes ) {   // the subject tree of the query depth is read from the suffix index
+						SuffixPepTree subject( *subjectSuffixes, *subjectSuffixesIdx, query.Depth() );
+						if ( bitmapNodes ) {
+								BitmapPepTree bitmapQuery( query );
+								stats = MapTrees( outputFile, bitmapQuery, subject, nbThreads, mapFormat );
+						} else {
+								stats = MapTrees( outputFile, query, subject, nbThreads, mapFormat );
+						}
+				} else if ( bitmapNodes && residentSubject && residentSubject->bitmap ) {
+						BitmapPepTree bitmapQuery( query );
+						stats = MapTrees( outputFile, bitmapQuery, *residentSubject->bitmap, nbThreads, mapFormat
+						                , &residentSubject->leafCodes, &residentSubject->bitmapBounds
+						                );
+				} else if ( bitmapNodes ) {
+						BitmapPepTree bitmapQuery( query ), bitmapSubject( *subjectTree );
+						stats = MapTrees( outputFile, bitmapQuery, bitmapSubject, nbThreads, mapFormat
+						                , residentSubject ? &residentSubject->leafCodes : nullptr
+						                );
+				} else if ( residentSubject ) {
+						stats = MapTrees( outputFile, query, *subjectTree, nbThreads, mapFormat
+						                , &residentSubject->leafCodes, &residentSubject->bounds
+						                );
+				} else {
+						stats = MapTrees( outputFile, query, *subjectTree, nbThreads, mapFormat );
+				}
 				fclose( outputFile );
 
+				vector< size_t > counts, sampleCounts;
+				auto mappingFilename = outputFilenameStream.str();
+				if ( samples && format == OutputFormat::Text ) {
+						sampleCounts = SplitSamples< Mapping::TextWriter >( mappingFilename.c_str(), false );
+				} else if ( samples && format == OutputFormat::Blocks ) {
+						sampleCounts = SplitSamples< Mapping::BlockWriter >( mappingFilename.c_str(), true );
+				} else if ( samples && format == OutputFormat::Binary ) {
+						sampleCounts = SplitSamples< Mapping::BinaryWriter >( mappingFilename.c_str(), true );
+				}
+				if ( mapFormat != format ) {
+						counts = SplitSweep< Mapping::TextWriter >( mappingFilename.c_str(), cutoffs, 0, false );
+				} else if ( sweep ) {
+						counts = SplitSweep< Mapping::BinaryWriter >( mappingFilename.c_str(), cutoffs, 1, true );
+				}
+
 				auto finishTimer = chrono::high_resolution_clock::now();
 				auto elapsed2 = finishTimer - startTimer;
 				printf( "   ...%zu mappings found in %ld seconds.\n"
-				      , nbStringSimilarity, chrono::duration_cast< chrono::seconds >( elapsed2 ).count()
+				      , stats.nbStringSimilarity, chrono::duration_cast< chrono::seconds >( elapsed2 ).count()
 				      );
+				for ( size_t i = 0; sweep && i != counts.size(); ++i ) {
+						printf( "   ...%zu of them reach %f (\"%s\").\n", counts[i], cutoffs[i].homology, cutoffs[i].filename.c_str() );
+				}
+				for ( size_t s = 0; s != sampleCounts.size(); ++s ) {
+						printf( "   ...%zu of them for sample \"%s\" (\"%s\").\n"
+						      , sampleCounts[s], querySamples->GetName( s ), SampleMappingFilename( s ).c_str()
+						      );
+				}
 #if defined( PROFILE_PERF )
-				PrintExecutionStats( stdout );
+				PrintExecutionStats( stdout, stats );
 #endif
 		} catch( std::exception & e ) {
 				fprintf( stderr, "%s\n", e.what() );
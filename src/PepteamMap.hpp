@@ -0,0 +1,57 @@
+#ifndef PEPTEAMMAP_HPP
+#define PEPTEAMMAP_HPP
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "Matrices.hpp"
+#include "FastIdx.hpp"
+#include "PepTree.hpp"
+
+// Self-scores still to come below each node of a tree, over all its leaves.  A (query,
+// subject) pair reached with a score Num/Den ends up at (Num + n) / (Den + d), where d
+// is the sum of these self-scores and n <= d as long as the matrix is diagonally
+// dominant (2*M[a][b] <= M[a][a] + M[b][b]).  (Num + x) / (Den + x) growing with x when
+// Num <= Den, (Num + maxRest) / (Den + maxRest) is an upper bound of every final score of
+// the subtrees pair provided Den + minRest stays positive.  This is always at least as
+// tight as the depth based bound which assumes maxHomology for every remaining residue.
+struct SubtreeBounds {
+		std::vector< int16_t > maxRest;   // indexed by children list
+		std::vector< int16_t > minRest;
+};
+
+// A subject tree kept loaded by Pepteamd, with the subject side tables of the traversal
+// built once before its jobs are forked, which share them instead of rebuilding them
+struct ResidentTree {
+		std::unique_ptr< MMappedPepTree >     tree;
+		std::vector< uint8_t >                leafCodes;      // cutover codes, none for packed leaves
+		std::map< Matrix::Id, SubtreeBounds > bounds;         // --tight-bounds ones, by built-in matrix
+		std::unique_ptr< BitmapPepTree >      bitmap;         // --bitmap-nodes layout
+		std::map< Matrix::Id, SubtreeBounds > bitmapBounds;   // --tight-bounds ones of the bitmap layout
+};
+
+// Subject files kept loaded by Pepteamd across its jobs, by their canonical path
+struct ResidentSubjects {
+		std::map< std::string, ResidentTree >                      trees;
+		std::map< std::string, std::unique_ptr< MMappedFastIdx > > fastIdxs;
+
+		// Builds the tables of every tree, the bitmap layouts and the subtree bounds only
+		// when asked for
+		void Prepare( bool bitmapNodes, bool tightBounds );
+
+		// nullptr when the file is not resident
+		ResidentTree   const * FindTree   ( char const * filename ) const;
+		MMappedFastIdx const * FindFastIdx( char const * filename ) const;
+};
+
+// Absolute path of filename without symbolic links, filename itself when it does not exist
+std::string CanonicalPath( char const * filename );
+
+// PepteamMap on its command line, the subject files being read from resident when they
+// are ones of its files, loaded as usual otherwise
+int PepteamMap( int argc, char * argv[], ResidentSubjects const * resident = nullptr );
+
+#endif
@@ -0,0 +1,5 @@
+#include "PepteamMap.hpp"
+
+int main( int argc, char * argv[] ) {
+		return PepteamMap( argc, argv );
+}
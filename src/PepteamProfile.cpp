@@ -1,97 +1,142 @@
 #include <cstdio>
 #include <cstdint>
 #include <cstring>
+#include <cstdlib>
+#include <vector>
+#include <memory>
+#include <string>
+#include <algorithm>
 #include <boost/range/algorithm/for_each.hpp>
 
 #include "FastIdx.hpp"
 #include "PepTree.hpp"
+#include "LeafAbundances.hpp"
+#include "Mapping.hpp"
+#include "Profile.hpp"
+#include "ThreadPool.hpp"
 
 using namespace std;
 using boost::range::for_each;
 
-typedef map< uint32_t, vector< unsigned int > > protProfile_map;
-protProfile_map protProfiles;
-
-struct ProtFunctor {
-	public:
-		ProtFunctor( MMappedFastIdx const & idx_, size_t pepSz )
-			: idx( idx_ )
-			, pepSize( pepSz ) {
-		}
-
-	public:
-		void ListSize( uint16_t ) {   }
-
-		void AddHeader( uint32_t protNumber, uint16_t ) {
-				auto curProt = protProfiles.find( protNumber );
-				if ( curProt == protProfiles.end() ) {
-						size_t seqLength = strlen( idx.GetSequence( protNumber ) );
-						curProt = protProfiles.insert( make_pair( protNumber
-						                                        , vector< unsigned int >( seqLength )
-						                                        ) ).first;
-				}
-				curVec = &curProt->second;
-		}
-		void StopHeader() {   }
-
-		void AddPos( uint16_t p ) {
-				for ( size_t i = p, e = p + pepSize; i < e; ++i ) {
-						++(*curVec)[i];
+int main( int argc, char * argv[] ) {
+		size_t nbThreads = 1;
+		bool abundances = false;
+		int argi = 1;
+		for ( ; argi < argc && argv[argi][0] == '-'; ++argi ) {
+				if ( strcmp( argv[argi], "-j" ) == 0 && argi+1 < argc && atoi( argv[argi+1] ) > 0 ) {
+						nbThreads = static_cast< size_t >( atoi( argv[++argi] ) );
+				} else if ( strcmp( argv[argi], "--abundances" ) == 0 ) {
+						abundances = true;
+				} else {
+						break;
 				}
 		}
-		void StopPos() {   }
-
-	private:
-		MMappedFastIdx const & idx;
-		size_t pepSize;
-
-		vector< unsigned int > * curVec;
-};
-
-int main( int argc, char * argv[] ) {
-		if ( argc != 6 ) {
-				printf( "Usage: %s mapping-file query-fastIdx-file query-pepTree-file subject-fastIdx-file subject-pepTree-file\n"
+		if ( argc - argi != 5 ) {
+				printf( "Usage: %s [-j threads] [--abundances] mapping-file query-fastIdx-file query-pepTree-file subject-fastIdx-file subject-pepTree-file\n"
+				        "   with --abundances, every mapping is weighted by the abundance of its query leaf, read from\n"
+				        "   query-pepTree-file plus .abundances (PepTree --abundances)\n"
 				      , argv[0]
 				      );
 				return 1;
 		}
+		char const * mappingFilename = argv[argi];
 
-		MMappedFastIdx queryFastIdx( argv[2] );
-		MMappedPepTree queryPepTree( argv[3] );
-		MMappedFastIdx subjectFastIdx( argv[4] );
-		MMappedPepTree subjectPepTree( argv[5] );
+		MMappedFastIdx queryFastIdx( argv[argi+1] );
+		MMappedPepTree queryPepTree( argv[argi+2] );
+		MMappedFastIdx subjectFastIdx( argv[argi+3] );
+		MMappedPepTree subjectPepTree( argv[argi+4] );
 
 		size_t szQuery, szSubject;
-		queryPepTree  .ForLeaf( 0, [&]( char const * s, uint32_t ) {   szQuery   = strlen( s );   } );
-		subjectPepTree.ForLeaf( 0, [&]( char const * s, uint32_t ) {   szSubject = strlen( s );   } );
+		queryPepTree  .ForLeaf( 0, [&]( char const * s, size_t ) {   szQuery   = strlen( s );   } );
+		subjectPepTree.ForLeaf( 0, [&]( char const * s, size_t ) {   szSubject = strlen( s );   } );
 		if ( szQuery != szSubject ) {
 				printf( "Invalid pepTree files, not same words' size (query: %zu and subject: %zu)\n", szQuery, szSubject );
 				return 1;
 		}
 		printf( "Words' size: %zu\n", szQuery );
 
-		FILE * mappingFile = fopen( argv[1], "rb" );
-		while( !feof( mappingFile ) ) {
-				size_t queryIndex, subjectIndex;
-				double score;
-				fscanf( mappingFile, "%zu %zu %lg\n", &queryIndex, &subjectIndex, &score );
+		unique_ptr< LeafAbundances > queryAbundances;
+		if ( abundances ) {
+				try {
+						queryAbundances.reset( new LeafAbundances( (string{ argv[argi+2] } + ".abundances").c_str() ) );
+				} catch( std::exception & e ) {
+						fprintf( stderr, "%s\n", e.what() );
+						return 1;
+				}
+				if ( queryAbundances->GetNumberLeaves() != queryPepTree.GetNumberLeaves() ) {
+						printf( "Invalid abundances file, not the same number of leaves as the query pepTree file\n" );
+						return 1;
+				}
+		}
 
-				subjectPepTree.ForLeaf( subjectIndex, [&]( char const *, uint32_t offset ) {
-						subjectPepTree.ForLeafPos( offset, ProtFunctor( subjectFastIdx, szQuery ) );
-				});
+		ProfileAccumulator profiles( szQuery, abundances );   // abundances add up in 64 bits
+
+		// Weight of the query leaves [queryStart, queryStop): their number, or their abundance
+		auto Weight = [&]( uint64_t queryStart, uint64_t queryStop ) {
+				return queryAbundances ? queryAbundances->Sum( queryStart, queryStop ) : queryStop - queryStart;
+		};
+
+		// every query leaf of a block maps onto each of its subject leaves
+		auto BlockAdder = [&]( ProfileAccumulator & acc ) {
+				return [&subjectPepTree, &subjectFastIdx, &acc, &Weight]( uint64_t queryStart, uint64_t queryStop
+				                                                        , uint64_t subjectStart, uint64_t subjectStop
+				                                                        , uint32_t
+				                                                        ) {
+						auto weight = Weight( queryStart, queryStop );
+						for ( uint64_t subjectIndex = subjectStart; subjectIndex != subjectStop; ++subjectIndex ) {
+								acc.AddLeaf( subjectPepTree, subjectFastIdx, subjectIndex, weight );
+						}
+				};
+		};
+
+		try {
+				Mapping::Reader mappings( mappingFilename );
+				if ( mappings.IsBinary() && mappings.GetHeader().depth != szQuery ) {
+						printf( "Invalid mapping file, not same words' size as the pepTree files (%u)\n", mappings.GetHeader().depth );
+						return 1;
+				}
+				if ( nbThreads > 1 && mappings.IsBinary() ) {
+						// Blocks are read by batches, each batch being decoded and accumulated in
+						// parallel into per-worker profiles, merged at the end
+						WorkStealingPool pool( nbThreads );
+						vector< ProfileAccumulator > workerProfiles( pool.NumThreads(), ProfileAccumulator( szQuery, abundances ) );
+						vector< vector< uint8_t > > payloads( 4*pool.NumThreads() );
+						vector< uint32_t >          nbRecords( payloads.size() );
+						bool const blocks = mappings.HasBlocks();
+						for ( size_t n; ; ) {
+								for ( n = 0; n != payloads.size() && mappings.ReadBlock( payloads[n], nbRecords[n] ); ++n ) {   }
+								if ( n == 0 ) {
+										break;
+								}
+								pool.Run( n, [&]( size_t worker, size_t t ) {
+										auto & acc = workerProfiles[worker];
+										if ( blocks ) {
+												Mapping::Reader::ForEachBlockOf( payloads[t].data(), payloads[t].data() + payloads[t].size(), nbRecords[t], BlockAdder( acc ) );
+										} else {
+												Mapping::Reader::ForEachRawMappingOf( payloads[t].data(), payloads[t].data() + payloads[t].size(), nbRecords[t]
+												                                    , [&]( uint64_t queryIndex, uint64_t subjectIndex, int32_t, int32_t ) {
+														acc.AddLeaf( subjectPepTree, subjectFastIdx, subjectIndex, Weight( queryIndex, queryIndex+1 ) );
+												});
+										}
+								});
+						}
+						for_each( workerProfiles, [&]( ProfileAccumulator const & acc ) {   profiles.Merge( acc );   } );
+				} else if ( mappings.HasBlocks() ) {
+						mappings.ForEachBlock( BlockAdder( profiles ) );
+				} else {
+						mappings.ForEachMapping( [&]( uint64_t queryIndex, uint64_t subjectIndex, double ) {
+								profiles.AddLeaf( subjectPepTree, subjectFastIdx, subjectIndex, Weight( queryIndex, queryIndex+1 ) );
+						});
+				}
+		} catch( std::exception & e ) {
+				fprintf( stderr, "%s\n", e.what() );
+				return 1;
 		}
-		fclose( mappingFile );
 
 		ostringstream ostr;
-		ostr << argv[1] << ".profiles";
+		ostr << mappingFilename << ".profiles";
 		FILE * outputFile = fopen( ostr.str().c_str(), "wb" );
-		for_each( protProfiles, [=]( protProfile_map::value_type const & p ) {
-				fprintf( outputFile, "%s\t", subjectFastIdx.GetName( p.first ) );
-				for_each( p.second, [=]( unsigned int v ) {
-						fprintf( outputFile, "%u ", v );
-				});
-				fprintf( outputFile, "\n" );
-		});
+		profiles.Write( outputFile, subjectFastIdx );
 		fclose( outputFile );
 
 		return 0;
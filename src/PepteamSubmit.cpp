@@ -0,0 +1,51 @@
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <vector>
+#include <string>
+
+#include <unistd.h>
+
+#include "Jobs.hpp"
+
+using namespace std;
+
+void UsageError( char * argv[] ) {
+		fprintf( stderr
+		       , "Usage: %s socket-file [--fasta] [PepteamMap options] query-file subject-file cutoff-homology[,cutoff-homology...]\n"
+		         "          run a PepteamMap job on the Pepteamd server listening on socket-file, with the subject trees it\n"
+		         "          keeps resident; the job runs in the current directory, its messages are printed here and its exit\n"
+		         "          status is returned\n"
+		         "   where:\n"
+		         "     --fasta    -> the query is a FASTA file, indexed and turned into the PepTree of the depth of the subject\n"
+		         "                   (query-file.fastIdx.pepTree.depth) by the server before mapping it\n"
+		       , argv[0]
+		       );
+		exit( 1 );
+}
+
+int main( int argc, char * argv[] ) {
+		if ( argc < 5 ) {
+				UsageError( argv );
+		}
+		vector< string > args( argv + 2, argv + argc );
+
+		int connection = ConnectJobSocket( argv[1] );
+		if ( connection < 0 ) {
+				fprintf( stderr, "No Pepteamd server listening on \"%s\"\n", argv[1] );
+				return 1;
+		}
+		fflush( nullptr );
+		int32_t status;
+		if ( !SendJob( connection, args ) ) {
+				fprintf( stderr, "Unable to submit the job to \"%s\"\n", argv[1] );
+				return 1;
+		}
+		if ( !ReceiveStatus( connection, status ) ) {
+				fprintf( stderr, "Pepteamd server gone before the end of the job\n" );
+				return 1;
+		}
+		close( connection );
+		return status;
+}
@@ -0,0 +1,321 @@
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <csignal>
+#include <cerrno>
+#include <vector>
+#include <memory>
+#include <string>
+#include <sstream>
+#include <stdexcept>
+#include <algorithm>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "FastIdx.hpp"
+#include "PepTree.hpp"
+#include "PepteamMap.hpp"
+#include "Jobs.hpp"
+
+using namespace std;
+
+namespace {
+
+	void UsageError( char * argv[] ) {
+			fprintf( stderr
+			       , "Usage: %s [options] socket-file pepTree-subject-file...\n"
+			         "          keep the subject trees resident, running the PepteamMap jobs submitted by PepteamSubmit\n"
+			         "          over the Unix domain socket-file\n"
+			         "   where options are:\n"
+			         "     -j threads   -> number of mapping threads of every job, unless it gives its own (default: 1)\n"
+			         "     --jobs n     -> number of jobs run at once, the next ones waiting for one to finish (default: 1)\n"
+			         "     --fastIdx subject-fastIdx-file -> also keep resident a subject FastIdx file, for --profiles jobs\n"
+			         "     --no-lock    -> fault the subject files in without locking them in memory\n"
+			         "     --bitmap-nodes -> also keep the bitmap node layout of the subject trees, for --bitmap-nodes jobs\n"
+			         "     --tight-bounds -> also keep the subtree bounds of the subject trees, for --tight-bounds jobs\n"
+			       , argv[0]
+			       );
+			exit( 1 );
+	}
+
+	// Sibling programs building the trees of FASTA queries
+	string ProgramPath( char const * name ) {
+			char path[4096];
+			ssize_t n = readlink( "/proc/self/exe", path, sizeof( path ) - 1 );
+			if ( n <= 0 ) {
+					return name;
+			}
+			path[n] = '\0';
+			string dir( path );
+			return dir.substr( 0, dir.rfind( '/' ) + 1 ) + name;
+	}
+
+	int RunProgram( string const & program, vector< string > const & args ) {
+			fflush( nullptr );
+			pid_t pid = fork();
+			if ( pid == 0 ) {
+					vector< char * > argv;
+					argv.push_back( const_cast< char * >( program.c_str() ) );
+					for ( auto const & arg : args ) {
+							argv.push_back( const_cast< char * >( arg.c_str() ) );
+					}
+					argv.push_back( nullptr );
+					execv( program.c_str(), argv.data() );
+					fprintf( stderr, "Unable to run \"%s\"\n", program.c_str() );
+					_exit( 127 );
+			}
+			int status;
+			if ( pid < 0 || waitpid( pid, &status, 0 ) != pid ) {
+					return 1;
+			}
+			return WIFEXITED( status ) ? WEXITSTATUS( status ) : 128 + WTERMSIG( status );
+	}
+
+	// Runs a job in the working directory of its client, a FASTA query ("--fasta" first) being
+	// indexed and turned into the PepTree of the depth of the subject first
+	int RunJob( Job & job, size_t nbThreads, ResidentSubjects const & resident ) {
+			if ( fchdir( job.cwd ) != 0 || dup2( job.output, STDOUT_FILENO ) < 0 || dup2( job.error, STDERR_FILENO ) < 0 ) {
+					return 1;
+			}
+			job.Close();
+
+			auto args = job.args;
+			bool fasta = !args.empty() && args[0] == "--fasta";
+			if ( fasta ) {
+					args.erase( args.begin() );
+			}
+			string threads = to_string( nbThreads );
+			if ( fasta && args.size() >= 3 ) {
+					string & query   = args[args.size() - 3];
+					auto     subject = args[args.size() - 2].c_str();
+					uint32_t depth;
+					try {
+							auto tree = resident.FindTree( subject );
+							depth = tree ? tree->tree->Depth() : MMappedPepTree( subject ).Depth();
+					} catch( std::exception & e ) {
+							fprintf( stderr, "%s\n", e.what() );
+							return 1;
+					}
+					int status = RunProgram( ProgramPath( "FastIdx" ), { "-j", threads, "-c", query } );
+					if ( status == 0 ) {
+							status = RunProgram( ProgramPath( "PepTree" ), { "-j", threads, "-c", query + ".fastIdx", to_string( depth ) } );
+					}
+					if ( status != 0 ) {
+							return status;
+					}
+					query += ".fastIdx.pepTree." + to_string( depth );
+			}
+
+			vector< char * > argv;
+			argv.push_back( const_cast< char * >( "PepteamMap" ) );
+			argv.push_back( const_cast< char * >( "-j" ) );
+			argv.push_back( const_cast< char * >( threads.c_str() ) );
+			for ( auto & arg : args ) {
+					argv.push_back( const_cast< char * >( arg.c_str() ) );
+			}
+			argv.push_back( nullptr );
+			int status = 1;
+			try {
+					status = PepteamMap( static_cast< int >( argv.size() - 1 ), argv.data(), &resident );
+			} catch( std::exception & e ) {
+					fprintf( stderr, "%s\n", e.what() );
+			}
+			fflush( nullptr );
+			return status;
+	}
+
+	// Clients have that long to send their job once connected
+	int const receiveTimeout = 10;   // seconds
+
+	// Connections waiting for a job slot, past which no more are accepted until one ends
+	size_t const maxWaitingJobs = 64;
+
+	// The job is received by a supervisor process, forked for every connection so that a
+	// slow client does not stall the server, and run by a child of the supervisor once it
+	// holds one of the --jobs tokens of the slots pipe; the supervisor sends back its exit
+	// status: the mapping settings are process wide, and the exit of the job (on usage
+	// errors) is reported all the same
+	void SuperviseJob( int connection, int const (&slots)[2], size_t jobNumber, size_t nbThreads, ResidentSubjects const & resident ) {
+			ucred peer;   // jobs run as the server, only its own user may submit them
+			socklen_t peerSize = sizeof( peer );
+			if ( getsockopt( connection, SOL_SOCKET, SO_PEERCRED, &peer, &peerSize ) != 0 || peer.uid != geteuid() ) {
+					close( connection );
+					return;
+			}
+			timeval timeout = { receiveTimeout, 0 };
+			setsockopt( connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof( timeout ) );
+			Job job;
+			if ( !ReceiveJob( connection, job ) ) {
+					close( connection );
+					return;
+			}
+			ostringstream line;
+			for ( auto const & arg : job.args ) {
+					line << ' ' << arg;
+			}
+			printf( "Job %zu:%s\n", jobNumber, line.str().c_str() );
+			fflush( stdout );
+
+			char token = 0;   // waits for a job to finish when as many as allowed run
+			while ( read( slots[0], &token, 1 ) < 0 && errno == EINTR ) {   }
+			pid_t pid = fork();
+			if ( pid == 0 ) {
+					close( connection );
+					_exit( RunJob( job, nbThreads, resident ) );
+			}
+			job.Close();
+			int status = 1;
+			if ( pid > 0 && waitpid( pid, &status, 0 ) == pid ) {
+					status = WIFEXITED( status ) ? WEXITSTATUS( status ) : 128 + WTERMSIG( status );
+			}
+			while ( write( slots[1], &token, 1 ) < 0 && errno == EINTR ) {   }
+			SendStatus( connection, status );
+			close( connection );
+	}
+
+	int ListenJobSocket( char const * socketFilename ) {
+			sockaddr_un address;
+			memset( &address, 0, sizeof( address ) );
+			address.sun_family = AF_UNIX;
+			if ( strlen( socketFilename ) >= sizeof( address.sun_path ) ) {
+					throw std::runtime_error{ string{ "Socket filename too long \"" } + socketFilename + '"' };
+			}
+			strcpy( address.sun_path, socketFilename );
+
+			struct stat fStat;   // left by a previous server
+			if ( stat( socketFilename, &fStat ) == 0 && S_ISSOCK( fStat.st_mode ) ) {
+					int previous = ConnectJobSocket( socketFilename );
+					if ( previous >= 0 ) {
+							close( previous );
+							throw std::runtime_error{ string{ "A server already listens on \"" } + socketFilename + '"' };
+					}
+					unlink( socketFilename );
+			}
+
+			int listener = socket( AF_UNIX, SOCK_STREAM, 0 );
+			mode_t mask = umask( 0177 );   // connecting takes write permission, for the user only
+			bool bound = listener >= 0 && bind( listener, reinterpret_cast< sockaddr const * >( &address ), sizeof( address ) ) == 0;
+			umask( mask );
+			if ( !bound || chmod( socketFilename, 0600 ) != 0 || listen( listener, 64 ) != 0 ) {
+					throw std::runtime_error{ string{ "Unable to listen on \"" } + socketFilename + '"' };
+			}
+			return listener;
+	}
+
+} // namespace
+
+int main( int argc, char * argv[] ) {
+		size_t nbThreads = 1;
+		size_t nbJobs = 1;
+		bool lock = true;
+		bool bitmapNodes = false, tightBounds = false;
+		vector< char const * > fastIdxFilenames;
+		int argi = 1;
+		for ( ; argi < argc && argv[argi][0] == '-'; ++argi ) {
+				if ( strcmp( argv[argi], "-j" ) == 0 && argi+1 < argc && atoi( argv[argi+1] ) > 0 ) {
+						nbThreads = static_cast< size_t >( atoi( argv[++argi] ) );
+				} else if ( strcmp( argv[argi], "--jobs" ) == 0 && argi+1 < argc && atoi( argv[argi+1] ) > 0 ) {
+						nbJobs = static_cast< size_t >( atoi( argv[++argi] ) );
+				} else if ( strcmp( argv[argi], "--fastIdx" ) == 0 && argi+1 < argc ) {
+						fastIdxFilenames.push_back( argv[++argi] );
+				} else if ( strcmp( argv[argi], "--no-lock" ) == 0 ) {
+						lock = false;
+				} else if ( strcmp( argv[argi], "--bitmap-nodes" ) == 0 ) {
+						bitmapNodes = true;
+				} else if ( strcmp( argv[argi], "--tight-bounds" ) == 0 ) {
+						tightBounds = true;
+				} else {
+						UsageError( argv );
+				}
+		}
+		if ( argc - argi < 2 ) {
+				UsageError( argv );
+		}
+		char const * socketFilename = argv[argi];
+
+		ResidentSubjects resident;
+		int listener;
+		int slots[2];   // a token per job allowed to run at once
+		try {
+				auto Loaded = [&]( char const * filename, size_t fileSize, bool locked ) {
+						printf( "   ...\"%s\" resident (%zu MB%s).\n"
+						      , filename, fileSize >> 20, locked ? ", locked" : lock ? ", unable to lock it" : ""
+						      );
+				};
+				printf( "Loading subject files...\n" );
+				for ( int i = argi+1; i < argc; ++i ) {
+						auto & tree = resident.trees[CanonicalPath( argv[i] )].tree;
+						tree.reset( new MMappedPepTree( argv[i] ) );
+						Loaded( argv[i], tree->FileSize(), tree->Preload( lock ) && lock );
+				}
+				for ( auto filename : fastIdxFilenames ) {
+						auto & idx = resident.fastIdxs[CanonicalPath( filename )];
+						idx.reset( new MMappedFastIdx( filename ) );
+						Loaded( filename, idx->FileSize(), idx->Preload( lock ) && lock );
+				}
+				printf( "Building the subject tables...\n" );   // shared by the jobs instead of built by each
+				resident.Prepare( bitmapNodes, tightBounds );
+				listener = ListenJobSocket( socketFilename );
+				if ( pipe2( slots, O_CLOEXEC ) != 0 ) {
+						throw std::runtime_error{ "Unable to create the job slots" };
+				}
+				string tokens( std::min< size_t >( nbJobs, 1 << 12 ), '\0' );   // within the capacity of a pipe
+				if ( write( slots[1], tokens.data(), tokens.size() ) != static_cast< ssize_t >( tokens.size() ) ) {
+						throw std::runtime_error{ "Unable to create the job slots" };
+				}
+		} catch( std::exception & e ) {
+				fprintf( stderr, "%s\n", e.what() );
+				return 1;
+		}
+		printf( "Listening on \"%s\" (%zu job%s at once, %zu thread%s each)\n"
+		      , socketFilename, nbJobs, nbJobs > 1 ? "s" : "", nbThreads, nbThreads > 1 ? "s" : ""
+		      );
+		fflush( stdout );
+		signal( SIGPIPE, SIG_IGN );   // clients may leave before their job is done
+
+		// The ends of jobs interrupt accept, for their supervisors to be waited for
+		struct sigaction onChild;
+		memset( &onChild, 0, sizeof( onChild ) );
+		onChild.sa_handler = []( int ) {   };
+		sigaction( SIGCHLD, &onChild, nullptr );
+
+		// Supervisors are the only children of the server: as many as the running jobs plus the
+		// waiting ones
+		size_t const maxSupervisors = std::min< size_t >( nbJobs, 1 << 12 ) + maxWaitingJobs;
+		size_t nbSupervisors = 0;
+		for ( size_t jobNumber = 1; ; ) {
+				while ( nbSupervisors != 0 && waitpid( -1, nullptr, WNOHANG ) > 0 ) {
+						--nbSupervisors;
+				}
+				if ( nbSupervisors >= maxSupervisors ) {   // every one busy, until one ends
+						if ( waitpid( -1, nullptr, 0 ) > 0 ) {
+								--nbSupervisors;
+						}
+						continue;
+				}
+				int connection = accept( listener, nullptr, nullptr );
+				if ( connection < 0 ) {
+						continue;
+				}
+				pid_t pid = fork();
+				if ( pid == 0 ) {
+						signal( SIGCHLD, SIG_DFL );
+						close( listener );
+						SuperviseJob( connection, slots, jobNumber, nbThreads, resident );
+						_exit( 0 );
+				}
+				if ( pid > 0 ) {
+						++jobNumber;
+						++nbSupervisors;
+				}
+				close( connection );
+		}
+}
@@ -0,0 +1,67 @@
+#include <cstdio>
+#include <cstring>
+#include <cinttypes>
+
+#include "Profile.hpp"
+
+using namespace std;
+
+namespace {
+
+	template< typename Count >
+	void WriteProfiles( FILE * file, MMappedFastIdx const & idx, vector< char > const & hit, vector< Count > const & diff, char const * format ) {
+			for ( size_t p = 0, e = hit.size(); p != e; ++p ) {
+					if ( !hit[p] ) {
+							continue;
+					}
+					char const * seq = idx.GetSequence( p );
+					Count const * d = diff.data() + (seq - idx.GetSequencesData());
+					fprintf( file, "%s\t", idx.GetName( p ) );
+					Count coverage = 0;
+					for ( size_t i = 0, n = strlen( seq ); i != n; ++i ) {
+							coverage += d[i];
+							fprintf( file, format, coverage );
+					}
+					fprintf( file, "\n" );
+			}
+	}
+
+} // namespace
+
+void ProfileAccumulator::Allocate( MMappedFastIdx const & idx ) {
+		if ( wide ) {
+				wideDiff.assign( idx.GetSequencesSize() + 1, 0 );
+		} else {
+				diff.assign( idx.GetSequencesSize() + 1, 0 );
+		}
+		hit.assign( idx.Size(), 0 );
+}
+
+void ProfileAccumulator::Merge( ProfileAccumulator const & o ) {
+		if ( o.hit.empty() ) {
+				return;
+		}
+		if ( hit.empty() ) {
+				diff     = o.diff;
+				wideDiff = o.wideDiff;
+				hit      = o.hit;
+				return;
+		}
+		for ( size_t i = 0, e = diff.size(); i != e; ++i ) {
+				diff[i] += o.diff[i];
+		}
+		for ( size_t i = 0, e = wideDiff.size(); i != e; ++i ) {
+				wideDiff[i] += o.wideDiff[i];
+		}
+		for ( size_t i = 0, e = hit.size(); i != e; ++i ) {
+				hit[i] |= o.hit[i];
+		}
+}
+
+void ProfileAccumulator::Write( FILE * file, MMappedFastIdx const & idx ) const {
+		if ( wide ) {
+				WriteProfiles( file, idx, hit, wideDiff, "%" PRIu64 " " );
+		} else {
+				WriteProfiles( file, idx, hit, diff, "%u " );
+		}
+}
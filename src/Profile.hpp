@@ -0,0 +1,93 @@
+#ifndef PROFILE_HPP
+#define PROFILE_HPP
+
+#include <cstdio>
+#include <cstdint>
+#include <vector>
+
+#include "FastIdx.hpp"
+#include "PepTree.hpp"
+
+// Coverage profiles of the subject proteins: for every protein hit by at least one
+// mapping, the number of mapped words covering each of its residues.
+// Coverage is kept as one difference array over the whole FastIdx sequences section
+// (a word at sequence offset o adds weight at o and removes it at o + wordSize), so a
+// hit costs two updates whatever the word size; the counts are only summed up on Write().
+// Counts are 32 bits, wrapping, unless the accumulator is wide: weights such as read
+// abundances then add up in 64 bits.
+class ProfileAccumulator {
+	public:
+		explicit ProfileAccumulator( size_t wordSize_ = 0, bool wide_ = false )
+			: wordSize( wordSize_ )
+			, wide( wide_ ) {
+		}
+
+	public:
+		// Adds weight to the residues covered by every occurrence of the subject leaf,
+		// tree being a MMappedPepTree or a BitmapPepTree
+		template< typename Tree >
+		void AddLeaf( Tree const & tree, MMappedFastIdx const & idx, size_t leafIndex, uint64_t weight = 1 ) {
+				if ( hit.empty() ) {
+						Allocate( idx );
+				}
+				tree.ForLeaf( leafIndex, [&]( char const *, size_t offset ) {
+						if ( wide ) {
+								tree.ForLeafPos( offset, ProtFunctor< uint64_t >( *this, wideDiff, idx, weight ) );
+						} else {
+								tree.ForLeafPos( offset, ProtFunctor< unsigned int >( *this, diff, idx, static_cast< unsigned int >( weight ) ) );
+						}
+				});
+		}
+
+		void Merge( ProfileAccumulator const & o );
+
+		// One "name<TAB>coverage coverage ... " line per protein hit, by protein index
+		void Write( FILE * file, MMappedFastIdx const & idx ) const;
+
+	private:
+		template< typename Count >
+		struct ProtFunctor {
+			public:
+				ProtFunctor( ProfileAccumulator & acc_, std::vector< Count > & diff_, MMappedFastIdx const & idx_, Count weight_ )
+					: acc( acc_ )
+					, diff( diff_ )
+					, idx( idx_ )
+					, weight( weight_ ) {
+				}
+
+			public:
+				void ListSize( size_t ) {   }
+
+				void AddHeader( uint32_t protNumber, size_t ) {
+						acc.hit[protNumber] = 1;
+						curSeq = diff.data() + idx.GetSequenceOffset( protNumber );
+				}
+				void StopHeader() {   }
+
+				void AddPos( size_t p ) {
+						curSeq[p]                += weight;
+						curSeq[p + acc.wordSize] -= weight;
+				}
+				void StopPos() {   }
+
+			private:
+				ProfileAccumulator   & acc;
+				std::vector< Count > & diff;
+				MMappedFastIdx const & idx;
+				Count weight;
+
+				Count * curSeq;
+		};
+
+		size_t wordSize;
+		bool   wide;
+
+		std::vector< unsigned int > diff;       // by sequence offset, wrapping like the counts themselves
+		std::vector< uint64_t >     wideDiff;   // the same, when wide
+		std::vector< char >         hit;        // by protein
+
+	private:
+		void Allocate( MMappedFastIdx const & idx );
+};
+
+#endif
@@ -0,0 +1,276 @@
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <limits>
+#include <thread>
+#include <utility>
+#include <exception>
+#include <stdexcept>
+#include <algorithm>
+
+#include <zlib.h>
+
+#include "Reads.hpp"
+#include "FastIdx.hpp"
+#include "ThreadPool.hpp"
+
+using namespace std;
+
+namespace {
+
+	// Codons by their bases coded A, C, G, T as 0 to 3, the first base in the high bits
+	char const standardCode[] = "KNKNTTTTRSRSIIMIQHQHPPPPRRRRLLLLEDEDAAAAGGGGVVVV*Y*YSSSS*CWCLFLF";
+	size_t const amberCodon   = 3*16 + 0*4 + 2;   // TAG
+
+	// Lines of a gzipped or plain file (zlib reads both), without their end of line
+	class LineReader {
+		public:
+			explicit LineReader( char const * filename )
+				: file( gzopen( filename, "rb" ) ) {
+					if ( !file ) {
+							throw std::runtime_error{ string{ "Unable to open input reads file \"" } + filename + '"' };
+					}
+					gzbuffer( file, 1 << 20 );
+			}
+
+			~LineReader() {
+					gzclose( file );
+			}
+
+			LineReader( LineReader const & ) = delete;
+			LineReader & operator=( LineReader const & ) = delete;
+
+		public:
+			bool Next( string & line ) {
+					line.clear();
+					for ( ;; ) {
+							if ( pos == size ) {
+									int n = gzread( file, buffer, sizeof( buffer ) );
+									if ( n < 0 ) {
+											throw std::runtime_error{ "Corrupted input reads file, abording" };
+									}
+									if ( n == 0 ) {
+											return !line.empty();
+									}
+									pos  = 0;
+									size = static_cast< size_t >( n );
+							}
+							auto eol = static_cast< char const * >( memchr( buffer + pos, '\n', size - pos ) );
+							size_t end = eol ? static_cast< size_t >( eol - buffer ) : size;
+							line.append( buffer + pos, end - pos );
+							pos = end;
+							if ( eol ) {
+									++pos;
+									if ( !line.empty() && line.back() == '\r' ) {
+											line.pop_back();
+									}
+									return true;
+							}
+					}
+			}
+
+		private:
+			gzFile file;
+			char   buffer[1 << 16];
+			size_t pos  = 0;
+			size_t size = 0;
+	};
+
+} // namespace
+
+void TranslationStats::Merge( TranslationStats const & o ) {
+		nbReads    += o.nbReads;
+		noInsert   += o.noInsert;
+		ambiguous  += o.ambiguous;
+		outOfFrame += o.outOfFrame;
+		lowQuality += o.lowQuality;
+		stopCodon  += o.stopCodon;
+}
+
+ReadTranslator::ReadTranslator( TranslationOptions const & options_ )
+	: options( options_ ) {
+		memcpy( codonTable, standardCode, sizeof( codonTable ) );
+		if ( options.amberAsQ ) {
+				codonTable[amberCodon] = 'Q';
+		}
+		memset( baseCodes, -1, sizeof( baseCodes ) );
+		char const * bases[] = { "Aa", "Cc", "Gg", "TtUu" };
+		for ( int8_t code = 0; code != 4; ++code ) {
+				for ( char const * b = bases[code]; *b; ++b ) {
+						baseCodes[ static_cast< unsigned char >( *b ) ] = code;
+				}
+		}
+}
+
+void ReadTranslator::Translate( Read const & read, string & peptide, PeptideCounts & workerCounts, TranslationStats & workerStats ) const {
+		++workerStats.nbReads;
+		auto const & bases = read.bases;
+		size_t start = 0, stop = bases.size();
+		if ( !options.leftFlank.empty() ) {
+				start = bases.find( options.leftFlank );
+				if ( start == string::npos ) {
+						++workerStats.noInsert;
+						return;
+				}
+				start += options.leftFlank.size();
+		}
+		if ( !options.rightFlank.empty() ) {
+				stop = bases.find( options.rightFlank, start );
+				if ( stop == string::npos ) {
+						++workerStats.noInsert;
+						return;
+				}
+		}
+		if ( start == stop ) {
+				++workerStats.noInsert;
+				return;
+		}
+		if ( (stop - start) % 3 != 0 ) {
+				++workerStats.outOfFrame;
+				return;
+		}
+
+		peptide.clear();
+		for ( size_t i = start; i != stop; i += 3 ) {
+				int b0 = baseCodes[ static_cast< unsigned char >( bases[i]   ) ];
+				int b1 = baseCodes[ static_cast< unsigned char >( bases[i+1] ) ];
+				int b2 = baseCodes[ static_cast< unsigned char >( bases[i+2] ) ];
+				if ( (b0 | b1 | b2) < 0 ) {
+						++workerStats.ambiguous;
+						return;
+				}
+				peptide += codonTable[ 16*b0 + 4*b1 + b2 ];
+		}
+		if ( options.minQuality != 0 && !read.qualities.empty() ) {
+				for ( size_t i = start; i != stop; ++i ) {
+						if ( static_cast< unsigned >( read.qualities[i] - '!' ) < options.minQuality ) {
+								++workerStats.lowQuality;
+								return;
+						}
+				}
+		}
+		if ( peptide.find( '*' ) != string::npos ) {
+				++workerStats.stopCodon;
+				return;
+		}
+		auto & count = workerCounts[peptide];
+		if ( count != numeric_limits< uint32_t >::max() ) {
+				++count;
+		}
+}
+
+size_t ReadTranslator::Parse( char const * filename, size_t nbThreads ) {
+		static size_t const batchSize = 1 << 16;
+
+		LineReader reader( filename );
+		WorkStealingPool pool( nbThreads );
+		vector< PeptideCounts >    workerCounts( pool.NumThreads() );
+		vector< TranslationStats > workerStats( pool.NumThreads() );
+
+		// Double buffered: a batch is translated by the pool, run from its own thread, while
+		// the next one is parsed into the other buffer
+		vector< Read > batches[2] = { vector< Read >( batchSize ), vector< Read >( batchSize ) };
+		thread         translating;
+		exception_ptr  translateError;
+		auto WaitTranslation = [&]() {
+				if ( translating.joinable() ) {
+						translating.join();
+				}
+				if ( translateError ) {
+						rethrow_exception( translateError );
+				}
+		};
+		auto TranslateBatch = [&]( size_t b, size_t nbReads ) {
+				WaitTranslation();   // of the other buffer
+				translating = thread( [&, b, nbReads]() {
+						try {
+								size_t nbTasks = std::min( nbReads, 4*pool.NumThreads() );
+								pool.Run( nbTasks, [&]( size_t worker, size_t t ) {
+										string peptide;
+										for ( size_t r = t*nbReads/nbTasks, e = (t+1)*nbReads/nbTasks; r != e; ++r ) {
+												Translate( batches[b][r], peptide, workerCounts[worker], workerStats[worker] );
+										}
+								});
+						} catch( ... ) {
+								translateError = current_exception();
+						}
+				});
+		};
+
+		// FASTQ records are four lines, FASTA ones a header then sequence lines
+		string line;
+		while ( reader.Next( line ) && line.empty() ) {   }
+		bool fastq = !line.empty() && line[0] == '@';
+		if ( !line.empty() && !fastq && line[0] != '>' ) {
+				throw std::runtime_error{ string{ "Input reads file \"" } + filename + "\" is neither FASTQ nor FASTA, abording" };
+		}
+		size_t nbReads = 0, inBatch = 0, b = 0;
+		bool more = !line.empty();
+		try {
+				while ( more ) {
+						auto & read = batches[b][inBatch];
+						read.bases.clear();
+						read.qualities.clear();
+						if ( fastq ) {
+								string plus;
+								if ( line[0] != '@' || !reader.Next( read.bases ) || !reader.Next( plus ) || plus.empty() || plus[0] != '+'
+								  || !reader.Next( read.qualities ) || read.qualities.size() != read.bases.size()
+								   ) {
+										throw std::runtime_error{ string{ "Invalid FASTQ record in \"" } + filename + "\", abording" };
+								}
+								while ( (more = reader.Next( line )) && line.empty() ) {   }
+						} else {
+								while ( (more = reader.Next( line )) && (line.empty() || line[0] != '>') ) {
+										read.bases += line;
+								}
+						}
+						++nbReads;
+						if ( ++inBatch == batchSize ) {
+								TranslateBatch( b, inBatch );
+								b ^= 1;
+								inBatch = 0;
+						}
+				}
+				if ( inBatch != 0 ) {
+						TranslateBatch( b, inBatch );
+				}
+		} catch( ... ) {   // a parse error, the batch being translated is waited for all the same
+				if ( translating.joinable() ) {
+						translating.join();
+				}
+				throw;
+		}
+		WaitTranslation();
+
+		for ( size_t w = 0; w != pool.NumThreads(); ++w ) {
+				stats.Merge( workerStats[w] );
+				for ( auto const & pc : workerCounts[w] ) {
+						auto & count = counts[pc.first];
+						count = static_cast< uint32_t >( std::min< uint64_t >( uint64_t{ count } + pc.second, numeric_limits< uint32_t >::max() ) );
+				}
+				PeptideCounts().swap( workerCounts[w] );   // release
+		}
+		return nbReads;
+}
+
+void ReadTranslator::Write( FILE * file, bool forceWide ) const {
+		vector< pair< string const *, uint32_t > > sorted;
+		sorted.reserve( counts.size() );
+		for ( auto const & pc : counts ) {
+				sorted.emplace_back( &pc.first, pc.second );
+		}
+		sort( sorted.begin(), sorted.end(), []( pair< string const *, uint32_t > const & a, pair< string const *, uint32_t > const & b ) {
+				return a.second != b.second ? a.second > b.second : *a.first < *b.first;
+		});
+
+		vector< string > names, sequences;
+		names    .reserve( sorted.size() );
+		sequences.reserve( sorted.size() );
+		for ( size_t i = 0; i != sorted.size(); ++i ) {
+				names    .push_back( "pep" + to_string( i+1 ) + ";size=" + to_string( sorted[i].second ) );
+				sequences.push_back( *sorted[i].first );
+		}
+		MemFastIdx( names, sequences ).Write( file, forceWide );
+}
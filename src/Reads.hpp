@@ -0,0 +1,76 @@
+#ifndef READS_HPP
+#define READS_HPP
+
+#include <cstdio>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+// ~~~ Nucleotide reads ~~~ //
+// Phage library reads, in FASTQ or FASTA (gzipped or not), are turned into the distinct
+// peptides of their inserts: the insert of a read lies between the two constant flanking
+// sequences (the whole read without them), its codons being translated through a table.
+// Reads without insert, with an insert of ambiguous bases, out of frame, of a base under
+// the least quality or translating to a stop codon are dropped; the others are collapsed
+// into their distinct peptides with their read counts.
+struct TranslationOptions {
+		std::string leftFlank;           // constant sequence before the insert, none if empty
+		std::string rightFlank;          // constant sequence after the insert, none if empty
+		unsigned    minQuality = 0;      // least Phred quality of the insert bases (FASTQ only)
+		bool        amberAsQ   = false;  // TAG translated as Q, as by amber suppressor strains
+};
+
+struct TranslationStats {
+		size_t nbReads      = 0;
+		size_t noInsert     = 0;
+		size_t ambiguous    = 0;
+		size_t outOfFrame   = 0;
+		size_t lowQuality   = 0;
+		size_t stopCodon    = 0;
+
+		size_t Kept() const {   return nbReads - noInsert - ambiguous - outOfFrame - lowQuality - stopCodon;   }
+
+		void Merge( TranslationStats const & o );
+};
+
+// Reads are parsed by batches on the calling thread, every batch being translated and
+// counted concurrently into per-worker peptide counts while the next one is parsed, the
+// counts being merged once all are read
+class ReadTranslator {
+	public:
+		explicit ReadTranslator( TranslationOptions const & options );
+
+	public:
+		// Returns the number of reads parsed
+		size_t Parse( char const * filename, size_t nbThreads );
+
+		TranslationStats const & GetStats() const {   return stats;   }
+
+		size_t NumPeptides() const {   return counts.size();   }
+
+		// FastIdx of the distinct peptides, by decreasing read count then peptide, named
+		// "pep<rank>;size=<count>" so that PepTree --abundances reads their counts back
+		void Write( FILE * file, bool forceWide = false ) const;
+
+	private:
+		typedef std::unordered_map< std::string, uint32_t > PeptideCounts;
+
+		struct Read {
+				std::string bases;
+				std::string qualities;   // empty for FASTA reads
+		};
+
+	private:
+		TranslationOptions options;
+		char               codonTable[64];
+		int8_t             baseCodes[256];
+
+		TranslationStats stats;
+		PeptideCounts    counts;
+
+	private:
+		void Translate( Read const & read, std::string & peptide, PeptideCounts & workerCounts, TranslationStats & workerStats ) const;
+};
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef SIMILARITY_HPP
+#define SIMILARITY_HPP
+
+#include <utility>
+#include <tuple>
+
+#include "Fasta.hpp"
+
+// Similarity of two words q and s under a substitution matrix H, kept as the exact ratio
+//    2*sum H(q_i,s_i) / sum (H(q_i,q_i) + H(s_i,s_i))
+typedef std::pair< int, int > SimilarityScore;
+inline int GetScoreNum( SimilarityScore const & s ) {   return std::get< 0 >( s );   }
+inline int GetScoreDen( SimilarityScore const & s ) {   return std::get< 1 >( s );   }
+
+inline double GetScoreValue( SimilarityScore const & s ) {
+		return GetScoreNum( s ) / static_cast< double >( GetScoreDen( s ) );
+}
+
+inline SimilarityScore WordsSimilarity( int const (&matrix)[24][24], char const * q, char const * s ) {
+		int subjectCost = 0, queryCost = 0, homologyCost = 0;
+		while ( *q != '\0' ) {
+				Fasta::AAIndex qIdx = Fasta::Char2Index( *q );
+				Fasta::AAIndex sIdx = Fasta::Char2Index( *s );
+
+				queryCost    += matrix[qIdx][qIdx];
+				subjectCost  += matrix[sIdx][sIdx];
+				homologyCost += matrix[qIdx][sIdx];
+
+				++q;
+				++s;
+		}
+		return { 2*homologyCost, queryCost + subjectCost };
+}
+
+#endif
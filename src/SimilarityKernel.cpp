@@ -0,0 +1,114 @@
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+#include <immintrin.h>
+
+#include "SimilarityKernel.hpp"
+
+using namespace std;
+
+BatchSimilarity::BatchSimilarity( int const (&matrix_)[24][24] )
+	: maxAbs( 0 ) {
+		memcpy( matrix, matrix_, sizeof( matrix ) );
+		memset( rows, 0, sizeof( rows ) );
+		for ( size_t a = 0; a != 24; ++a ) {
+				for ( size_t b = 0; b != 24; ++b ) {
+						maxAbs = max( maxAbs, abs( matrix[a][b] ) );
+						rows[a][b] = static_cast< int8_t >( matrix[a][b] );
+				}
+		}
+
+		kernel     = &ScalarKernel;
+		kernelName = "scalar";
+		if ( getenv( "PEPTEAM_NO_SIMD" ) ) {
+				return;
+		}
+		__builtin_cpu_init();
+		if ( __builtin_cpu_supports( "avx512bw" ) ) {
+				kernel     = &Avx512Kernel;
+				kernelName = "avx512bw";
+		} else if ( __builtin_cpu_supports( "avx2" ) ) {
+				kernel     = &Avx2Kernel;
+				kernelName = "avx2";
+		}
+}
+
+void BatchSimilarity::ScalarKernel( BatchSimilarity const & self, int8_t const * query
+                                  , EncodedWords const & words, int32_t * homology
+                                  ) {
+		fill( homology, homology + words.Size(), 0 );
+		for ( size_t i = 0, e = words.WordSize(); i != e; ++i ) {
+				int const    * row = self.matrix[ query[i] ];
+				int8_t const * res = words.Position( i );
+				for ( size_t j = 0, n = words.Size(); j != n; ++j ) {
+						homology[j] += row[ res[j] ];
+				}
+		}
+}
+
+// Both SIMD kernels look the 24 entries of the query residue row up with byte
+// shuffles: entries 0-15 from the low half of the row, 16-23 from the high half,
+// selected by comparing the subject residue index against 15.
+
+__attribute__(( target( "avx2" ) ))
+void BatchSimilarity::Avx2Kernel( BatchSimilarity const & self, int8_t const * query
+                                , EncodedWords const & words, int32_t * homology
+                                ) {
+		size_t const wordSize = words.WordSize();
+		__m256i const fifteen = _mm256_set1_epi8( 15 );
+		for ( size_t j = 0, n = words.Size(); j < n; j += 32 ) {
+				__m256i accLo = _mm256_setzero_si256();
+				__m256i accHi = _mm256_setzero_si256();
+				for ( size_t i = 0; i != wordSize; ++i ) {
+						int8_t const * row = self.rows[ query[i] ];
+						__m256i lo  = _mm256_broadcastsi128_si256( _mm_loadu_si128( reinterpret_cast< __m128i const * >( row ) ) );
+						__m256i hi  = _mm256_broadcastsi128_si256( _mm_loadu_si128( reinterpret_cast< __m128i const * >( row + 16 ) ) );
+						__m256i idx = _mm256_loadu_si256( reinterpret_cast< __m256i const * >( words.Position( i ) + j ) );
+						__m256i val = _mm256_blendv_epi8( _mm256_shuffle_epi8( lo, idx )
+						                                , _mm256_shuffle_epi8( hi, idx )
+						                                , _mm256_cmpgt_epi8( idx, fifteen )
+						                                );
+						accLo = _mm256_add_epi16( accLo, _mm256_cvtepi8_epi16( _mm256_castsi256_si128( val ) ) );
+						accHi = _mm256_add_epi16( accHi, _mm256_cvtepi8_epi16( _mm256_extracti128_si256( val, 1 ) ) );
+				}
+				auto out = reinterpret_cast< __m256i * >( homology + j );
+				_mm256_storeu_si256( out    , _mm256_cvtepi16_epi32( _mm256_castsi256_si128( accLo ) ) );
+				_mm256_storeu_si256( out + 1, _mm256_cvtepi16_epi32( _mm256_extracti128_si256( accLo, 1 ) ) );
+				_mm256_storeu_si256( out + 2, _mm256_cvtepi16_epi32( _mm256_castsi256_si128( accHi ) ) );
+				_mm256_storeu_si256( out + 3, _mm256_cvtepi16_epi32( _mm256_extracti128_si256( accHi, 1 ) ) );
+		}
+}
+
+// GCC flags the undefined upper lanes of the broadcast/extract intrinsics
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+__attribute__(( target( "avx512bw" ) ))
+void BatchSimilarity::Avx512Kernel( BatchSimilarity const & self, int8_t const * query
+                                  , EncodedWords const & words, int32_t * homology
+                                  ) {
+		size_t const wordSize = words.WordSize();
+		__m512i const fifteen = _mm512_set1_epi8( 15 );
+		for ( size_t j = 0, n = words.Size(); j < n; j += 64 ) {
+				__m512i accLo = _mm512_setzero_si512();
+				__m512i accHi = _mm512_setzero_si512();
+				for ( size_t i = 0; i != wordSize; ++i ) {
+						int8_t const * row = self.rows[ query[i] ];
+						__m512i lo  = _mm512_broadcast_i32x4( _mm_loadu_si128( reinterpret_cast< __m128i const * >( row ) ) );
+						__m512i hi  = _mm512_broadcast_i32x4( _mm_loadu_si128( reinterpret_cast< __m128i const * >( row + 16 ) ) );
+						__m512i idx = _mm512_loadu_si512( words.Position( i ) + j );
+						__m512i val = _mm512_mask_blend_epi8( _mm512_cmpgt_epi8_mask( idx, fifteen )
+						                                    , _mm512_shuffle_epi8( lo, idx )
+						                                    , _mm512_shuffle_epi8( hi, idx )
+						                                    );
+						accLo = _mm512_add_epi16( accLo, _mm512_cvtepi8_epi16( _mm512_castsi512_si256( val ) ) );
+						accHi = _mm512_add_epi16( accHi, _mm512_cvtepi8_epi16( _mm512_extracti64x4_epi64( val, 1 ) ) );
+				}
+				auto out = homology + j;
+				_mm512_storeu_si512( out     , _mm512_cvtepi16_epi32( _mm512_castsi512_si256( accLo ) ) );
+				_mm512_storeu_si512( out + 16, _mm512_cvtepi16_epi32( _mm512_extracti64x4_epi64( accLo, 1 ) ) );
+				_mm512_storeu_si512( out + 32, _mm512_cvtepi16_epi32( _mm512_castsi512_si256( accHi ) ) );
+				_mm512_storeu_si512( out + 48, _mm512_cvtepi16_epi32( _mm512_extracti64x4_epi64( accHi, 1 ) ) );
+		}
+}
+#pragma GCC diagnostic pop
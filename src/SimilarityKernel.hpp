@@ -0,0 +1,115 @@
+#ifndef SIMILARITYKERNEL_HPP
+#define SIMILARITYKERNEL_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "Fasta.hpp"
+
+// Words of a leaf range, pre-encoded as residue indices and stored position-major
+// (residue i of every word is contiguous), padded to a multiple of the widest
+// SIMD kernel so that kernels never need a scalar tail.
+class EncodedWords {
+	public:
+		static size_t const padding = 64;
+
+	public:
+		explicit EncodedWords( size_t wordSize_ = 0 )
+			: wordSize( wordSize_ )
+			, count( 0 )
+			, stride( 0 ) {
+		}
+
+	public:
+		size_t WordSize() const {   return wordSize;   }
+		size_t Size() const     {   return count;      }
+		size_t Stride() const   {   return stride;     }
+
+		// Resets to count words of wordSize residues, all padding
+		void Resize( size_t wordSize_, size_t count_ ) {
+				wordSize = wordSize_;
+				count    = count_;
+				stride   = (count + padding - 1) / padding * padding;
+				residues.assign( wordSize * stride, 0 );
+		}
+
+		void Set( size_t j, char const * word ) {
+				for ( size_t i = 0; i != wordSize; ++i ) {
+						residues[i*stride + j] = Encode( word[i] );
+				}
+		}
+
+		// Word of wordSize already encoded residues
+		void Set( size_t j, int8_t const * word ) {
+				for ( size_t i = 0; i != wordSize; ++i ) {
+						residues[i*stride + j] = word[i];
+				}
+		}
+
+		int8_t const * Position( size_t i ) const {   return residues.data() + i*stride;   }
+
+		// Residues outside of the matrix (J, U, ...) are never part of the trees, should
+		// they still appear they are scored as X
+		static int8_t Encode( char c ) {
+				auto idx = Fasta::Char2Index( c );
+				return idx < 0 ? 22 : idx;
+		}
+
+	private:
+		size_t wordSize;
+		size_t count;
+		size_t stride;
+		std::vector< int8_t > residues;
+};
+
+// Scores one query word against every word of an EncodedWords, using the widest
+// instruction set available at runtime (AVX-512BW, AVX2, or plain scalar code).
+class BatchSimilarity {
+	public:
+		explicit BatchSimilarity( int const (&matrix)[24][24] );
+
+	public:
+		// homology[j] = sum_i matrix[query[i]][words_i[j]] for the words.Size() first words,
+		// query being words.WordSize() encoded residues; homology must hold words.Stride() values
+		void Homology( int8_t const * query, EncodedWords const & words, int32_t * homology ) const {
+				if ( FitsSimd( words.WordSize() ) ) {
+						kernel( *this, query, words, homology );
+				} else {
+						ScalarKernel( *this, query, words, homology );
+				}
+		}
+
+		// sum_i matrix[word[i]][word[i]]
+		int SelfScore( int8_t const * word, size_t wordSize ) const {
+				int score = 0;
+				for ( size_t i = 0; i != wordSize; ++i ) {
+						score += matrix[word[i]][word[i]];
+				}
+				return score;
+		}
+
+		char const * KernelName() const {   return kernelName;   }
+
+	private:
+		typedef void (*Kernel)( BatchSimilarity const &, int8_t const *, EncodedWords const &, int32_t * );
+
+		int    matrix[24][24];
+		int8_t rows[24][32];   // matrix rows as bytes, padded for the byte shuffles
+		int    maxAbs;
+
+		Kernel       kernel;
+		char const * kernelName;
+
+	private:
+		static void ScalarKernel( BatchSimilarity const &, int8_t const *, EncodedWords const &, int32_t * );
+		static void Avx2Kernel  ( BatchSimilarity const &, int8_t const *, EncodedWords const &, int32_t * );
+		static void Avx512Kernel( BatchSimilarity const &, int8_t const *, EncodedWords const &, int32_t * );
+
+		// The SIMD kernels accumulate bytes in 16 bits lanes
+		bool FitsSimd( size_t wordSize ) const {
+				return maxAbs <= INT8_MAX && wordSize * maxAbs <= INT16_MAX;
+		}
+};
+
+#endif
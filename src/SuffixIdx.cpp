@@ -0,0 +1,237 @@
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <algorithm>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "SuffixIdx.hpp"
+#include "Fasta.hpp"
+#include "ThreadPool.hpp"
+
+using namespace std;
+
+static size_t const headerSize = 4 * sizeof( uint32_t ) + 2 * sizeof( uint64_t );   // magic + version + maxDepth + suffixSize + nbSuffixes + sequencesSize
+
+SuffixArray::SuffixArray( MMappedFastIdx const & idx, uint32_t maxDepth_, size_t nbThreads )
+	: maxDepth( maxDepth_ )
+	, sequencesSize( idx.GetSequencesSize() ) {
+		if ( maxDepth == 0 || maxDepth > SuffixIdxFormat::maxMaxDepth ) {
+				throw std::runtime_error{ "Suffix index maximum depth must be between 1 and 255, abording" };
+		}
+		auto sequences = idx.GetSequencesData();
+
+		// valid residues starting at every offset, up to maxDepth
+		vector< uint8_t > runs( sequencesSize + 1, 0 );
+		for ( size_t i = sequencesSize; i-- != 0; ) {
+				if ( Fasta::IsValidAA( sequences[i] ) ) {
+						runs[i] = static_cast< uint8_t >( std::min< uint32_t >( runs[i+1] + 1, maxDepth ) );
+				}
+		}
+
+		// Buckets of the first two residues (or of the first one and the end of the valid
+		// residues), in residues order
+		uint8_t codes[256];
+		memset( codes, 0, sizeof( codes ) );
+		for ( size_t i = 0; PepTreeFormat::residuesInOrder[i]; ++i ) {
+				codes[ static_cast< unsigned char >( PepTreeFormat::residuesInOrder[i] ) ] = static_cast< uint8_t >( i+1 );
+		}
+		size_t const nbCodes = sizeof( PepTreeFormat::residuesInOrder );
+		auto Bucket = [&]( size_t i ) {
+				return codes[ static_cast< unsigned char >( sequences[i] ) ] * nbCodes
+				     + (runs[i] >= 2 ? codes[ static_cast< unsigned char >( sequences[i+1] ) ] : 0);
+		};
+		vector< size_t > bucketStarts( nbCodes*nbCodes + 1, 0 );
+		for ( size_t i = 0; i != sequencesSize; ++i ) {
+				if ( runs[i] != 0 ) {
+						++bucketStarts[ Bucket( i ) + 1 ];
+				}
+		}
+		for ( size_t b = 1; b != bucketStarts.size(); ++b ) {
+				bucketStarts[b] += bucketStarts[b-1];
+		}
+		suffixes.resize( bucketStarts.back() );
+		{
+				vector< size_t > next( bucketStarts.begin(), bucketStarts.end() - 1 );
+				for ( size_t i = 0; i != sequencesSize; ++i ) {
+						if ( runs[i] != 0 ) {
+								suffixes[ next[ Bucket( i ) ]++ ] = i;
+						}
+				}
+		}
+
+		// Suffixes compare on their valid residues, a suffix being before those it is a
+		// prefix of; equal ones stay by offset
+		auto Less = [&]( uint64_t a, uint64_t b ) {
+				int c = memcmp( sequences + a, sequences + b, std::min( runs[a], runs[b] ) );
+				if ( c != 0 ) {
+						return c < 0;
+				}
+				return runs[a] != runs[b] ? runs[a] < runs[b] : a < b;
+		};
+		WorkStealingPool pool( nbThreads );
+		pool.Run( bucketStarts.size() - 1, [&]( size_t, size_t b ) {
+				sort( suffixes.begin() + bucketStarts[b], suffixes.begin() + bucketStarts[b+1], Less );
+		});
+
+		lcp     .resize( suffixes.size(), 0 );
+		validRun.resize( suffixes.size(), 0 );
+		for ( size_t j = 0; j != suffixes.size(); ++j ) {
+				validRun[j] = runs[ suffixes[j] ];
+				if ( j != 0 ) {
+						size_t a = suffixes[j-1], b = suffixes[j];
+						size_t common = 0, maxCommon = std::min( runs[a], runs[b] );
+						while ( common != maxCommon && sequences[a + common] == sequences[b + common] ) {
+								++common;
+						}
+						lcp[j] = static_cast< uint8_t >( common );
+				}
+		}
+}
+
+void SuffixArray::Write( FILE * file ) const {
+		uint32_t suffixSize = sequencesSize <= numeric_limits< uint32_t >::max() ? sizeof( uint32_t ) : sizeof( uint64_t );
+		uint32_t arr[] = { 0, SuffixIdxFormat::currentVersion, maxDepth, suffixSize };
+		memcpy( arr, SuffixIdxFormat::magic, sizeof( SuffixIdxFormat::magic ) );
+		uint64_t sizes[] = { suffixes.size(), sequencesSize };
+		fwrite( arr  , sizeof( arr[0] )  , sizeof( arr ) / sizeof( arr[0] )    , file );
+		fwrite( sizes, sizeof( sizes[0] ), sizeof( sizes ) / sizeof( sizes[0] ), file );
+		if ( suffixSize == sizeof( uint32_t ) ) {
+				vector< uint32_t > narrow( suffixes.begin(), suffixes.end() );
+				fwrite( narrow.data(), sizeof( uint32_t ), narrow.size(), file );
+		} else {
+				fwrite( suffixes.data(), sizeof( uint64_t ), suffixes.size(), file );
+		}
+		fwrite( lcp     .data(), sizeof( uint8_t ), lcp     .size(), file );
+		fwrite( validRun.data(), sizeof( uint8_t ), validRun.size(), file );
+}
+
+MMappedSuffixIdx::MMappedSuffixIdx( char const * filename )
+	: fd( open( filename, O_RDONLY ) )
+	, fileSize( 0 )
+	, ptr( nullptr ) {
+		if ( fd < 0 ) {
+				throw std::runtime_error{ string{ "Unable to open input SuffixIdx file \"" } + filename + '"' };
+		}
+		struct stat fStat;
+		fstat( fd, &fStat );
+		fileSize = static_cast< size_t >( fStat.st_size );
+		if ( fileSize < headerSize ) {
+				close( fd );
+				throw std::runtime_error{ string{ "Invalid SuffixIdx file \"" } + filename + "\", abording" };
+		}
+		ptr = static_cast< char const * >( mmap( nullptr, fileSize, PROT_READ, MAP_SHARED, fd, 0 ) );
+
+		auto header = reinterpret_cast< uint32_t const * >( ptr );
+		auto sizes  = reinterpret_cast< uint64_t const * >( ptr + 4 * sizeof( uint32_t ) );
+		maxDepth       = header[2];
+		suffixSize     = header[3];
+		nbSuffixes     = sizes[0];
+		sequencesSize  = sizes[1];
+		suffixesOffset = headerSize;
+		lcpOffset      = suffixesOffset + nbSuffixes * suffixSize;
+		validRunOffset = lcpOffset + nbSuffixes;
+		if ( memcmp( ptr, SuffixIdxFormat::magic, sizeof( SuffixIdxFormat::magic ) ) != 0 || header[1] != SuffixIdxFormat::currentVersion
+		  || (suffixSize != sizeof( uint32_t ) && suffixSize != sizeof( uint64_t )) || validRunOffset + nbSuffixes != fileSize
+		   ) {
+				throw std::runtime_error{ string{ "Invalid or unsupported SuffixIdx file \"" } + filename + "\", abording" };
+		}
+}
+
+MMappedSuffixIdx::~MMappedSuffixIdx() {
+		close( fd );
+}
+
+void MMappedSuffixIdx::WriteReadable( FILE * file, MMappedFastIdx const & idx ) const {
+		auto sequences = idx.GetSequencesData();
+		for ( size_t i = 0; i != Size(); ++i ) {
+				fprintf( file, "(%05zu) %08zX: %3u %3u %.*s\n"
+				       , i, GetSuffix( i ), GetLcp( i ), GetValidRun( i ), static_cast< int >( GetValidRun( i ) ), sequences + GetSuffix( i )
+				       );
+		}
+}
+
+SuffixPepTree::SuffixPepTree( MMappedSuffixIdx const & suffixes_, MMappedFastIdx const & idx_, uint32_t depth )
+	: suffixes( suffixes_ )
+	, idx( idx_ )
+	, sequences( idx_.GetSequencesData() )
+	, nodes( depth ) {
+		if ( suffixes.GetSequencesSize() != idx.GetSequencesSize() ) {
+				throw std::runtime_error{ "Suffix index of another FastIdx, abording" };
+		}
+		if ( depth == 0 || depth > suffixes.MaxDepth() ) {
+				throw std::runtime_error{ "Fragments size over the maximum depth of the suffix index, abording" };
+		}
+
+		// Suffixes of too few valid residues are skipped, the common prefix of a leaf with
+		// the previous one being the least lcp since the previous leaf suffix
+		uint32_t common = 0;
+		for ( size_t i = 0, n = suffixes.Size(); i != n; ++i ) {
+				common = std::min( common, suffixes.GetLcp( i ) );
+				if ( suffixes.GetValidRun( i ) < depth ) {
+						continue;
+				}
+				if ( leafSuffixes.empty() || common < depth ) {
+						nodes.AddLeaf( sequences + suffixes.GetSuffix( i ), leafSuffixes.empty() ? 0 : common );
+						leafSuffixes.push_back( i );
+				}
+				common = depth;
+		}
+		nodes.Finish();
+}
+
+uint64_t SuffixPepTree::GetPackedLeaf( size_t index ) const {
+		if ( Depth() > PepTreeFormat::maxPackedDepth ) {
+				throw std::runtime_error{ "Packed leaves require a depth of at most 12, abording" };
+		}
+		uint64_t word = 0;
+		ForLeaf( index, [&]( char const * str, size_t ) {
+				for ( uint32_t d = 0; d != Depth(); ++d ) {
+						auto code = find( PepTreeFormat::residuesInOrder, PepTreeFormat::residuesInOrder + sizeof( PepTreeFormat::residuesInOrder ) - 1, str[d] )
+						          - PepTreeFormat::residuesInOrder + 1;
+						word = (word << 5) | static_cast< uint64_t >( code );
+				}
+		});
+		return word;
+}
+
+vector< pair< uint32_t, size_t > > const & SuffixPepTree::LeafPositions( size_t index ) const {
+		static thread_local vector< size_t >                     offsets;
+		static thread_local vector< pair< uint32_t, size_t > > positions;
+
+		// the suffixes of a leaf are the ones sharing its first Depth() residues
+		offsets.clear();
+		for ( size_t i = leafSuffixes[index], n = suffixes.Size(); ; ) {
+				offsets.push_back( suffixes.GetSuffix( i ) );
+				if ( ++i == n || suffixes.GetLcp( i ) < Depth() ) {
+						break;
+				}
+		}
+		sort( offsets.begin(), offsets.end() );
+
+		positions.clear();
+		size_t protein = 0;
+		for ( size_t offset : offsets ) {
+				// last protein starting at or before offset, offsets being sorted
+				size_t lo = protein, hi = idx.Size();
+				while ( hi - lo > 1 ) {
+						size_t mid = lo + (hi - lo) / 2;
+						if ( idx.GetSequenceOffset( mid ) <= offset ) {
+								lo = mid;
+						} else {
+								hi = mid;
+						}
+				}
+				protein = lo;
+				positions.emplace_back( static_cast< uint32_t >( protein ), offset - idx.GetSequenceOffset( protein ) );
+		}
+		return positions;
+}
@@ -0,0 +1,164 @@
+#ifndef SUFFIXIDX_HPP
+#define SUFFIXIDX_HPP
+
+#include <cstdio>
+#include <cstdint>
+#include <vector>
+#include <utility>
+
+#include "FastIdx.hpp"
+#include "PepTree.hpp"
+
+// ~~~ SuffixIdx files ~~~ //
+// A SuffixIdx file holds the suffix array of the sequences section of a FastIdx, for
+// the suffixes starting with a valid residue, compared on their valid residues only
+// (up to maxDepth of them).  With the common prefix of every suffix with the previous
+// one, and the number of valid residues it starts with, the sorted fragments of any
+// size up to maxDepth are read from it, as the leaves of the PepTree of that depth:
+//    ["SUFX"][version:u32][maxDepth:u32][suffixSize:u32][nbSuffixes:u64][sequencesSize:u64]
+//    [suffix:u32 or u64...][lcp:u8...][validRun:u8...]
+// suffixes being offsets in the sequences section, of 32 bits when it fits.
+namespace SuffixIdxFormat {
+
+	char     const magic[4]        = { 'S', 'U', 'F', 'X' };
+	uint32_t const currentVersion  = 1;
+	uint32_t const defaultMaxDepth = 64;
+	uint32_t const maxMaxDepth     = 255;   // lcp and valid runs on 8 bits
+
+} // namespace SuffixIdxFormat
+
+// Sorts the suffixes of a FastIdx, by buckets of their first two residues
+class SuffixArray {
+	public:
+		SuffixArray( MMappedFastIdx const & idx, uint32_t maxDepth = SuffixIdxFormat::defaultMaxDepth, size_t nbThreads = 1 );
+
+	public:
+		size_t Size() const {   return suffixes.size();   }
+
+		void Write( FILE * file ) const;
+
+	private:
+		uint32_t maxDepth;
+		size_t   sequencesSize;
+
+		std::vector< uint64_t > suffixes;
+		std::vector< uint8_t >  lcp;
+		std::vector< uint8_t >  validRun;
+};
+
+class MMappedSuffixIdx {
+	public:
+		explicit MMappedSuffixIdx( char const * filename );
+
+		~MMappedSuffixIdx();
+
+	public:
+		uint32_t MaxDepth() const {   return maxDepth;   }
+
+		size_t Size() const {   return nbSuffixes;   }
+
+		size_t GetSequencesSize() const {   return sequencesSize;   }
+
+		size_t GetSuffix( size_t i ) const {
+				return suffixSize == sizeof( uint32_t ) ? reinterpret_cast< uint32_t const * >( ptr + suffixesOffset )[i]
+				                                        : reinterpret_cast< uint64_t const * >( ptr + suffixesOffset )[i];
+		}
+
+		// Common valid residues of the suffix i with the suffix i-1, 0 for the first one
+		uint32_t GetLcp( size_t i ) const {   return reinterpret_cast< uint8_t const * >( ptr + lcpOffset )[i];   }
+
+		uint32_t GetValidRun( size_t i ) const {   return reinterpret_cast< uint8_t const * >( ptr + validRunOffset )[i];   }
+
+		void WriteReadable( FILE * file, MMappedFastIdx const & idx ) const;
+
+	private:
+		int          fd;
+		size_t       fileSize;
+		char const * ptr;
+
+		uint32_t maxDepth;
+		uint32_t suffixSize;
+		size_t   nbSuffixes;
+		size_t   sequencesSize;
+		size_t   suffixesOffset;
+		size_t   lcpOffset;
+		size_t   validRunOffset;
+};
+
+// Depth-k view of a suffix index, traversed as the PepTree of depth k of its FastIdx
+// would be: leaves are the distinct fragments of k valid residues, in the same order
+// and thus with the same indexes, their nodes being laid out as a BitmapPepTree's.
+// Leaf positions are listed from the suffixes of the leaf, by protein and position.
+class SuffixPepTree {
+	public:
+		SuffixPepTree( MMappedSuffixIdx const & suffixes, MMappedFastIdx const & idx, uint32_t depth );
+
+	public:
+		uint32_t Depth() const {   return nodes.Depth();   }
+
+		size_t GetNumberLeaves() const {   return leafSuffixes.size();   }
+
+		size_t GetNodesSize() const {   return nodes.Size();   }
+
+		template< typename F >
+		inline void ForNodeChildren( size_t index, F && f ) const {
+				nodes.ForNodeChildren( index, std::forward< F >( f ) );
+		}
+
+		// Leaf strings are not NUL terminated, only their Depth() residues are to be read;
+		// the offset of a leaf positions is its index
+		template< typename F >
+		inline void ForLeaf( size_t index, F && f ) const {
+				f( sequences + suffixes.GetSuffix( leafSuffixes[index] ), index );
+		}
+
+		template< typename F >
+		inline void ForLeafRange( size_t start, size_t stop, F && f ) const {
+				for ( ; start < stop; ++start ) {
+						ForLeaf( start, std::forward< F >( f ) );
+				}
+		}
+
+		// Same calls as MMappedPepTree::ForLeafPos, returns the number of positions
+		template< typename F >
+		inline size_t ForLeafPos( size_t index, F && f ) const {
+				auto & positions = LeafPositions( index );
+				size_t nbProteins = 0;
+				for ( size_t i = 0; i != positions.size(); ++i ) {
+						nbProteins += i == 0 || positions[i].first != positions[i-1].first;
+				}
+				f.ListSize( nbProteins );
+				for ( size_t i = 0; i != positions.size(); ) {
+						size_t end = i;
+						while ( end != positions.size() && positions[end].first == positions[i].first ) {
+								++end;
+						}
+						f.AddHeader( positions[i].first, end - i );
+						for ( ; i != end; ++i ) {
+								f.AddPos( positions[i].second );
+						}
+						f.StopPos();
+				}
+				f.StopHeader();
+				return positions.size();
+		}
+
+		bool HasPackedLeaves() const {   return false;   }
+
+		uint64_t GetPackedLeaf( size_t index ) const;
+
+	private:
+		MMappedSuffixIdx const & suffixes;
+		MMappedFastIdx   const & idx;
+		char             const * sequences;
+
+		std::vector< size_t > leafSuffixes;   // first suffix of every leaf
+		BitmapNodes           nodes;
+
+	private:
+		// (protein, position) of the suffixes of the leaf, sorted; valid until the next call
+		// of the thread
+		std::vector< std::pair< uint32_t, size_t > > const & LeafPositions( size_t index ) const;
+};
+
+#endif
@@ -0,0 +1,113 @@
+#include <cstdio>
+#include <string>
+#include <sstream>
+#include <chrono>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <stdexcept>
+
+#include "FastIdx.hpp"
+#include "SuffixIdx.hpp"
+
+using namespace std;
+
+void UsageError( char * argv[] ) {
+		fprintf( stderr
+		       , "Usage: %s [options] -c input-FastIdx-file\n"
+		         "          create the suffix index of the input FastIdx file, usable in place of its PepTrees of any\n"
+		         "          depth up to the maximum one\n"
+		         "   where options are:\n"
+		         "     --max-depth d  -> longest fragments the index serves, from 1 to 255 (default: %u)\n"
+		         "     -j threads     -> number of sorting threads (default: 1)\n"
+		         "   or: %s -d suffixIdx-file\n"
+		         "          print the maximum depth and number of suffixes of the index\n"
+		         "   or: %s -v suffixIdx-file input-FastIdx-file\n"
+		         "          print the index in human 'interpretable' format\n"
+		       , argv[0], SuffixIdxFormat::defaultMaxDepth, argv[0], argv[0]
+		       );
+		exit( 1 );
+}
+
+void SuffixIdxCreation( char const * fastIdxFilename, uint32_t maxDepth, size_t nbThreads ) {
+		MMappedFastIdx idx( fastIdxFilename );
+
+		ostringstream outputFilenameStream;
+		outputFilenameStream << fastIdxFilename << ".sufIdx";
+		auto outputFile = fopen( outputFilenameStream.str().c_str(), "wb" );
+		if ( !outputFile ) {
+				fprintf( stderr, "Unable to open output file \"%s\"\n", outputFilenameStream.str().c_str() );
+				exit( 1 );
+		}
+
+		printf( "Creating suffix index of maximum depth %u from \"%s\"...\n", maxDepth, fastIdxFilename );
+		try {
+				auto startTimer = chrono::high_resolution_clock::now();
+
+				SuffixArray suffixes( idx, maxDepth, nbThreads );
+
+				auto finishTimer = chrono::high_resolution_clock::now();
+				auto elapsed1 = finishTimer - startTimer;
+				printf( "   ...%zu suffix%s sorted in %ld seconds.\n"
+				      , suffixes.Size(), suffixes.Size() > 1 ? "es" : ""
+				      , chrono::duration_cast< chrono::seconds >( elapsed1 ).count()
+				      );
+
+				suffixes.Write( outputFile );
+				fclose( outputFile );
+		} catch( std::exception & e ) {
+				fprintf( stderr, "%s\n", e.what() );
+				exit( 1 );
+		}
+}
+
+int main( int argc, char * argv[] ) {
+		uint32_t maxDepth  = SuffixIdxFormat::defaultMaxDepth;
+		size_t   nbThreads = 1;
+		int argi = 1;
+		while ( argi < argc ) {
+				if ( argc - argi > 1 && strcmp( argv[ argi ], "--max-depth" ) == 0 && atoi( argv[ argi+1 ] ) > 0 ) {
+						maxDepth = static_cast< uint32_t >( atoi( argv[ argi+1 ] ) );
+						argi += 2;
+				} else if ( argc - argi > 1 && strcmp( argv[ argi ], "-j" ) == 0 && atoi( argv[ argi+1 ] ) > 0 ) {
+						nbThreads = static_cast< size_t >( atoi( argv[ argi+1 ] ) );
+						argi += 2;
+				} else {
+						break;
+				}
+		}
+		if ( argc - argi < 2 || argc - argi > 3 || argv[ argi ][ 0 ] != '-' || strlen( argv[ argi ] ) != 2 ) {
+				UsageError( argv );
+		}
+
+		try {
+				switch ( argv[ argi ][ 1 ] ) {
+					case 'c': {
+							if ( argc - argi != 2 ) {
+									UsageError( argv );
+							}
+							SuffixIdxCreation( argv[ argi+1 ], maxDepth, nbThreads );
+					} break;
+					case 'd': {
+							if ( argc - argi != 2 || argi != 1 ) {
+									UsageError( argv );
+							}
+							MMappedSuffixIdx suffixes( argv[ argi+1 ] );
+							fprintf( stdout, "Maximum depth: %u\nSuffixes: %zu\n", suffixes.MaxDepth(), suffixes.Size() );
+					} break;
+					case 'v': {
+							if ( argc - argi != 3 || argi != 1 ) {
+									UsageError( argv );
+							}
+							MMappedSuffixIdx suffixes( argv[ argi+1 ] );
+							MMappedFastIdx   idx( argv[ argi+2 ] );
+							suffixes.WriteReadable( stdout, idx );
+					} break;
+					default: UsageError( argv );
+				}
+		} catch( std::exception & e ) {
+				fprintf( stderr, "%s\n", e.what() );
+				return 1;
+		}
+		return 0;
+}
@@ -0,0 +1,107 @@
+#ifndef THREADPOOL_HPP
+#define THREADPOOL_HPP
+
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <exception>
+
+// Runs a fixed set of indexed tasks on nbThreads workers.  Each worker owns a
+// contiguous slice of the task indices which it consumes front to back (so
+// that tasks roughly complete in index order), and steals from the back of
+// the other workers' slices once its own is exhausted.
+class WorkStealingPool {
+	public:
+		explicit WorkStealingPool( size_t nbThreads_ )
+			: nbThreads( nbThreads_ > 0 ? nbThreads_ : 1 ) {
+		}
+
+	public:
+		size_t NumThreads() const {   return nbThreads;   }
+
+		// Calls f( workerIndex, taskIndex ) for every taskIndex in [0, nbTasks),
+		// returns once every task has completed.  The first exception thrown by
+		// a task is rethrown here, the remaining tasks are abandoned.
+		template< typename F >
+		void Run( size_t nbTasks, F && f ) {
+				std::vector< WorkerQueue > queues( nbThreads );
+				for ( size_t w = 0; w != nbThreads; ++w ) {
+						for ( size_t t = w*nbTasks/nbThreads, e = (w+1)*nbTasks/nbThreads; t != e; ++t ) {
+								queues[w].tasks.push_back( t );
+						}
+				}
+
+				std::mutex         errorMutex;
+				std::exception_ptr error;
+				bool               abort = false;
+
+				auto Worker = [&]( size_t w ) {
+						size_t task;
+						while ( Pop( queues, w, task ) ) {
+								{
+										std::lock_guard< std::mutex > lock( errorMutex );
+										if ( abort ) {
+												return;
+										}
+								}
+								try {
+										f( w, task );
+								} catch ( ... ) {
+										std::lock_guard< std::mutex > lock( errorMutex );
+										if ( !error ) {
+												error = std::current_exception();
+										}
+										abort = true;
+										return;
+								}
+						}
+				};
+
+				std::vector< std::thread > threads;
+				for ( size_t w = 1; w < nbThreads; ++w ) {
+						threads.emplace_back( Worker, w );
+				}
+				Worker( 0 );
+				for ( auto & t : threads ) {
+						t.join();
+				}
+
+				if ( error ) {
+						std::rethrow_exception( error );
+				}
+		}
+
+	private:
+		struct WorkerQueue {
+				std::mutex           mutex;
+				std::deque< size_t > tasks;
+		};
+
+		static bool Pop( std::vector< WorkerQueue > & queues, size_t w, size_t & task ) {
+				{
+						std::lock_guard< std::mutex > lock( queues[w].mutex );
+						if ( !queues[w].tasks.empty() ) {
+								task = queues[w].tasks.front();
+								queues[w].tasks.pop_front();
+								return true;
+						}
+				}
+				for ( size_t i = 1, e = queues.size(); i < e; ++i ) {
+						auto & victim = queues[(w + i) % e];
+						std::lock_guard< std::mutex > lock( victim.mutex );
+						if ( !victim.tasks.empty() ) {
+								task = victim.tasks.back();
+								victim.tasks.pop_back();
+								return true;
+						}
+				}
+				return false;
+		}
+
+	private:
+		size_t nbThreads;
+};
+
+#endif